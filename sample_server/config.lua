@@ -26,6 +26,23 @@ cloud = {
 	-- Disk buffer size (in bytes). Default is 1024 * 640 = 640 KiB.
 	data_buffer_size = 1024 * 640,
 
+	-- How the server handles client connections. Could be omitten, default is "threads".
+	-- "threads" - every connection is served by its own thread.
+	-- "epoll" - connections are shared between a fixed number of event loops, which is much cheaper for many idle clients.
+	io_model = "threads",
+
+	-- Number of event loops for the "epoll" IO model. Default is 0, which means the number of CPU cores.
+	event_loops = 0,
+
+	-- Number of threads executing read-only requests (listing, node info, ...) so that the requests pipelined by one client
+	-- run in parallel, the responses may then come out of order. Default is 0, which means every request is executed
+	-- by the thread which reads it.
+	request_workers = 0,
+
+	-- Number of node heads (type, rights, group, parent) kept in memory, so that metadata requests do not read them from
+	-- the disk every time. Default is 65536, 0 disables the cache.
+	node_cache_size = 65536,
+
 }
 
 
@@ -35,6 +52,29 @@ launcher = {
 	-- The port which the server will run on. Default is 909.
 	server_port = 909,
 
+	-- Number of listening sockets sharing the port (SO_REUSEPORT), each accepted by its own thread pinned to a CPU core.
+	-- Spreads connection bursts over the cores. Default is 1, 0 means the number of CPU cores. Ignored with io_uring.
+	acceptors = 1,
+
+	-- Serve plain TCP connections through io_uring, which batches socket and disk operations of long transfers. Default is false.
+	-- Can't be used together with SSL. If the kernel doesn't support io_uring, the server falls back to the "epoll" IO model.
+	io_uring = false,
+
+	-- Additional unix domain socket listener for clients on the same host, they connect with 'cloud9 --unix=PATH'.
+	-- To enable it, uncomment 'unix' table the same way as the 'ssl' table below.
+	--[[
+	unix = {
+
+		-- Socket path, a stale socket at this path is replaced, any other existing file makes the server refuse to start
+		path = "cloud9.sock",
+
+		-- Opt-in: log in processes running as the same system user as the server without checking the password.
+		-- Such a process may then log in as any user. Default is false.
+		trust_owner = false,
+
+	},
+	--]]
+
 	-- You could run server on bare TCP or with SSL, the following table is here to set up the SSL options.
 	-- To enable SSL, put your SSL certificate and private key in the working directory, then uncomment 'ssl' table (just put the space between '-' and '[' in the next line) and set up the options for appropriate values.
 	--[[
@@ -49,6 +89,17 @@ launcher = {
 		-- SSL private key password. Can be omitten, default is nil, which means that the password will be prompted (if necessary)
 		-- password = "PASSWORD",
 
+		-- Kernel TLS offload, lets file downloads be sent with sendfile without user space encryption. Default is false.
+		-- Needs the kernel 'tls' module, otherwise the server falls back to user space TLS.
+		-- ktls = true,
+
+		-- Maximum number of TLS sessions kept by the server for resumption. 0 disables the cache. Default is 20480.
+		-- session_cache_size = 20480,
+
+		-- Session tickets let clients resume TLS sessions without a full handshake. Their encryption keys are rotated every
+		-- 'ticket_key_lifetime' seconds, tickets issued with the previous key are still accepted. 0 disables tickets. Default is 3600.
+		-- ticket_key_lifetime = 3600,
+
 	},
 	--]]
 }
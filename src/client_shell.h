@@ -7,6 +7,11 @@
 #include <iomanip>
 #include <filesystem>
 #include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
 #include "cloud_common.h"
 #include "cloud_client.h"
 
@@ -42,77 +47,8 @@ std::string parse_command(const std::string &command, std::vector<std::string> &
     return "";
 }
 
-bool is_absolute_path(const std::string &path) {
-    return path[0] == CLOUD_PATH_HOME || path[0] == CLOUD_PATH_NODE;
-}
-
-std::string get_absolute_path_base(const std::string &path) {
-    return path.substr(0, path.find(CLOUD_PATH_DIV));
-}
-
-Node get_absolute_path_base_node(CloudClient *client, const std::string &base) {
-    if (base[0] == CLOUD_PATH_NODE) {
-        return string2node(base.substr(1));
-    } else if (base[0] == CLOUD_PATH_HOME) {
-        return client->get_home(base.substr(1));
-    } else throw std::invalid_argument("invalid base " + base);
-}
-
-Node get_relative_path_node(CloudClient *client, Node base, const std::string &path) {
-    std::vector<std::string> parts;
-    size_t start = 0;
-    for (size_t pos = 0; pos < path.length(); pos++) {
-        if (path[pos] == '/') {
-            parts.push_back(path.substr(start, pos - start));
-            start = pos + 1;
-        }
-    }
-    parts.push_back(path.substr(start, path.size()));
-    Node current = base;
-    for (const std::string &part : parts) {
-        if (part.empty()) continue;
-        else if (part == "..") client->get_parent(current, &current);
-        else {
-            bool found = false;
-            client->list_directory(current, [&](const std::string &name, Node child) {
-                if (name == part) {
-                    found = true;
-                    current = child;
-                }
-            });
-            if (!found) throw std::runtime_error("'" + part + "' not found");
-        }
-    }
-    return current;
-}
-
 Node get_path_node(CloudClient *client, Node cwd, const std::string &path) {
-    if (is_absolute_path(path)) {
-        std::string base = get_absolute_path_base(path);
-        return get_relative_path_node(client, get_absolute_path_base_node(client, base), path.substr(base.length()));
-    } else return get_relative_path_node(client, cwd, path);
-}
-
-std::string get_node_path(CloudClient *client, Node node) {
-    Node parent;
-    bool has_parent;
-    has_parent = client->get_parent(node, &parent);
-    if (has_parent) {
-        std::string name;
-        try {
-            client->list_directory(parent, [&name, node](const std::string &child_name, Node child) {
-                if (child == node)
-                    name = child_name;
-            });
-        } catch (CloudRequestError &error) {
-            if (error.status == REQUEST_ERR_FORBIDDEN)
-                return get_node_path(client, parent) + CLOUD_PATH_DIV + CLOUD_PATH_UNKNOWN;
-            else throw;
-        }
-        return get_node_path(client, parent) + CLOUD_PATH_DIV + name;
-    } else {
-        return "";
-    }
+    return client->resolve_path(cwd, path);
 }
 
 #define PROGRESSBAR_SIZE 20
@@ -150,17 +86,164 @@ void print_loading_status(size_t done, size_t all, size_t start_time) {
 }
 
 #define STATUS_DELAY 500
+#define STRIPE_MIN_SIZE (16 * 1024 * 1024)
+
+// opens another authenticated session to the server, used by striped transfers
+typedef std::function<std::pair<NetConnection *, CloudClient *>()> Connector;
 
-void put_file(CloudClient *client, const std::string &src, Node dst, bool info, size_t block_size) {
+// the sessions of a striped transfer, the shell's own session comes first and is kept open
+struct StripeSessions {
+    std::vector<CloudClient *> clients;
+    std::vector<NetConnection *> connections;
+
+    StripeSessions(CloudClient *client, const Connector &connect, size_t count) : clients{client} {
+        try {
+            while (clients.size() < count) {
+                auto session = connect();
+                connections.push_back(session.first);
+                clients.push_back(session.second);
+            }
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    StripeSessions(const StripeSessions &) = delete;
+
+    void release() {
+        for (size_t i = 0; i < connections.size(); i++) {
+            delete clients[i + 1];
+            connections[i]->close();
+            delete connections[i];
+        }
+        clients.resize(1);
+        connections.clear();
+    }
+
+    ~StripeSessions() {
+        release();
+    }
+};
+
+// uploads the file over several sessions at once, the ranges are read from the local file in place
+void put_file_striped(const std::vector<CloudClient *> &clients, const std::string &src, Node dst, bool info,
+                      size_t block_size, uint64_t offset) {
+    uint64_t size = std::filesystem::file_size(src);
+    int file = open(src.c_str(), O_RDONLY);
+    if (file == -1) throw std::runtime_error("failed to open '" + src + "'");
+    // shared writers never truncate the remote file
+    if (!offset) clients[0]->fd_close(clients[0]->fd_open(dst, NODE_FD_MODE_WRITE));
+    std::atomic<uint64_t> done = offset;
+    // the first position that could not be read from the local file, the upload is cut there on failure
+    std::atomic<uint64_t> unread = size;
+    uint64_t written = offset;
+    std::mutex status_lock;
+    auto start_time = get_current_time_ms();
+    size_t last_status_time = start_time;
+    auto source = [&](uint64_t position, uint32_t n, char *buffer) {
+        uint32_t got = 0;
+        while (got < n) {
+            ssize_t read = pread(file, buffer + got, n - got, off_t(position + got));
+            if (read <= 0) break;
+            got += read;
+        }
+        if (got < n) {
+            // the stream has to be completed anyway, the zeros are cut off below
+            std::memset(buffer + got, 0, n - got);
+            uint64_t expected = unread;
+            while (position + got < expected && !unread.compare_exchange_weak(expected, position + got));
+        }
+        done += n;
+        std::unique_lock<std::mutex> locker(status_lock, std::try_to_lock);
+        if (info && locker && get_current_time_ms() - last_status_time > STATUS_DELAY) {
+            print_loading_status(done, size, start_time);
+            last_status_time = get_current_time_ms();
+        }
+    };
+    try {
+        CloudClient::striped_write(clients, dst, offset, size - offset, block_size, source, &written);
+        if (unread < size) throw std::runtime_error("failed to read '" + src + "'");
+    } catch (...) {
+        ::close(file);
+        // a partial striped upload has holes, it is cut at the end of the data written without them,
+        // so that put -c goes on from there
+        try {
+            uint8_t fd = clients[0]->fd_open(dst, NODE_FD_MODE_WRITE | NODE_FD_MODE_NO_TRUNCATE);
+            clients[0]->fd_truncate(fd, std::min(written, unread.load()));
+            clients[0]->fd_close(fd);
+        } catch (...) {}
+        throw;
+    }
+    ::close(file);
+    if (info) {
+        print_loading_status(size, size, start_time);
+        std::cout << std::endl;
+    }
+}
+
+// downloads the file over several sessions at once, the ranges are written to the local file in place
+void get_file_striped(const std::vector<CloudClient *> &clients, Node src, uint64_t size, const std::string &dst,
+                      bool info, size_t block_size, uint64_t offset) {
+    int file = open(dst.c_str(), O_WRONLY | O_CREAT | (offset ? 0 : O_TRUNC), 0644);
+    if (file == -1) throw std::runtime_error("failed to open '" + dst + "'");
+    std::atomic<uint64_t> done = offset;
+    // the end of the data written without holes, a failed download is cut there so that it can be resumed
+    std::atomic<uint64_t> contiguous = offset;
+    std::atomic<bool> failed = false;
+    std::mutex status_lock;
+    auto start_time = get_current_time_ms();
+    size_t last_status_time = start_time;
+    auto sink = [&](uint64_t position, uint32_t n, const char *buffer) {
+        uint32_t written = 0;
+        while (!failed && written < n) {
+            ssize_t result = pwrite(file, buffer + written, n - written, off_t(position + written));
+            if (result <= 0) failed = true;
+            else written += result;
+        }
+        if (!failed) {
+            uint64_t expected = position;
+            contiguous.compare_exchange_strong(expected, position + n);
+        }
+        done += n;
+        std::unique_lock<std::mutex> locker(status_lock, std::try_to_lock);
+        if (info && locker && get_current_time_ms() - last_status_time > STATUS_DELAY) {
+            print_loading_status(done, size, start_time);
+            last_status_time = get_current_time_ms();
+        }
+    };
+    try {
+        CloudClient::striped_read(clients, src, offset, size - offset, block_size, sink);
+        if (failed) throw std::runtime_error("failed to write '" + dst + "'");
+    } catch (...) {
+        if (ftruncate(file, off_t(contiguous.load())) == -1) std::cerr << "get: failed to truncate " << dst << std::endl;
+        ::close(file);
+        throw;
+    }
+    ::close(file);
+    if (info) {
+        print_loading_status(size, size, start_time);
+        std::cout << std::endl;
+    }
+}
+
+// uploads the file starting from offset, the remote content before it is kept
+void put_file(CloudClient *client, const std::string &src, Node dst, bool info, size_t block_size,
+              uint64_t offset = 0, const std::vector<CloudClient *> &stripes = {}) {
     size_t size = std::filesystem::file_size(src);
+    if (stripes.size() > 1 && size - offset >= STRIPE_MIN_SIZE) {
+        put_file_striped(stripes, src, dst, info, block_size, offset);
+        return;
+    }
     std::ifstream stream(src);
-    auto fd = client->fd_open(dst, NODE_FD_MODE_WRITE);
+    stream.seekg(offset);
+    auto fd = client->fd_open(dst, offset ? NODE_FD_MODE_WRITE | NODE_FD_MODE_NO_TRUNCATE : NODE_FD_MODE_WRITE);
     char *buffer = new char[block_size];
-    size_t done = 0;
+    size_t done = offset;
     auto start_time = get_current_time_ms();
     size_t last_status_time = start_time;
     try {
-        client->fd_write_long(fd, size, buffer, [&]() -> uint32_t {
+        client->fd_pwrite_long(fd, offset, size - offset, buffer, [&]() -> uint32_t {
             if (info) {
                 if (get_current_time_ms() - last_status_time > STATUS_DELAY) {
                     print_loading_status(done, size, start_time);
@@ -182,40 +265,97 @@ void put_file(CloudClient *client, const std::string &src, Node dst, bool info,
     if (info) std::cout << std::endl;
 }
 
+#define PUT_BATCH_FILE_MAX_SIZE (64 * 1024)
+#define PUT_BATCH_MAX_SIZE (1024 * 1024)
+
+// uploads small files in batches, one round trip per batch instead of four per file
+void put_small_files(CloudClient *client, const std::vector<std::string> &files, Node dst_dir, bool info,
+                     const std::string &dst_dir_path) {
+    CloudBatch batch;
+    auto send_batch = [&]() {
+        if (batch.count()) client->batch(batch);
+        batch = CloudBatch();
+    };
+    for (auto &file : files) {
+        std::string name = std::filesystem::path(file).filename();
+        std::ifstream stream(file);
+        std::string data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+        if (batch.size() + data.size() > PUT_BATCH_MAX_SIZE) send_batch();
+        if (info) std::cout << file << "\t-->\t" << dst_dir_path << name << std::endl;
+        auto node = batch.make_node(dst_dir, name, NODE_TYPE_FILE);
+        auto fd = batch.fd_open(node, NODE_FD_MODE_WRITE);
+        if (!data.empty()) batch.fd_write(fd, data.size(), data.c_str());
+        batch.fd_close(fd);
+    }
+    send_batch();
+}
+
+bool find_child(CloudClient *client, Node dir, const std::string &name, Node &child) {
+    bool found = false;
+    client->list_directory(dir, [&](const std::string &child_name, Node child_node) {
+        if (child_name == name) {
+            found = true;
+            child = child_node;
+        }
+    });
+    return found;
+}
+
 void put_node(CloudClient *client, const std::string &file, Node dst_dir, bool info, size_t block_size, bool recursive,
-              const std::string &dst_dir_path) {
+              const std::string &dst_dir_path, bool resume = false, const std::vector<CloudClient *> &stripes = {}) {
     std::string name = std::filesystem::absolute(std::filesystem::path(file)).filename();
     if (!std::filesystem::exists(file)) {
         std::cerr << "put: '" << file << "' does not exist" << std::endl;
         return;
     }
+    Node dst;
+    bool exists = resume && find_child(client, dst_dir, name, dst);
     if (std::filesystem::is_regular_file(file)) {
         if (info) std::cout << file << "\t-->\t" << dst_dir_path << name << std::endl;
-        Node dst = client->make_node(dst_dir, name, NODE_TYPE_FILE);
-        put_file(client, file, dst, info, block_size);
+        uint64_t offset = 0;
+        if (exists) {
+            offset = client->get_node_info(dst).size;
+            if (offset > std::filesystem::file_size(file)) throw std::runtime_error("remote file is larger");
+        } else dst = client->make_node(dst_dir, name, NODE_TYPE_FILE);
+        put_file(client, file, dst, info, block_size, offset, stripes);
     } else if (std::filesystem::is_directory(file)) {
         if (recursive) {
             if (info) std::cout << "mkdir " << dst_dir_path << name << std::endl;
-            Node dst = client->make_node(dst_dir, name, NODE_TYPE_DIRECTORY);
+            if (!exists) dst = client->make_node(dst_dir, name, NODE_TYPE_DIRECTORY);
+            std::vector<std::string> small_files;
             for (const auto &child : std::filesystem::directory_iterator(file)) {
-                put_node(client, child.path(), dst, info, block_size, recursive, dst_dir_path + name + CLOUD_PATH_DIV);
+                // resumed uploads check every file, so they are not batched
+                if (!resume && child.is_regular_file() && child.file_size() <= PUT_BATCH_FILE_MAX_SIZE) {
+                    small_files.push_back(child.path());
+                } else {
+                    put_node(client, child.path(), dst, info, block_size, recursive,
+                             dst_dir_path + name + CLOUD_PATH_DIV, resume, stripes);
+                }
             }
+            put_small_files(client, small_files, dst, info, dst_dir_path + name + CLOUD_PATH_DIV);
         } else std::cout << "put: non-recursive, skipping directory " << file << std::endl;
     } else {
         std::cout << "put: skipping other file " << file << std::endl;
     }
 }
 
-void get_file(CloudClient *client, Node src, const std::string &dst, bool info, size_t block_size) {
+// downloads the file starting from offset, the local content before it is kept
+void get_file(CloudClient *client, Node src, const std::string &dst, bool info, size_t block_size,
+              uint64_t offset = 0, const std::vector<CloudClient *> &stripes = {}) {
     NodeInfo node_info = client->get_node_info(src);
-    std::ofstream stream(dst);
+    if (offset > node_info.size) throw std::runtime_error("local file is larger");
+    if (stripes.size() > 1 && node_info.size - offset >= STRIPE_MIN_SIZE) {
+        get_file_striped(stripes, src, node_info.size, dst, info, block_size, offset);
+        return;
+    }
+    std::ofstream stream(dst, offset ? std::ios_base::app : std::ios_base::trunc);
     auto fd = client->fd_open(src, NODE_FD_MODE_READ);
-    size_t done = 0;
+    size_t done = offset;
     auto start_time = get_current_time_ms();
     size_t last_status_time = start_time;
     char *buffer = new char[block_size];
     try {
-        client->fd_read_long(fd, node_info.size, buffer, block_size, [&](uint32_t read) {
+        client->fd_pread_long(fd, offset, node_info.size - offset, buffer, block_size, [&](uint32_t read) {
             stream.write(buffer, read);
             done += read;
             if (info) {
@@ -236,63 +376,82 @@ void get_file(CloudClient *client, Node src, const std::string &dst, bool info,
 }
 
 void get_node(CloudClient *client, Node node, const std::string &dst_dir, bool info, size_t block_size, bool recursive,
-              const std::string &node_path, const std::string &node_name) {
+              const std::string &node_path, const std::string &node_name, bool resume = false,
+              const std::vector<CloudClient *> &stripes = {}) {
     NodeInfo node_info = client->get_node_info(node);
     if (node_info.type == NODE_TYPE_FILE) {
         if (info) std::cout << dst_dir << node_name << "\t<--\t" << node_path << std::endl;
-        if (std::filesystem::exists(dst_dir + node_name)) throw std::runtime_error("file exists");
-        get_file(client, node, dst_dir + node_name, info, block_size);
+        uint64_t offset = 0;
+        if (std::filesystem::exists(dst_dir + node_name)) {
+            if (!resume) throw std::runtime_error("file exists");
+            offset = std::filesystem::file_size(dst_dir + node_name);
+        }
+        get_file(client, node, dst_dir + node_name, info, block_size, offset, stripes);
     } else if (node_info.type == NODE_TYPE_DIRECTORY) {
         if (recursive) {
             if (info) std::cout << "mkdir " << dst_dir << node_name << std::endl;
             std::filesystem::create_directory(dst_dir + node_name);
-            client->list_directory(node, [=](const std::string &child_name, Node child) {
+            client->list_directory(node, [=, &stripes](const std::string &child_name, Node child) {
                 get_node(client, child, dst_dir + node_name + PATH_DIV, info, block_size, recursive,
-                         node_path + CLOUD_PATH_DIV + child_name, child_name);
+                         node_path + CLOUD_PATH_DIV + child_name, child_name, resume, stripes);
             });
         } else std::cout << "get: non-recursive, skipping directory " << node_path << std::endl;
     }
 }
 
 std::string get_node_name(CloudClient *client, Node node) {
-    Node parent;
-    if (client->get_parent(node, &parent)) {
-        std::string name;
-        client->list_directory(parent, [&name, node](const std::string &child_name, Node child) {
-            if (child == node) {
-                name = child_name;
-            }
-        });
-        return name;
-    } else {
-        return CLOUD_PATH_HOME + client->get_node_owner(node);
-    }
+    std::string path = client->get_node_path(node);
+    auto div = path.find_last_of(CLOUD_PATH_DIV);
+    return div == std::string::npos ? path : path.substr(div + 1);
 }
 
-std::string node_desc(CloudClient *client, Node node, bool hidden, bool long_list) {
+std::string entry_desc(const DirectoryEntry &entry, bool hidden, bool long_list) {
     std::string result;
-    std::string name = get_node_name(client, node);;
-    if (name.find('.') == 0 && !hidden) return "";
-    NodeInfo info = client->get_node_info(node);
+    if (entry.name.find('.') == 0 && !hidden) return "";
     if (long_list) {
-        if (info.type == NODE_TYPE_FILE) result += '-';
-        else if (info.type == NODE_TYPE_DIRECTORY) result += 'd';
+        if (entry.info.type == NODE_TYPE_FILE) result += '-';
+        else if (entry.info.type == NODE_TYPE_DIRECTORY) result += 'd';
         else result += '?';
-        result += rights2string(info.rights);
+        result += rights2string(entry.info.rights);
         result += '\t';
-        result += client->get_node_group(node);
+        result += entry.group;
         result += '\t';
-        std::string size_s = std::to_string(info.size);
+        std::string size_s = std::to_string(entry.info.size);
         result += size_s;
         result += '\t';
         if (size_s.length() < 8) result += '\t';
     }
-    result += name;
-    if (info.type == NODE_TYPE_DIRECTORY) result += CLOUD_PATH_DIV;
+    result += entry.name;
+    if (entry.info.type == NODE_TYPE_DIRECTORY) result += CLOUD_PATH_DIV;
     result += '\n';
     return result;
 }
 
+std::string node_desc(CloudClient *client, Node node, bool hidden, bool long_list) {
+    DirectoryEntry entry;
+    entry.node = node;
+    entry.name = get_node_name(client, node);
+    entry.info = client->get_node_info(node);
+    if (long_list) entry.group = client->get_node_group(node);
+    return entry_desc(entry, hidden, long_list);
+}
+
+// reports the nodes a recursive request failed on
+void print_tree_failures(CloudClient *client, const std::string &command, const TreeResult &result) {
+    for (auto &[node, status] : result.failures) {
+        std::string path;
+        try {
+            path = client->get_node_path(node);
+        } catch (CloudRequestError &) {
+            path = CLOUD_PATH_NODE + node2string(node);
+        }
+        std::cerr << command << ": " << path << ": " << request_status_string(status) << std::endl;
+    }
+    if (result.failed > result.failures.size()) {
+        std::cerr << command << ": " << result.failed - result.failures.size() << " more failed" << std::endl;
+    }
+}
+
 void list_commands() {
     std::cout << "Available commands:" << std::endl;
     std::cout << " " << "ls" "\t\t" "cd" "\t\t" "pwd" << std::endl;
@@ -355,7 +514,9 @@ void print_help(std::string cmd) {
         std::cout << "\t" " Options:" << std::endl;
         std::cout << "\t" "  " "-r" "\t" "operate recursively" << std::endl;
         std::cout << "\t" "  " "-s" "\t" "operate silently" << std::endl;
+        std::cout << "\t" "  " "-c" "\t" "continue interrupted uploads of the files which exist remotely" << std::endl;
         std::cout << "\t" "  " "-b=<N>" "\t" "read up to N bytes at a time, default is 640 KiB" << std::endl;
+        std::cout << "\t" "  " "-p=<N>" "\t" "transfer files of 16 MiB or more over N connections at once" << std::endl;
     }
     if (all | cmd == "get") {
         ok = true;
@@ -364,7 +525,9 @@ void print_help(std::string cmd) {
         std::cout << "\t" " Options:" << std::endl;
         std::cout << "\t" "  " "-r" "\t" "operate recursively" << std::endl;
         std::cout << "\t" "  " "-s" "\t" "operate silently" << std::endl;
+        std::cout << "\t" "  " "-c" "\t" "continue interrupted downloads of the files which exist locally" << std::endl;
         std::cout << "\t" "  " "-b=<N>" "\t" "write up to N bytes at a time, default is 640 KiB" << std::endl;
+        std::cout << "\t" "  " "-p=<N>" "\t" "transfer files of 16 MiB or more over N connections at once" << std::endl;
     }
     if (all | cmd == "chmod") {
         ok = true;
@@ -392,9 +555,9 @@ void print_help(std::string cmd) {
     }
     if (all | cmd == "rm") {
         ok = true;
-        std::cout << "rm <NODES>..." << std::endl;
+        std::cout << "rm [-r] <NODES>..." << std::endl;
         std::cout << "\t" << "Remove NODES" << std::endl;
-        std::cout << "\t" << " Non-empty directories removal is unsupported" << std::endl;
+        std::cout << "\t" << " Non-empty directories are only removed with -r" << std::endl;
     }
     if (all | cmd == "chown") {
         ok = true;
@@ -409,8 +572,9 @@ void print_help(std::string cmd) {
     }
     if (all | cmd == "cp") {
         ok = true;
-        std::cout << "cp <NODE> <NAME>" << std::endl;
+        std::cout << "cp [-r] <NODE> <NAME>" << std::endl;
         std::cout << "\t" "Create NODE's clone with name NAME" << std::endl;
+        std::cout << "\t" " Non-empty directories are only copied with -r" << std::endl;
     }
     if (all | cmd == "rn") {
         ok = true;
@@ -430,7 +594,8 @@ void print_help(std::string cmd) {
     if (!ok) std::cerr << "help: no such command '" << cmd << "'" << std::endl;
 }
 
-int shell(CloudClient *client, NetConnection *connection, const std::string &login, const std::string &host) {
+int shell(CloudClient *client, NetConnection *connection, const std::string &login, const std::string &host,
+          const Connector &connect) {
     const std::map<std::string, std::function<void(CloudClient *, Node &, std::vector<std::string> &)>> commands{
             {"ls",   [](CloudClient *client, Node &cwd, std::vector<std::string> &args) {
                 std::string target;
@@ -459,14 +624,14 @@ int shell(CloudClient *client, NetConnection *connection, const std::string &log
                 }
                 if (target.empty() || target.find(CLOUD_PATH_DIV) == target.length() - 1) {
                     Node node = target.empty() ? cwd : get_path_node(client, cwd, target);
-                    std::vector<std::pair<std::string, Node>> children;
-                    client->list_directory(node, [&](const std::string &name, Node child) {
-                        children.emplace_back(name, child);
+                    std::vector<DirectoryEntry> entries;
+                    client->list_directory_plus(node, [&entries](const DirectoryEntry &entry) {
+                        entries.push_back(entry);
                     });
-                    std::sort(children.begin(), children.end());
-                    for (auto[name, child] : children) {
-                        std::cout << node_desc(client, child, hidden, long_list);
-                    }
+                    std::sort(entries.begin(), entries.end(), [](const DirectoryEntry &a, const DirectoryEntry &b) {
+                        return a.name < b.name;
+                    });
+                    for (auto &entry : entries) std::cout << entry_desc(entry, hidden, long_list);
                 } else {
                     std::cout << node_desc(client, get_path_node(client, cwd, target), hidden, long_list);
                 }
@@ -481,8 +646,7 @@ int shell(CloudClient *client, NetConnection *connection, const std::string &log
             {"pwd",   [](CloudClient *client, Node &cwd, std::vector<std::string> &args) {
                 if (!args.empty()) std::cerr << "pwd: too many arguments" << std::endl;
                 else {
-                    std::cout << CLOUD_PATH_HOME << client->get_node_owner(cwd) << get_node_path(client, cwd)
-                              << std::endl;
+                    std::cout << client->get_node_path(cwd) << std::endl;
                 }
             }},
             {"mkdir", [](CloudClient *client, Node &cwd, std::vector<std::string> &args) {
@@ -506,7 +670,7 @@ int shell(CloudClient *client, NetConnection *connection, const std::string &log
                     std::cout << "#" << result << std::endl;
                 } else std::cerr << "node: too many arguments" << std::endl;
             }},
-            {"put",   [](CloudClient *client, Node &cwd, std::vector<std::string> &args) {
+            {"put",   [&connect](CloudClient *client, Node &cwd, std::vector<std::string> &args) {
                 std::vector<std::string> options;
                 std::vector<std::string> files;
                 for (auto &arg : args) {
@@ -516,15 +680,24 @@ int shell(CloudClient *client, NetConnection *connection, const std::string &log
                 bool info = true;
                 size_t block_size = DEFAULT_DATA_BUFFER_SIZE;
                 bool recursive = false;
+                bool resume = false;
+                size_t connections = 1;
                 for (auto &option : options) {
                     if (option == "s") info = false;
                     else if (option == "r") recursive = true;
+                    else if (option == "c") resume = true;
                     else if (option.find("b=") == 0) {
                         if (!is_number(option.substr(2))) {
                             std::cerr << "Buffer size must be a number" << std::endl;
                             return;
                         }
                         block_size = std::stoll(option.substr(2));
+                    } else if (option.find("p=") == 0) {
+                        if (!is_number(option.substr(2)) || std::stoll(option.substr(2)) < 1) {
+                            std::cerr << "Connection count must be a positive number" << std::endl;
+                            return;
+                        }
+                        connections = std::stoll(option.substr(2));
                     } else {
                         std::cerr << "put: unknown option " << option << std::endl;
                         return;
@@ -536,18 +709,19 @@ int shell(CloudClient *client, NetConnection *connection, const std::string &log
                 }
                 std::string dst_dir_path = files.back();
                 Node dst_dir = get_path_node(client, cwd, dst_dir_path);
-                dst_dir_path = CLOUD_PATH_HOME + client->get_node_owner(dst_dir) + get_node_path(client, dst_dir) +
-                               CLOUD_PATH_DIV;
+                dst_dir_path = client->get_node_path(dst_dir) + CLOUD_PATH_DIV;
                 files.pop_back();
                 if (files.empty()) {
                     std::cerr << "put: no source files given" << std::endl;
                     return;
                 }
+                StripeSessions stripes(client, connect, connections);
                 for (auto &file : files) {
-                    put_node(client, file, dst_dir, info, block_size, recursive, dst_dir_path);
+                    put_node(client, file, dst_dir, info, block_size, recursive, dst_dir_path, resume,
+                             stripes.clients);
                 }
             }},
-            {"get",   [](CloudClient *client, Node &cwd, std::vector<std::string> &args) {
+            {"get",   [&connect](CloudClient *client, Node &cwd, std::vector<std::string> &args) {
                 std::vector<std::string> options;
                 std::vector<std::string> files;
                 for (auto &arg : args) {
@@ -557,15 +731,24 @@ int shell(CloudClient *client, NetConnection *connection, const std::string &log
                 bool info = true;
                 size_t block_size = DEFAULT_DATA_BUFFER_SIZE;
                 bool recursive = false;
+                bool resume = false;
+                size_t connections = 1;
                 for (auto &option : options) {
                     if (option == "s") info = false;
                     else if (option == "r") recursive = true;
+                    else if (option == "c") resume = true;
                     else if (option.find("b=") == 0) {
                         if (!is_number(option.substr(2))) {
                             std::cerr << "Buffer size must be a number" << std::endl;
                             return;
                         }
                         block_size = std::stoll(option.substr(2));
+                    } else if (option.find("p=") == 0) {
+                        if (!is_number(option.substr(2)) || std::stoll(option.substr(2)) < 1) {
+                            std::cerr << "Connection count must be a positive number" << std::endl;
+                            return;
+                        }
+                        connections = std::stoll(option.substr(2));
                     } else {
                         std::cerr << "get: unknown option " << option << std::endl;
                         return;
@@ -581,14 +764,15 @@ int shell(CloudClient *client, NetConnection *connection, const std::string &log
                     std::cerr << "get: no source files given" << std::endl;
                     return;
                 }
+                StripeSessions stripes(client, connect, connections);
                 for (auto &file : files) {
                     Node node = get_path_node(client, cwd, file);
-                    std::string path = get_node_path(client, node);
-                    std::string name;
-                    if (path.size() <= 1) name = client->get_node_owner(node);
-                    else name = path.substr(path.find_last_of(CLOUD_PATH_DIV) + 1);
-                    get_node(client, node, dst_dir + PATH_DIV, info, block_size, recursive,
-                             CLOUD_PATH_HOME + client->get_node_owner(node) + path, name);
+                    std::string path = client->get_node_path(node);
+                    auto div = path.find_last_of(CLOUD_PATH_DIV);
+                    // a home is saved under the name of its owner
+                    std::string name = div == std::string::npos ? path.substr(1) : path.substr(div + 1);
+                    get_node(client, node, dst_dir + PATH_DIV, info, block_size, recursive, path, name, resume,
+                             stripes.clients);
                 }
             }},
             {"chmod", [](CloudClient *client, Node &cwd, std::vector<std::string> &args) {
@@ -637,11 +821,14 @@ int shell(CloudClient *client, NetConnection *connection, const std::string &log
                 }
             }},
             {"rm",    [](CloudClient *client, Node &cwd, std::vector<std::string> &args) {
+                bool recursive = !args.empty() && args[0] == "-r";
+                if (recursive) args.erase(args.begin());
                 if (args.empty()) std::cerr << "rm: not enough arguments" << std::endl;
                 else {
                     for (std::string &path: args) {
                         Node node = get_path_node(client, cwd, path);
-                        client->remove_node(node);
+                        if (recursive) print_tree_failures(client, "rm", client->remove_tree(node));
+                        else client->remove_node(node);
                     }
                 }
             }},
@@ -669,11 +856,14 @@ int shell(CloudClient *client, NetConnection *connection, const std::string &log
                 }
             }},
             {"cp",   [](CloudClient *client, Node &cwd, std::vector<std::string> &args) {
+                bool recursive = !args.empty() && args[0] == "-r";
+                if (recursive) args.erase(args.begin());
                 if (args.size() != 2) std::cerr << "cp: exactly 2 arguments expected" << std::endl;
                 else {
                     Node node = get_path_node(client, cwd, args[0]);
                     std::string name = args[1];
-                    client->copy_node(node, name);
+                    if (recursive) print_tree_failures(client, "cp", client->copy_tree(node, name).second);
+                    else client->copy_node(node, name);
                 }
             }},
             {"rn",   [](CloudClient *client, Node &cwd, std::vector<std::string> &args) {
@@ -48,8 +48,8 @@ CloudClient::CloudClient(NetConnection *net, const std::string &login,
 CloudClient::~CloudClient() {
     if (connected) {
         try {
-            std::unique_lock<std::mutex> locker(api_lock);
-            send_uint32(connection, current_id);
+            std::unique_lock<std::mutex> locker(send_lock);
+            send_uint32(connection, current_id++);
             send_uint16(connection, REQUEST_CMD_GOODBYE);
             send_uint64(connection, 0);
             connection->flush();
@@ -63,234 +63,312 @@ CloudClient::~CloudClient() {
 
 
 void CloudClient::listener_routine() {
-    ServerResponse response;
     try {
         while (true) {
-            response = ServerResponse();
+            ServerResponse response;
             uint32_t id = read_uint32(connection);
             response.status = read_uint16(connection);
-            response.size = read_uint64(connection);
-            response.body = new char[response.size];
-            read_exact(connection, response.size, response.body);
-            responses[id] = response;
-            response_notifier.notify_all();
+            response.body.resize(read_uint64(connection));
+            read_exact(connection, response.body.size(), response.body.data());
+            ResponseHandler handler;
+            {
+                std::unique_lock locker(handlers_lock);
+                auto it = handlers.find(id);
+                if (it != handlers.end()) {
+                    handler = std::move(it->second);
+                    handlers.erase(it);
+                }
+            }
+            if (handler) handler(&response);
             if (response.status == REQUEST_SWITCH_OK) {
                 std::unique_lock locker(ldtm_lock);
             }
         }
     } catch (std::runtime_error &error) {
-        connected = false;
-        response_notifier.notify_all();
-        delete[] response.body;
+        std::map<uint32_t, ResponseHandler> lost;
+        {
+            std::unique_lock locker(handlers_lock);
+            connected = false;
+            lost.swap(handlers);
+        }
+        for (auto &[id, handler] : lost) handler(nullptr);
+    }
+}
+
+std::unique_lock<std::mutex> CloudClient::begin_request(ResponseHandler handler) {
+    std::unique_lock<std::mutex> locker(send_lock);
+    uint32_t id;
+    {
+        std::unique_lock handlers_locker(handlers_lock);
+        if (!connected) throw std::runtime_error("not connected");
+        id = current_id++;
+        handlers[id] = std::move(handler);
     }
+    send_uint32(connection, id);
+    return locker;
 }
 
-CloudClient::ServerResponse CloudClient::wait_response(uint32_t id, std::unique_lock<std::mutex> &locker) {
+template<typename T>
+std::future<T> CloudClient::request(uint16_t cmd, const std::string &body,
+                                    std::function<T(const ServerResponse &)> parse) {
+    auto promise = std::make_shared<std::promise<T>>();
+    std::future<T> future = promise->get_future();
+    auto locker = begin_request([promise, parse](const ServerResponse *response) {
+        try {
+            if (!response) throw std::runtime_error("not connected");
+            if (response->status != REQUEST_OK) throw CloudRequestError(response->status);
+            if constexpr (std::is_void_v<T>) {
+                if (parse) parse(*response);
+                promise->set_value();
+            } else promise->set_value(parse(*response));
+        } catch (...) {
+            promise->set_exception(std::current_exception());
+        }
+    });
+    send_uint16(connection, cmd);
+    send_uint64(connection, body.size());
+    send_exact(connection, body.size(), body.data());
     connection->flush();
-    while (connected && responses.find(id) == responses.end()) response_notifier.wait(locker);
-    if (!connected) throw std::runtime_error("not connected");
-    ServerResponse response = responses[id];
-    responses.erase(id);
-    return response;
+    return future;
 }
 
-Node CloudClient::get_home(const std::string &user) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_GET_HOME);
-    send_uint64(connection, user.size());
-    send_exact(connection, user.size(), user.c_str());
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    Node node = *reinterpret_cast<Node *>(response.body);
-    delete[] response.body;
+static void append_uint8(std::string &body, uint8_t n) {
+    body += char(n);
+}
+
+static void append_uint32(std::string &body, uint32_t n) {
+    char buffer[sizeof(uint32_t)];
+    buf_send_uint32(buffer, n);
+    body.append(buffer, sizeof(uint32_t));
+}
+
+static void append_uint64(std::string &body, uint64_t n) {
+    char buffer[sizeof(uint64_t)];
+    buf_send_uint64(buffer, n);
+    body.append(buffer, sizeof(uint64_t));
+}
+
+static void append_node(std::string &body, Node node) {
+    body.append(reinterpret_cast<const char *>(&node), sizeof(Node));
+}
+
+static void append_name(std::string &body, const std::string &name) {
+    append_uint8(body, name.length());
+    body += name;
+}
+
+static Node parse_node(const std::string &body) {
+    if (body.size() < sizeof(Node)) throw std::runtime_error("invalid response");
+    Node node;
+    std::memcpy(&node, body.data(), sizeof(Node));
     return node;
 }
 
+std::future<Node> CloudClient::get_home_async(const std::string &user) {
+    return request<Node>(REQUEST_CMD_GET_HOME, user, [](const ServerResponse &response) {
+        return parse_node(response.body);
+    });
+}
+
+Node CloudClient::get_home(const std::string &user) {
+    return get_home_async(user).get();
+}
+
+std::future<std::vector<std::pair<std::string, Node>>> CloudClient::list_directory_async(Node node) {
+    std::string body;
+    append_node(body, node);
+    return request<std::vector<std::pair<std::string, Node>>>(
+            REQUEST_CMD_LIST_DIRECTORY, body, [](const ServerResponse &response) {
+                std::vector<std::pair<std::string, Node>> children;
+                size_t offset = 0;
+                while (offset + sizeof(Node) < response.body.size()) {
+                    Node child = parse_node(response.body.substr(offset, sizeof(Node)));
+                    offset += sizeof(Node);
+                    auto length = (size_t) (unsigned char) response.body[offset];
+                    offset += 1;
+                    children.emplace_back(response.body.substr(offset, length), child);
+                    offset += length;
+                }
+                return children;
+            });
+}
+
 void CloudClient::list_directory(Node node, const std::function<void(std::string, Node)> &callback) {
-    std::vector<std::pair<std::string, Node>> children;
-    {
-        std::unique_lock<std::mutex> locker(api_lock);
-        send_uint32(connection, current_id);
-        send_uint16(connection, REQUEST_CMD_LIST_DIRECTORY);
-        send_uint64(connection, sizeof(Node));
-        send_exact(connection, sizeof(Node), &node);
-        ServerResponse response = wait_response(current_id++, locker);
-        if (response.status != REQUEST_OK) {
-            delete[] response.body;
-            throw CloudRequestError(response.status);
-        }
-        size_t offset = 0;
-        while (offset < response.size) {
-            Node child = *reinterpret_cast<Node *>(response.body + offset);
-            offset += sizeof(Node);
-            auto length = (size_t) *reinterpret_cast<unsigned char *>(response.body + offset);
-            offset += 1;
-            std::string name(reinterpret_cast<const char *>(response.body + offset), length);
-            offset += length;
-            children.emplace_back(name, child);
-        }
-        delete[] response.body;
-    }
-    for (auto[name, child] : children) callback(name, child);
+    for (auto[name, child] : list_directory_async(node).get()) callback(name, child);
+}
+
+std::future<std::vector<DirectoryEntry>> CloudClient::list_directory_plus_async(Node node) {
+    std::string body;
+    append_node(body, node);
+    return request<std::vector<DirectoryEntry>>(
+            REQUEST_CMD_LIST_DIRECTORY_PLUS, body, [](const ServerResponse &response) {
+                const std::string &data = response.body;
+                // reads a string prefixed by its u8 length
+                auto read_name = [&data](size_t &offset) {
+                    if (offset >= data.size()) throw std::runtime_error("invalid response");
+                    auto length = (size_t) (unsigned char) data[offset];
+                    if (offset + 1 + length > data.size()) throw std::runtime_error("invalid response");
+                    offset += 1 + length;
+                    return data.substr(offset - length, length);
+                };
+                size_t offset = 0;
+                std::string owner = read_name(offset);
+                std::vector<DirectoryEntry> entries;
+                while (offset < data.size()) {
+                    DirectoryEntry entry;
+                    if (offset + sizeof(Node) > data.size()) throw std::runtime_error("invalid response");
+                    entry.node = parse_node(data.substr(offset, sizeof(Node)));
+                    offset += sizeof(Node);
+                    entry.name = read_name(offset);
+                    if (offset + 2 + sizeof(uint64_t) > data.size()) throw std::runtime_error("invalid response");
+                    entry.info.type = uint8_t(data[offset]);
+                    entry.info.size = buf_read_uint64(data.data() + offset + 1);
+                    entry.info.rights = uint8_t(data[offset + 1 + sizeof(uint64_t)]);
+                    offset += 2 + sizeof(uint64_t);
+                    entry.group = read_name(offset);
+                    entry.owner = owner;
+                    entries.push_back(entry);
+                }
+                return entries;
+            });
+}
+
+void CloudClient::list_directory_plus(Node node, const std::function<void(const DirectoryEntry &)> &callback) {
+    for (auto &entry : list_directory_plus_async(node).get()) callback(entry);
+}
+
+std::future<std::pair<bool, Node>> CloudClient::get_parent_async(Node node) {
+    std::string body;
+    append_node(body, node);
+    return request<std::pair<bool, Node>>(REQUEST_CMD_GET_PARENT, body, [](const ServerResponse &response) {
+        if (response.body.size() != sizeof(Node)) return std::pair<bool, Node>(false, Node());
+        return std::pair<bool, Node>(true, parse_node(response.body));
+    });
 }
 
 bool CloudClient::get_parent(Node node, Node *parent) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_GET_PARENT);
-    send_uint64(connection, sizeof(Node));
-    send_exact(connection, sizeof(Node), &node);
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    bool result = response.size == sizeof(Node);
-    if (result && parent) *parent = *reinterpret_cast<Node *>(response.body);
-    delete[] response.body;
+    auto[result, node_parent] = get_parent_async(node).get();
+    if (result && parent) *parent = node_parent;
     return result;
 }
 
+std::future<Node> CloudClient::make_node_async(Node parent, const std::string &name, uint8_t type) {
+    std::string body;
+    append_node(body, parent);
+    append_name(body, name);
+    append_uint8(body, type);
+    return request<Node>(REQUEST_CMD_MAKE_NODE, body, [](const ServerResponse &response) {
+        return parse_node(response.body);
+    });
+}
+
 Node CloudClient::make_node(Node parent, const std::string &name, uint8_t type) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_MAKE_NODE);
-    send_uint64(connection, sizeof(Node) + 1 + name.length() + 1);
-    send_exact(connection, sizeof(Node), &parent);
-    send_uint8(connection, name.length());
-    send_exact(connection, name.length(), name.c_str());
-    send_uint8(connection, type);
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    Node node = *reinterpret_cast<Node *>(response.body);
-    delete[] response.body;
-    return node;
+    return make_node_async(parent, name, type).get();
+}
+
+std::future<std::string> CloudClient::get_node_owner_async(Node node) {
+    std::string body;
+    append_node(body, node);
+    return request<std::string>(REQUEST_CMD_GET_NODE_OWNER, body, [](const ServerResponse &response) {
+        return response.body;
+    });
 }
 
 std::string CloudClient::get_node_owner(Node node) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_GET_NODE_OWNER);
-    send_uint64(connection, sizeof(Node));
-    send_exact(connection, sizeof(Node), &node);
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    std::string owner(response.body, response.size);
-    delete[] response.body;
-    return owner;
+    return get_node_owner_async(node).get();
+}
+
+std::future<uint8_t> CloudClient::fd_open_async(Node node, uint8_t mode) {
+    std::string body;
+    append_node(body, node);
+    append_uint8(body, mode);
+    return request<uint8_t>(REQUEST_CMD_FD_OPEN, body, [](const ServerResponse &response) {
+        if (response.body.empty()) throw std::runtime_error("invalid response");
+        return uint8_t(response.body[0]);
+    });
 }
 
 uint8_t CloudClient::fd_open(Node node, uint8_t mode) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_FD_OPEN);
-    send_uint64(connection, sizeof(Node) + 1);
-    send_exact(connection, sizeof(Node), &node);
-    send_uint8(connection, mode);
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    uint8_t fd = *reinterpret_cast<uint8_t *>(response.body);
-    delete[] response.body;
-    return fd;
+    return fd_open_async(node, mode).get();
+}
+
+std::future<void> CloudClient::fd_close_async(uint8_t fd) {
+    std::string body;
+    append_uint8(body, fd);
+    return request<void>(REQUEST_CMD_FD_CLOSE, body, nullptr);
 }
 
 void CloudClient::fd_close(uint8_t fd) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_FD_CLOSE);
-    send_uint64(connection, 1);
-    send_uint8(connection, fd);
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    delete[] response.body;
+    fd_close_async(fd).get();
+}
+
+std::future<void> CloudClient::fd_write_async(uint8_t fd, uint32_t n, const void *bytes) {
+    std::string body;
+    append_uint8(body, fd);
+    body.append(static_cast<const char *>(bytes), n);
+    return request<void>(REQUEST_CMD_FD_WRITE, body, nullptr);
 }
 
 void CloudClient::fd_write(uint8_t fd, uint32_t n, const void *bytes) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_FD_WRITE);
-    send_uint64(connection, 1 + n);
-    send_uint8(connection, fd);
-    send_exact(connection, n, bytes);
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    delete[] response.body;
+    fd_write_async(fd, n, bytes).get();
+}
+
+std::future<uint32_t> CloudClient::fd_read_async(uint8_t fd, uint32_t n, void *bytes) {
+    std::string body;
+    append_uint8(body, fd);
+    append_uint32(body, n);
+    return request<uint32_t>(REQUEST_CMD_FD_READ, body, [n, bytes](const ServerResponse &response) {
+        if (response.body.size() > n) throw std::runtime_error("invalid response");
+        std::memcpy(bytes, response.body.data(), response.body.size());
+        return uint32_t(response.body.size());
+    });
 }
 
 uint32_t CloudClient::fd_read(uint8_t fd, uint32_t n, void *bytes) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_FD_READ);
-    send_uint64(connection, 1 + sizeof(uint32_t));
-    send_uint8(connection, fd);
-    send_uint32(connection, n);
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    std::memcpy(bytes, response.body, response.size);
-    delete[] response.body;
-    return response.size;
+    return fd_read_async(fd, n, bytes).get();
 }
 
-NodeInfo CloudClient::get_node_info(Node node) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_GET_NODE_INFO);
-    send_uint64(connection, sizeof(Node));
-    send_exact(connection, sizeof(Node), &node);
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    NodeInfo node_info;
-    char *p = response.body;
-    node_info.type = *reinterpret_cast<uint8_t *>(p);
-    p += sizeof(uint8_t);
-    node_info.size = buf_read_uint64(p);
-    p += sizeof(uint64_t);
-    node_info.rights = *reinterpret_cast<uint8_t *>(p);
-    delete[] response.body;
-    return node_info;
+std::future<NodeInfo> CloudClient::get_node_info_async(Node node) {
+    std::string body;
+    append_node(body, node);
+    return request<NodeInfo>(REQUEST_CMD_GET_NODE_INFO, body, [](const ServerResponse &response) {
+        if (response.body.size() < 2 + sizeof(uint64_t)) throw std::runtime_error("invalid response");
+        NodeInfo node_info;
+        const char *p = response.body.data();
+        node_info.type = *reinterpret_cast<const uint8_t *>(p);
+        p += sizeof(uint8_t);
+        node_info.size = buf_read_uint64(p);
+        p += sizeof(uint64_t);
+        node_info.rights = *reinterpret_cast<const uint8_t *>(p);
+        return node_info;
+    });
 }
 
+NodeInfo CloudClient::get_node_info(Node node) {
+    return get_node_info_async(node).get();
+}
+
+uint16_t CloudClient::begin_long_request(uint16_t cmd, const std::string &body, std::unique_lock<std::mutex> &locker) {
+    auto status = std::make_shared<std::promise<uint16_t>>();
+    std::future<uint16_t> future = status->get_future();
+    locker = begin_request([status](const ServerResponse *response) {
+        if (response) status->set_value(response->status);
+        else status->set_exception(std::make_exception_ptr(std::runtime_error("not connected")));
+    });
+    send_uint16(connection, cmd);
+    send_uint64(connection, body.size());
+    send_exact(connection, body.size(), body.data());
+    connection->flush();
+    return future.get();
+}
 
-void CloudClient::fd_read_long(uint8_t fd, uint64_t count, char *buffer, uint32_t buf_size,
-                               const std::function<void(uint32_t)> &callback) {
-    std::unique_lock<std::mutex> locker(api_lock);
+void CloudClient::read_long(uint16_t cmd, const std::string &body, uint64_t count, char *buffer, uint32_t buf_size,
+                            const std::function<void(uint32_t)> &callback) {
     std::unique_lock<std::mutex> locker_ldtm(ldtm_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_FD_READ_LONG);
-    send_uint64(connection, 1 + sizeof(uint64_t));
-    send_uint8(connection, fd);
-    send_uint64(connection, count);
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_SWITCH_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    delete[] response.body;
+    // the send lock is kept until the raw stream is over
+    std::unique_lock<std::mutex> locker;
+    uint16_t status = begin_long_request(cmd, body, locker);
+    if (status != REQUEST_SWITCH_OK) throw CloudRequestError(status);
     uint64_t done = 0;
     while (done < count) {
         uint32_t read = connection->read(std::min(uint64_t(buf_size), count - done), buffer);
@@ -299,21 +377,12 @@ void CloudClient::fd_read_long(uint8_t fd, uint64_t count, char *buffer, uint32_
     }
 }
 
-void CloudClient::fd_write_long(uint8_t fd, uint64_t count, const char *buffer,
-                                const std::function<uint32_t()> &callback) {
-    std::unique_lock<std::mutex> locker(api_lock);
+void CloudClient::write_long(uint16_t cmd, const std::string &body, uint64_t count, const char *buffer,
+                             const std::function<uint32_t()> &callback) {
     std::unique_lock<std::mutex> locker_ldtm(ldtm_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_FD_WRITE_LONG);
-    send_uint64(connection, 1 + sizeof(uint64_t));
-    send_uint8(connection, fd);
-    send_uint64(connection, count);
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_SWITCH_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    delete[] response.body;
+    std::unique_lock<std::mutex> locker;
+    uint16_t status = begin_long_request(cmd, body, locker);
+    if (status != REQUEST_SWITCH_OK) throw CloudRequestError(status);
     uint64_t done = 0;
     while (done < count) {
         uint32_t sent = callback();
@@ -322,156 +391,422 @@ void CloudClient::fd_write_long(uint8_t fd, uint64_t count, const char *buffer,
     }
 }
 
+void CloudClient::fd_read_long(uint8_t fd, uint64_t count, char *buffer, uint32_t buf_size,
+                               const std::function<void(uint32_t)> &callback) {
+    std::string body;
+    append_uint8(body, fd);
+    append_uint64(body, count);
+    read_long(REQUEST_CMD_FD_READ_LONG, body, count, buffer, buf_size, callback);
+}
+
+void CloudClient::fd_write_long(uint8_t fd, uint64_t count, const char *buffer,
+                                const std::function<uint32_t()> &callback) {
+    std::string body;
+    append_uint8(body, fd);
+    append_uint64(body, count);
+    write_long(REQUEST_CMD_FD_WRITE_LONG, body, count, buffer, callback);
+}
+
+void CloudClient::fd_pread_long(uint8_t fd, uint64_t offset, uint64_t count, char *buffer, uint32_t buf_size,
+                                const std::function<void(uint32_t)> &callback) {
+    std::string body;
+    append_uint8(body, fd);
+    append_uint64(body, offset);
+    append_uint64(body, count);
+    read_long(REQUEST_CMD_FD_PREAD_LONG, body, count, buffer, buf_size, callback);
+}
+
+void CloudClient::fd_pwrite_long(uint8_t fd, uint64_t offset, uint64_t count, const char *buffer,
+                                 const std::function<uint32_t()> &callback) {
+    std::string body;
+    append_uint8(body, fd);
+    append_uint64(body, offset);
+    append_uint64(body, count);
+    write_long(REQUEST_CMD_FD_PWRITE_LONG, body, count, buffer, callback);
+}
+
+std::future<uint32_t> CloudClient::fd_pread_async(uint8_t fd, uint64_t offset, uint32_t n, void *bytes) {
+    std::string body;
+    append_uint8(body, fd);
+    append_uint64(body, offset);
+    append_uint32(body, n);
+    return request<uint32_t>(REQUEST_CMD_FD_PREAD, body, [n, bytes](const ServerResponse &response) {
+        if (response.body.size() > n) throw std::runtime_error("invalid response");
+        std::memcpy(bytes, response.body.data(), response.body.size());
+        return uint32_t(response.body.size());
+    });
+}
+
+uint32_t CloudClient::fd_pread(uint8_t fd, uint64_t offset, uint32_t n, void *bytes) {
+    return fd_pread_async(fd, offset, n, bytes).get();
+}
+
+std::future<void> CloudClient::fd_pwrite_async(uint8_t fd, uint64_t offset, uint32_t n, const void *bytes) {
+    std::string body;
+    append_uint8(body, fd);
+    append_uint64(body, offset);
+    body.append(static_cast<const char *>(bytes), n);
+    return request<void>(REQUEST_CMD_FD_PWRITE, body, nullptr);
+}
+
+void CloudClient::fd_pwrite(uint8_t fd, uint64_t offset, uint32_t n, const void *bytes) {
+    fd_pwrite_async(fd, offset, n, bytes).get();
+}
+
+std::future<void> CloudClient::fd_truncate_async(uint8_t fd, uint64_t length) {
+    std::string body;
+    append_uint8(body, fd);
+    append_uint64(body, length);
+    return request<void>(REQUEST_CMD_FD_TRUNCATE, body, nullptr);
+}
+
+void CloudClient::fd_truncate(uint8_t fd, uint64_t length) {
+    fd_truncate_async(fd, length).get();
+}
+
+std::future<void> CloudClient::set_node_rights_async(Node node, uint8_t rights) {
+    std::string body;
+    append_node(body, node);
+    append_uint8(body, rights);
+    return request<void>(REQUEST_CMD_SET_NODE_RIGHTS, body, nullptr);
+}
+
 void CloudClient::set_node_rights(Node node, uint8_t rights) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_SET_NODE_RIGHTS);
-    send_uint64(connection, sizeof(Node) + 1);
-    send_exact(connection, sizeof(Node), &node);
-    send_uint8(connection, rights);
-    ServerResponse response = wait_response(current_id++, locker);
-    delete[] response.body;
-    if (response.status != REQUEST_OK) {
-        throw CloudRequestError(response.status);
-    }
+    set_node_rights_async(node, rights).get();
+}
+
+std::future<void> CloudClient::group_invite_async(const std::string &user) {
+    return request<void>(REQUEST_CMD_GROUP_INVITE, user, nullptr);
 }
 
 void CloudClient::group_invite(const std::string &user) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_GROUP_INVITE);
-    send_uint64(connection, user.length());
-    send_exact(connection, user.length(), user.c_str());
-    ServerResponse response = wait_response(current_id++, locker);
-    delete[] response.body;
-    if (response.status != REQUEST_OK) {
-        throw CloudRequestError(response.status);
-    }
+    group_invite_async(user).get();
+}
+
+std::future<std::string> CloudClient::get_node_group_async(Node node) {
+    std::string body;
+    append_node(body, node);
+    return request<std::string>(REQUEST_CMD_GET_NODE_GROUP, body, [](const ServerResponse &response) {
+        return response.body;
+    });
 }
 
 std::string CloudClient::get_node_group(Node node) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_GET_NODE_GROUP);
-    send_uint64(connection, sizeof(Node));
-    send_exact(connection, sizeof(Node), &node);
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    std::string group(response.body, response.size);
-    return group;
+    return get_node_group_async(node).get();
+}
+
+std::future<void> CloudClient::remove_node_async(Node node) {
+    std::string body;
+    append_node(body, node);
+    return request<void>(REQUEST_CMD_REMOVE_NODE, body, nullptr);
 }
 
 void CloudClient::remove_node(Node node) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_REMOVE_NODE);
-    send_uint64(connection, sizeof(Node));
-    send_exact(connection, sizeof(Node), &node);
-    ServerResponse response = wait_response(current_id++, locker);
-    delete[] response.body;
-    if (response.status != REQUEST_OK) {
-        throw CloudRequestError(response.status);
-    }
+    remove_node_async(node).get();
+}
+
+std::future<void> CloudClient::set_node_group_async(Node node, const std::string &group) {
+    std::string body;
+    append_node(body, node);
+    body += group;
+    return request<void>(REQUEST_CMD_SET_NODE_GROUP, body, nullptr);
 }
 
 void CloudClient::set_node_group(Node node, const std::string &group) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_SET_NODE_GROUP);
-    send_uint64(connection, sizeof(Node) + group.length());
-    send_exact(connection, sizeof(Node), &node);
-    send_exact(connection, group.length(), group.c_str());
-    ServerResponse response = wait_response(current_id++, locker);
-    delete[] response.body;
-    if (response.status != REQUEST_OK) {
-        throw CloudRequestError(response.status);
-    }
+    set_node_group_async(node, group).get();
+}
+
+std::future<void> CloudClient::group_kick_async(const std::string &user) {
+    return request<void>(REQUEST_CMD_GROUP_KICK, user, nullptr);
 }
 
 void CloudClient::group_kick(const std::string &user) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_GROUP_KICK);
-    send_uint64(connection, user.length());
-    send_exact(connection, user.length(), user.c_str());
-    ServerResponse response = wait_response(current_id++, locker);
-    delete[] response.body;
-    if (response.status != REQUEST_OK) {
-        throw CloudRequestError(response.status);
-    }
+    group_kick_async(user).get();
+}
+
+std::future<std::vector<std::string>> CloudClient::group_list_async() {
+    return request<std::vector<std::string>>(REQUEST_CMD_GROUP_LIST, "", [](const ServerResponse &response) {
+        std::vector<std::string> groups;
+        size_t pos = 0;
+        while (pos < response.body.size()) {
+            auto length = (size_t) (unsigned char) response.body[pos];
+            pos++;
+            groups.push_back(response.body.substr(pos, length));
+            pos += length;
+        }
+        return groups;
+    });
 }
 
 void CloudClient::group_list(const std::function<void(std::string)> &callback) {
-    std::string groups;
-    {
-        std::unique_lock<std::mutex> locker(api_lock);
-        send_uint32(connection, current_id);
-        send_uint16(connection, REQUEST_CMD_GROUP_LIST);
-        send_uint64(connection, 0);
-        ServerResponse response = wait_response(current_id++, locker);
-        if (response.status != REQUEST_OK) {
-            delete[] response.body;
-            throw CloudRequestError(response.status);
-        }
-        groups = std::string(response.body, response.size);
-        delete[] response.body;
-    }
-    size_t pos = 0;
-    while (pos < groups.size()) {
-        uint8_t length = groups[pos];
-        pos++;
-        std::string group = groups.substr(pos, length);
-        callback(group);
-        pos += length;
-    }
+    for (auto &group : group_list_async().get()) callback(group);
+}
+
+std::future<void> CloudClient::move_node_async(Node node, Node new_parent) {
+    std::string body;
+    append_node(body, node);
+    append_node(body, new_parent);
+    return request<void>(REQUEST_CMD_MOVE_NODE, body, nullptr);
 }
 
 void CloudClient::move_node(Node node, Node new_parent) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_MOVE_NODE);
-    send_uint64(connection, sizeof(Node) * 2);
-    send_exact(connection, sizeof(Node), &node);
-    send_exact(connection, sizeof(Node), &new_parent);
-    ServerResponse response = wait_response(current_id++, locker);
-    delete[] response.body;
-    if (response.status != REQUEST_OK) {
-        throw CloudRequestError(response.status);
-    }
+    move_node_async(node, new_parent).get();
+}
+
+std::future<Node> CloudClient::copy_node_async(Node node, const std::string &name) {
+    std::string body;
+    append_node(body, node);
+    body += name;
+    return request<Node>(REQUEST_CMD_COPY_NODE, body, [](const ServerResponse &response) {
+        return parse_node(response.body);
+    });
 }
 
 Node CloudClient::copy_node(Node node, const std::string &name) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_COPY_NODE);
-    send_uint64(connection, sizeof(Node) + name.length());
-    send_exact(connection, sizeof(Node), &node);
-    send_exact(connection, name.length(), name.c_str());
-    ServerResponse response = wait_response(current_id++, locker);
-    if (response.status != REQUEST_OK) {
-        delete[] response.body;
-        throw CloudRequestError(response.status);
-    }
-    Node clone = *reinterpret_cast<Node *>(response.body);
-    delete[] response.body;
-    return clone;
+    return copy_node_async(node, name).get();
+}
+
+std::future<void> CloudClient::rename_node_async(Node node, const std::string &name) {
+    std::string body;
+    append_node(body, node);
+    body += name;
+    return request<void>(REQUEST_CMD_RENAME_NODE, body, nullptr);
 }
 
 void CloudClient::rename_node(Node node, const std::string &name) {
-    std::unique_lock<std::mutex> locker(api_lock);
-    send_uint32(connection, current_id);
-    send_uint16(connection, REQUEST_CMD_RENAME_NODE);
-    send_uint64(connection, sizeof(Node) + name.length());
-    send_exact(connection, sizeof(Node), &node);
-    send_exact(connection, name.length(), name.c_str());
-    ServerResponse response = wait_response(current_id++, locker);
-    delete[] response.body;
-    if (response.status != REQUEST_OK) {
-        throw CloudRequestError(response.status);
+    rename_node_async(node, name).get();
+}
+
+std::future<Node> CloudClient::resolve_path_async(Node base, const std::string &path) {
+    std::string body;
+    append_node(body, base);
+    body += path;
+    return request<Node>(REQUEST_CMD_RESOLVE_PATH, body, [](const ServerResponse &response) {
+        return parse_node(response.body);
+    });
+}
+
+Node CloudClient::resolve_path(Node base, const std::string &path) {
+    return resolve_path_async(base, path).get();
+}
+
+std::future<std::string> CloudClient::get_node_path_async(Node node) {
+    std::string body;
+    append_node(body, node);
+    return request<std::string>(REQUEST_CMD_GET_NODE_PATH, body, [](const ServerResponse &response) {
+        return response.body;
+    });
+}
+
+std::string CloudClient::get_node_path(Node node) {
+    return get_node_path_async(node).get();
+}
+
+static TreeResult parse_tree_result(const std::string &body) {
+    if (body.size() < 2 * sizeof(uint64_t)) throw std::runtime_error("invalid response");
+    TreeResult result;
+    result.done = buf_read_uint64(body.data());
+    result.failed = buf_read_uint64(body.data() + sizeof(uint64_t));
+    for (size_t pos = 2 * sizeof(uint64_t); pos + sizeof(Node) + sizeof(uint16_t) <= body.size();) {
+        Node node = parse_node(body.substr(pos, sizeof(Node)));
+        result.failures.emplace_back(node, buf_read_uint16(body.data() + pos + sizeof(Node)));
+        pos += sizeof(Node) + sizeof(uint16_t);
     }
+    return result;
+}
+
+std::future<TreeResult> CloudClient::remove_tree_async(Node node) {
+    std::string body;
+    append_node(body, node);
+    return request<TreeResult>(REQUEST_CMD_REMOVE_TREE, body, [](const ServerResponse &response) {
+        return parse_tree_result(response.body);
+    });
+}
+
+TreeResult CloudClient::remove_tree(Node node) {
+    return remove_tree_async(node).get();
+}
+
+std::future<std::pair<Node, TreeResult>> CloudClient::copy_tree_async(Node node, const std::string &name) {
+    std::string body;
+    append_node(body, node);
+    body += name;
+    return request<std::pair<Node, TreeResult>>(REQUEST_CMD_COPY_TREE, body, [](const ServerResponse &response) {
+        if (response.body.size() < sizeof(Node)) throw std::runtime_error("invalid response");
+        return std::pair(parse_node(response.body.substr(0, sizeof(Node))),
+                         parse_tree_result(response.body.substr(sizeof(Node))));
+    });
+}
+
+std::pair<Node, TreeResult> CloudClient::copy_tree(Node node, const std::string &name) {
+    return copy_tree_async(node, name).get();
+}
+
+std::future<std::vector<std::string>> CloudClient::batch_async(const CloudBatch &batch) {
+    size_t count = batch.count();
+    return request<std::vector<std::string>>(REQUEST_CMD_BATCH, batch.body, [count](const ServerResponse &response) {
+        std::vector<std::string> results;
+        size_t pos = 0;
+        while (pos + BATCH_RESULT_HEADER_LENGTH <= response.body.size()) {
+            uint16_t status = buf_read_uint16(response.body.data() + pos);
+            uint64_t size = buf_read_uint64(response.body.data() + pos + sizeof(uint16_t));
+            pos += BATCH_RESULT_HEADER_LENGTH;
+            if (status != REQUEST_OK) {
+                throw CloudRequestError(status, "sub-request " + std::to_string(results.size()));
+            }
+            results.push_back(response.body.substr(pos, size));
+            pos += size;
+        }
+        if (results.size() != count) throw std::runtime_error("invalid response");
+        return results;
+    });
+}
+
+std::vector<std::string> CloudClient::batch(const CloudBatch &batch) {
+    return batch_async(batch).get();
+}
+
+// runs stripe(client, offset, count) for a contiguous range per client on its own thread
+static void run_stripes(const std::vector<CloudClient *> &clients, uint64_t offset, uint64_t count,
+                        const std::function<void(CloudClient *, uint64_t, uint64_t)> &stripe) {
+    if (clients.empty()) throw std::invalid_argument("no clients for a striped transfer");
+    uint64_t stripe_size = (count + clients.size() - 1) / clients.size();
+    std::vector<std::thread> threads;
+    std::mutex error_lock;
+    std::exception_ptr error;
+    for (size_t i = 0; i < clients.size() && i * stripe_size < count; i++) {
+        uint64_t begin = offset + i * stripe_size;
+        uint64_t length = std::min(stripe_size, count - i * stripe_size);
+        threads.emplace_back([&, i, begin, length]() {
+            try {
+                stripe(clients[i], begin, length);
+            } catch (...) {
+                std::unique_lock<std::mutex> locker(error_lock);
+                if (!error) error = std::current_exception();
+            }
+        });
+    }
+    for (auto &thread : threads) thread.join();
+    if (error) std::rethrow_exception(error);
+}
+
+// keeps the fd open for the duration of a stripe
+static void run_with_fd(CloudClient *client, Node node, uint8_t mode, const std::function<void(uint8_t)> &transfer) {
+    uint8_t fd = client->fd_open(node, mode);
+    try {
+        transfer(fd);
+    } catch (...) {
+        try {
+            client->fd_close(fd);
+        } catch (...) {}
+        throw;
+    }
+    client->fd_close(fd);
+}
+
+void CloudClient::striped_read(const std::vector<CloudClient *> &clients, Node node, uint64_t offset, uint64_t count,
+                               uint32_t buf_size, const std::function<void(uint64_t, uint32_t, const char *)> &sink) {
+    run_stripes(clients, offset, count, [&](CloudClient *client, uint64_t begin, uint64_t length) {
+        run_with_fd(client, node, NODE_FD_MODE_READ, [&](uint8_t fd) {
+            std::vector<char> buffer(buf_size);
+            uint64_t position = begin;
+            client->fd_pread_long(fd, begin, length, buffer.data(), buf_size, [&](uint32_t read) {
+                sink(position, read, buffer.data());
+                position += read;
+            });
+        });
+    });
+}
+
+void CloudClient::striped_write(const std::vector<CloudClient *> &clients, Node node, uint64_t offset, uint64_t count,
+                                uint32_t buf_size, const std::function<void(uint64_t, uint32_t, char *)> &source,
+                                uint64_t *written) {
+    // a stripe is known to be written only once its request succeeded, as a failed one may have left holes
+    std::map<uint64_t, uint64_t> finished;
+    std::mutex finished_lock;
+    try {
+        run_stripes(clients, offset, count, [&](CloudClient *client, uint64_t begin, uint64_t length) {
+            run_with_fd(client, node, NODE_FD_MODE_WRITE | NODE_FD_MODE_SHARED_WRITE, [&](uint8_t fd) {
+                std::vector<char> buffer(buf_size);
+                uint64_t position = begin;
+                client->fd_pwrite_long(fd, begin, length, buffer.data(), [&]() -> uint32_t {
+                    auto n = uint32_t(std::min(uint64_t(buf_size), begin + length - position));
+                    source(position, n, buffer.data());
+                    position += n;
+                    return n;
+                });
+            });
+            std::unique_lock<std::mutex> locker(finished_lock);
+            finished[begin] = begin + length;
+        });
+    } catch (...) {
+        if (written) {
+            *written = offset;
+            for (auto stripe = finished.find(offset); stripe != finished.end(); stripe = finished.find(*written)) {
+                *written = stripe->second;
+            }
+        }
+        throw;
+    }
+    if (written) *written = offset + count;
+}
+
+CloudBatch::Ref CloudBatch::add(uint16_t cmd, const Ref *ref, const std::string &entry_body) {
+    uint8_t distance = 0;
+    if (ref) {
+        if (*ref >= entries || entries - *ref > 0xFF) throw std::invalid_argument("invalid batch reference");
+        distance = entries - *ref;
+    }
+    char header[BATCH_ENTRY_HEADER_LENGTH];
+    buf_send_uint16(header, cmd);
+    header[sizeof(uint16_t)] = char(distance);
+    buf_send_uint64(header + sizeof(uint16_t) + sizeof(uint8_t), entry_body.size());
+    body.append(header, BATCH_ENTRY_HEADER_LENGTH);
+    body += entry_body;
+    return entries++;
+}
+
+CloudBatch::Ref CloudBatch::make_node(Node parent, const std::string &name, uint8_t type) {
+    std::string entry_body;
+    append_node(entry_body, parent);
+    append_name(entry_body, name);
+    append_uint8(entry_body, type);
+    return add(REQUEST_CMD_MAKE_NODE, nullptr, entry_body);
+}
+
+CloudBatch::Ref CloudBatch::make_node(Ref parent, const std::string &name, uint8_t type) {
+    std::string entry_body;
+    append_node(entry_body, Node());
+    append_name(entry_body, name);
+    append_uint8(entry_body, type);
+    return add(REQUEST_CMD_MAKE_NODE, &parent, entry_body);
+}
+
+CloudBatch::Ref CloudBatch::fd_open(Node node, uint8_t mode) {
+    std::string entry_body;
+    append_node(entry_body, node);
+    append_uint8(entry_body, mode);
+    return add(REQUEST_CMD_FD_OPEN, nullptr, entry_body);
+}
+
+CloudBatch::Ref CloudBatch::fd_open(Ref node, uint8_t mode) {
+    std::string entry_body;
+    append_node(entry_body, Node());
+    append_uint8(entry_body, mode);
+    return add(REQUEST_CMD_FD_OPEN, &node, entry_body);
+}
+
+CloudBatch::Ref CloudBatch::fd_write(Ref fd, uint32_t n, const void *bytes) {
+    std::string entry_body;
+    append_uint8(entry_body, 0);
+    entry_body.append(static_cast<const char *>(bytes), n);
+    return add(REQUEST_CMD_FD_WRITE, &fd, entry_body);
+}
+
+CloudBatch::Ref CloudBatch::fd_close(Ref fd) {
+    std::string entry_body;
+    append_uint8(entry_body, 0);
+    return add(REQUEST_CMD_FD_CLOSE, &fd, entry_body);
 }
 
 void CloudClient::negotiate(NetConnection *net) {
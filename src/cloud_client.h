@@ -7,6 +7,9 @@
 #include <thread>
 #include <condition_variable>
 #include <map>
+#include <atomic>
+#include <future>
+#include <vector>
 #include "networking.h"
 #include "cloud_common.h"
 
@@ -16,24 +19,94 @@ typedef struct {
     uint8_t rights;
 } NodeInfo;
 
+typedef struct {
+    std::string name;
+    Node node;
+    NodeInfo info;
+    std::string group;
+    std::string owner;
+} DirectoryEntry;
+
+typedef struct {
+    uint64_t done = 0; // removed or copied nodes
+    uint64_t failed = 0;
+    std::vector<std::pair<Node, uint16_t>> failures; // the first TREE_FAILURES_MAX failed nodes and their status
+} TreeResult;
+
+class CloudClient;
+
+// sub-requests that the server executes in order within one round trip, stopping on the first error
+class CloudBatch final {
+public:
+    // position of a sub-request in the batch, what it returns may stand for the node or fd of a later sub-request
+    typedef size_t Ref;
+
+    Ref make_node(Node parent, const std::string &name, uint8_t type);
+
+    Ref make_node(Ref parent, const std::string &name, uint8_t type);
+
+    Ref fd_open(Node node, uint8_t mode);
+
+    Ref fd_open(Ref node, uint8_t mode);
+
+    Ref fd_write(Ref fd, uint32_t n, const void *bytes);
+
+    Ref fd_close(Ref fd);
+
+    [[nodiscard]] size_t count() const {
+        return entries;
+    }
+
+    [[nodiscard]] size_t size() const {
+        return body.size();
+    }
+
+private:
+    friend CloudClient;
+
+    std::string body;
+    size_t entries = 0;
+
+    Ref add(uint16_t cmd, const Ref *ref, const std::string &entry_body);
+};
+
 class CloudClient final {
 private:
     struct ServerResponse {
         uint16_t status = 0;
-        uint64_t size = 0;
-        char *body = nullptr;
+        std::string body;
     };
+
+    // called by the listener with the response of a request, or with nullptr if the connection is lost
+    typedef std::function<void(const ServerResponse *)> ResponseHandler;
+
     NetConnection *const connection;
-    std::mutex api_lock;
+    std::mutex send_lock;
+    std::mutex handlers_lock;
     std::mutex ldtm_lock;
     std::thread listener;
-    std::condition_variable response_notifier;
-    std::map<uint32_t, ServerResponse> responses;
+    std::map<uint32_t, ResponseHandler> handlers;
     uint32_t current_id = 0;
-    bool connected = true;
+    std::atomic<bool> connected{true};
 
     static void negotiate(NetConnection *net);
 
+    // registers the handler and sends the request id, the rest of the request must be sent while holding the lock
+    std::unique_lock<std::mutex> begin_request(ResponseHandler handler);
+
+    // sends a request whose successful response is followed by a raw stream, the send lock is kept in locker
+    uint16_t begin_long_request(uint16_t cmd, const std::string &body, std::unique_lock<std::mutex> &locker);
+
+    void read_long(uint16_t cmd, const std::string &body, uint64_t count, char *buffer, uint32_t buf_size,
+                   const std::function<void(uint32_t)> &callback);
+
+    void write_long(uint16_t cmd, const std::string &body, uint64_t count, const char *buffer,
+                    const std::function<uint32_t()> &callback);
+
+    // sends a request, its response is parsed on the listener thread and delivered through the future
+    template<typename T>
+    std::future<T> request(uint16_t cmd, const std::string &body, std::function<T(const ServerResponse &)> parse);
+
 public:
     CloudClient(NetConnection *net, const std::string &login, const std::function<std::string()> &password_callback);
 
@@ -50,6 +123,9 @@ public:
 
     void list_directory(Node node, const std::function<void(std::string, Node)> &callback);
 
+    // lists the entries together with their attributes in a single request
+    void list_directory_plus(Node node, const std::function<void(const DirectoryEntry &)> &callback);
+
     bool get_parent(Node node, Node *parent);
 
     Node make_node(Node parent, const std::string &name, uint8_t type);
@@ -69,6 +145,21 @@ public:
 
     void fd_write_long(uint8_t fd, uint64_t count, const char *buffer, const std::function<uint32_t()> &callback);
 
+    // positioned I/O, the fd position is neither used nor changed, so it may be shared by several readers
+
+    // returns less than n bytes only at the end of file
+    uint32_t fd_pread(uint8_t fd, uint64_t offset, uint32_t n, void *bytes);
+
+    void fd_pwrite(uint8_t fd, uint64_t offset, uint32_t n, const void *bytes);
+
+    void fd_truncate(uint8_t fd, uint64_t length);
+
+    void fd_pread_long(uint8_t fd, uint64_t offset, uint64_t count, char *buffer, uint32_t buf_size,
+                       const std::function<void(uint32_t)> &callback);
+
+    void fd_pwrite_long(uint8_t fd, uint64_t offset, uint64_t count, const char *buffer,
+                        const std::function<uint32_t()> &callback);
+
     NodeInfo get_node_info(Node node);
 
     void set_node_rights(Node node, uint8_t rights);
@@ -93,7 +184,99 @@ public:
 
     void rename_node(Node node, const std::string &name);
 
-    ServerResponse wait_response(uint32_t id, std::unique_lock<std::mutex> &locker);
+    // the path is relative to base unless it starts with ~user or #node
+    Node resolve_path(Node base, const std::string &path);
+
+    // returns the absolute ~owner/a/b path of the node
+    std::string get_node_path(Node node);
+
+    // removes the node and everything below it, going on past the nodes that can't be removed
+    TreeResult remove_tree(Node node);
+
+    // copies the node and everything below it next to the node under the given name, returns the clone
+    std::pair<Node, TreeResult> copy_tree(Node node, const std::string &name);
+
+    // asynchronous variants, they return as soon as the request is sent and may be used from any thread,
+    // so one thread can keep many requests in flight; errors are rethrown by std::future::get
+
+    std::future<Node> get_home_async(const std::string &user = "");
+
+    std::future<std::vector<std::pair<std::string, Node>>> list_directory_async(Node node);
+
+    std::future<std::vector<DirectoryEntry>> list_directory_plus_async(Node node);
+
+    // the future holds false if the node has no parent
+    std::future<std::pair<bool, Node>> get_parent_async(Node node);
+
+    std::future<Node> make_node_async(Node parent, const std::string &name, uint8_t type);
+
+    std::future<std::string> get_node_owner_async(Node node);
+
+    std::future<uint8_t> fd_open_async(Node node, uint8_t mode);
+
+    std::future<void> fd_close_async(uint8_t fd);
+
+    // bytes must stay valid until the future is ready
+    std::future<uint32_t> fd_read_async(uint8_t fd, uint32_t n, void *bytes);
+
+    std::future<void> fd_write_async(uint8_t fd, uint32_t n, const void *bytes);
+
+    std::future<uint32_t> fd_pread_async(uint8_t fd, uint64_t offset, uint32_t n, void *bytes);
+
+    std::future<void> fd_pwrite_async(uint8_t fd, uint64_t offset, uint32_t n, const void *bytes);
+
+    std::future<void> fd_truncate_async(uint8_t fd, uint64_t length);
+
+    std::future<NodeInfo> get_node_info_async(Node node);
+
+    std::future<void> set_node_rights_async(Node node, uint8_t rights);
+
+    std::future<void> group_invite_async(const std::string &user);
+
+    std::future<void> group_kick_async(const std::string &user);
+
+    std::future<std::vector<std::string>> group_list_async();
+
+    std::future<void> remove_node_async(Node node);
+
+    std::future<std::string> get_node_group_async(Node node);
+
+    std::future<void> set_node_group_async(Node node, const std::string &group);
+
+    std::future<void> move_node_async(Node node, Node new_parent);
+
+    std::future<Node> copy_node_async(Node node, const std::string &name);
+
+    std::future<void> rename_node_async(Node node, const std::string &name);
+
+    std::future<Node> resolve_path_async(Node base, const std::string &path);
+
+    std::future<std::string> get_node_path_async(Node node);
+
+    std::future<TreeResult> remove_tree_async(Node node);
+
+    std::future<std::pair<Node, TreeResult>> copy_tree_async(Node node, const std::string &name);
+
+    // the future holds the response body of every sub-request, the first failed one is thrown as CloudRequestError
+    std::future<std::vector<std::string>> batch_async(const CloudBatch &batch);
+
+    std::vector<std::string> batch(const CloudBatch &batch);
+
+    // striped transfers split [offset, offset + count) of a file into one range per client, each client being
+    // a separate connection, and transfer the ranges concurrently; the callbacks are called from several threads
+    // with disjoint ranges, and the first error is rethrown once every range is over
+
+    // sink receives n bytes read at the given file offset
+    static void striped_read(const std::vector<CloudClient *> &clients, Node node, uint64_t offset, uint64_t count,
+                             uint32_t buf_size, const std::function<void(uint64_t, uint32_t, const char *)> &sink);
+
+    // source must fill the buffer with exactly n bytes to be written at the given file offset,
+    // the file is opened with NODE_FD_MODE_SHARED_WRITE, so it is not truncated; written, if given, receives the end
+    // of the range from offset on that is surely written, also when an error is thrown
+    static void striped_write(const std::vector<CloudClient *> &clients, Node node, uint64_t offset, uint64_t count,
+                              uint32_t buf_size, const std::function<void(uint64_t, uint32_t, char *)> &source,
+                              uint64_t *written = nullptr);
+
 };
 
 class CloudInitError : public std::exception {
@@ -52,8 +52,8 @@ static void send_uint16(NetConnection *connection, uint16_t n) {
     send_exact(connection, 2, &buffer);
 }
 
-static uint16_t buf_read_uint16(void *buffer) {
-    auto *r_buffer = reinterpret_cast<uint8_t *>(buffer);
+static uint16_t buf_read_uint16(const void *buffer) {
+    auto *r_buffer = reinterpret_cast<const uint8_t *>(buffer);
     uint16_t n = 0;
     for (size_t i = 0; i < sizeof(uint16_t); i++) {
         uint8_t e = r_buffer[i];
@@ -69,17 +69,22 @@ static uint16_t read_uint16(NetConnection *connection) {
     return buf_read_uint16(buffer);
 }
 
-static void send_uint32(NetConnection *connection, uint32_t n) {
-    uint8_t buffer[4];
+static void buf_send_uint32(void *buffer, uint32_t n) {
+    auto *r_buffer = reinterpret_cast<uint8_t *>(buffer);
     for (int8_t i = 3; i >= 0; i--) {
-        buffer[i] = n & uint32_t(0xFF);
+        r_buffer[i] = n & uint32_t(0xFF);
         n >>= uint32_t(8);
     }
+}
+
+static void send_uint32(NetConnection *connection, uint32_t n) {
+    uint8_t buffer[4];
+    buf_send_uint32(&buffer, n);
     send_exact(connection, 4, &buffer);
 }
 
-static uint32_t buf_read_uint32(void *buffer) {
-    auto *r_buffer = reinterpret_cast<uint8_t *>(buffer);
+static uint32_t buf_read_uint32(const void *buffer) {
+    auto *r_buffer = reinterpret_cast<const uint8_t *>(buffer);
     uint32_t n = 0;
     for (size_t i = 0; i < sizeof(uint32_t); i++) {
         uint8_t e = r_buffer[i];
@@ -95,17 +100,22 @@ static uint32_t read_uint32(NetConnection *connection) {
     return buf_read_uint32(buffer);
 }
 
-static void send_uint64(NetConnection *connection, uint64_t n) {
-    uint8_t buffer[8];
+static void buf_send_uint64(void *buffer, uint64_t n) {
+    auto *r_buffer = reinterpret_cast<uint8_t *>(buffer);
     for (int8_t i = 7; i >= 0; i--) {
-        buffer[i] = n & uint64_t(0xFF);
+        r_buffer[i] = n & uint64_t(0xFF);
         n >>= uint64_t(8);
     }
+}
+
+static void send_uint64(NetConnection *connection, uint64_t n) {
+    uint8_t buffer[8];
+    buf_send_uint64(&buffer, n);
     send_exact(connection, 8, &buffer);
 }
 
-static uint64_t buf_read_uint64(void *buffer) {
-    auto *r_buffer = reinterpret_cast<uint8_t *>(buffer);
+static uint64_t buf_read_uint64(const void *buffer) {
+    auto *r_buffer = reinterpret_cast<const uint8_t *>(buffer);
     uint64_t n = 0;
     for (size_t i = 0; i < sizeof(uint64_t); i++) {
         uint8_t e = r_buffer[i];
@@ -163,6 +173,7 @@ static const char PATH_DIV = '/';
 static const char LOGIN_DIV = '@';
 
 static const uint64_t INIT_BODY_MAX_SIZE = 1024 * 8; // 8 KiB
+static const size_t INIT_HEADER_LENGTH = sizeof(uint16_t) + sizeof(uint64_t); // cmd, body size
 
 static const uint16_t INIT_CMD_AUTH = 1;
 static const uint16_t INIT_CMD_REGISTER = 2;
@@ -177,6 +188,7 @@ static const uint16_t INIT_ERR_USER_EXISTS = 6;
 static const uint16_t INIT_ERR_INVALID_USERNAME = 7;
 
 static const uint64_t REQUEST_BODY_MAX_SIZE = 1024 * 1024 * 8; // 8 MiB
+static const size_t REQUEST_HEADER_LENGTH = sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint64_t); // id, cmd, size
 static const uint16_t REQUEST_CMD_GET_HOME = 1;
 static const uint16_t REQUEST_CMD_LIST_DIRECTORY = 2;
 static const uint16_t REQUEST_CMD_GOODBYE = 3;
@@ -200,6 +212,35 @@ static const uint16_t REQUEST_CMD_GROUP_LIST = 20;
 static const uint16_t REQUEST_CMD_COPY_NODE = 21;
 static const uint16_t REQUEST_CMD_MOVE_NODE = 22;
 static const uint16_t REQUEST_CMD_RENAME_NODE = 23;
+static const uint16_t REQUEST_CMD_BATCH = 24;
+// positioned variants of the fd requests, they take an offset and leave the fd position as it is
+static const uint16_t REQUEST_CMD_FD_PREAD = 25;
+static const uint16_t REQUEST_CMD_FD_PWRITE = 26;
+static const uint16_t REQUEST_CMD_FD_PREAD_LONG = 27;
+static const uint16_t REQUEST_CMD_FD_PWRITE_LONG = 28;
+// lists a directory together with the attributes of its entries, the response is the owner of the directory
+// (length u8, owner) followed by node, name length u8, name, type u8, size u64, rights u8, group length u8, group
+// for every entry
+static const uint16_t REQUEST_CMD_LIST_DIRECTORY_PLUS = 29;
+// resolves a shell path to a node: the body is a base node and the path, which is either relative to the base
+// or starts with ~user or #node
+static const uint16_t REQUEST_CMD_RESOLVE_PATH = 30;
+// the response is the absolute ~owner/a/b path of the node
+static const uint16_t REQUEST_CMD_GET_NODE_PATH = 31;
+// recursive variants of remove and copy, they go on past the nodes that fail; the response is the number of
+// processed nodes u64, the number of failed nodes u64 and up to TREE_FAILURES_MAX failures: node, status u16;
+// a copy response starts with the clone of the root
+static const uint16_t REQUEST_CMD_REMOVE_TREE = 32;
+static const uint16_t REQUEST_CMD_COPY_TREE = 33;
+static const size_t TREE_FAILURES_MAX = 64;
+// sets the size of a file opened for writing: fd u8, size u64; it is cut or extended with zeros
+static const uint16_t REQUEST_CMD_FD_TRUNCATE = 34;
+
+// a batch body is a list of sub-requests: cmd, ref, size, body; if ref is N > 0, the response body of the N-th previous
+// sub-request replaces the beginning of the body, e.g. to write to the fd opened just before;
+// the response is a list of status, size, body for every executed sub-request, execution stops on the first error
+static const size_t BATCH_ENTRY_HEADER_LENGTH = sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint64_t); // cmd, ref, size
+static const size_t BATCH_RESULT_HEADER_LENGTH = sizeof(uint16_t) + sizeof(uint64_t); // status, size
 
 static const uint16_t REQUEST_OK = 0;
 static const uint16_t REQUEST_ERR_BODY_TOO_LARGE = 1;
@@ -244,6 +285,9 @@ static const uint64_t NODE_HEAD_OFFSET_OWNER_GROUP = 3;
 
 static const uint8_t NODE_FD_MODE_READ = 0b10;
 static const uint8_t NODE_FD_MODE_WRITE = 0b01;
+static const uint8_t NODE_FD_MODE_NO_TRUNCATE = 0b100; // keeps the content of a file opened for writing only
+// lets the writers of a striped upload hold the file together, implies NODE_FD_MODE_NO_TRUNCATE
+static const uint8_t NODE_FD_MODE_SHARED_WRITE = 0b1000;
 
 static const uint8_t NODE_RIGHTS_GROUP_READ = 0b1000;
 static const uint8_t NODE_RIGHTS_GROUP_WRITE = 0b0100;
@@ -312,6 +356,17 @@ static std::string request_name(uint16_t request) {
     else if (request == REQUEST_CMD_COPY_NODE) return "COPY";
     else if (request == REQUEST_CMD_MOVE_NODE) return "MOVE";
     else if (request == REQUEST_CMD_RENAME_NODE) return "RENM";
+    else if (request == REQUEST_CMD_BATCH) return "BTCH";
+    else if (request == REQUEST_CMD_FD_PREAD) return "FDPR";
+    else if (request == REQUEST_CMD_FD_PWRITE) return "FDPW";
+    else if (request == REQUEST_CMD_FD_PREAD_LONG) return "FPRL";
+    else if (request == REQUEST_CMD_FD_PWRITE_LONG) return "FPWL";
+    else if (request == REQUEST_CMD_LIST_DIRECTORY_PLUS) return "LSTP";
+    else if (request == REQUEST_CMD_RESOLVE_PATH) return "RSLV";
+    else if (request == REQUEST_CMD_GET_NODE_PATH) return "PATH";
+    else if (request == REQUEST_CMD_REMOVE_TREE) return "RMTR";
+    else if (request == REQUEST_CMD_COPY_TREE) return "CPTR";
+    else if (request == REQUEST_CMD_FD_TRUNCATE) return "FTRN";
     else return std::to_string(request);
 }
 
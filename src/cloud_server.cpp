@@ -2,28 +2,108 @@
 #include <iostream>
 #include <filesystem>
 #include <fstream>
+#include <limits>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "cloud_server.h"
 #include "cloud_common.h"
 
+#define EVENT_LOOP_MAX_EVENTS 64
+#define SESSION_MAX_IN_FLIGHT 64 // requests of a session on the workers, more wait until some of them are done
+
 CloudConfig::CloudConfig() = default;
 
 CloudConfig::~CloudConfig() = default;
 
-CloudServer::CloudServer(NetServer *net, const CloudConfig &config) : config(config), net(net),
-                                                                      connector(new std::thread(
-                                                                              [this] { connector_routine(); })) {
+CloudServer::CloudServer(NetServer *net, const CloudConfig &config) : CloudServer(std::vector{net}, config) {
+
+}
+
+CloudServer::CloudServer(const std::vector<NetServer *> &nets, const CloudConfig &config) : config(config), nets(nets),
+                                                                                        node_cache(config.node_cache_size),
+                                                                                        home_cache(config.node_cache_size) {
+    load_users();
     if (!config.access_log.empty()) {
         access_log.open(config.access_log, std::ios_base::out | std::ios_base::app);
         access_log << "-----------------------------------------------" << std::endl;
         access_log << "[" << generate_timestamp() << "] Server started" << std::endl;
     }
+    if (config.io_model == CLOUD_IO_MODEL_EPOLL) {
+        size_t loops = config.event_loops ? config.event_loops : std::max(1u, std::thread::hardware_concurrency());
+        event_loop_wakeup = eventfd(0, 0);
+        if (event_loop_wakeup == -1) {
+            throw std::runtime_error(std::string("failed to create event loop wakeup: ") + strerror(errno));
+        }
+        for (size_t loop = 0; loop < loops; loop++) {
+            int epoll = epoll_create1(0);
+            if (epoll == -1) throw std::runtime_error(std::string("failed to create event loop: ") + strerror(errno));
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.ptr = nullptr;
+            epoll_ctl(epoll, EPOLL_CTL_ADD, event_loop_wakeup, &event);
+            event_loop_fds.push_back(epoll);
+            auto *kick_queue = new KickQueue();
+            kick_queue->event = eventfd(0, EFD_NONBLOCK);
+            if (kick_queue->event == -1) {
+                delete kick_queue;
+                throw std::runtime_error(std::string("failed to create kick queue: ") + strerror(errno));
+            }
+            event.data.ptr = kick_queue;
+            epoll_ctl(epoll, EPOLL_CTL_ADD, kick_queue->event, &event);
+            kick_queues.push_back(kick_queue);
+        }
+        for (size_t loop = 0; loop < loops; loop++) {
+            event_loops.push_back(new std::thread(&CloudServer::event_loop_routine, this, loop));
+        }
+    } else if (config.io_model != CLOUD_IO_MODEL_THREADS) {
+        throw std::invalid_argument("unknown io model '" + config.io_model + "'");
+    }
+    for (size_t worker = 0; worker < config.request_workers; worker++) {
+        workers.push_back(new std::thread(&CloudServer::worker_routine, this));
+    }
+    for (NetServer *net : nets) {
+        size_t shards = net->shards();
+        for (size_t shard = 0; shard < shards; shard++) {
+            auto *connector = new std::thread(&CloudServer::connector_routine, this, net, shard);
+            if (shards > 1) {
+                // acceptors are spread over the cores so that connection bursts are handled in parallel
+                cpu_set_t cpu_set;
+                CPU_ZERO(&cpu_set);
+                CPU_SET(shard % std::max(1u, std::thread::hardware_concurrency()), &cpu_set);
+                pthread_setaffinity_np(connector->native_handle(), sizeof cpu_set, &cpu_set);
+            }
+            connectors.push_back(connector);
+        }
+    }
 }
 
 CloudServer::~CloudServer() {
     shutting_down = true;
-    net->destroy();
-    if (connector->joinable()) connector->join();
-    delete connector;
+    for (NetServer *net : nets) net->destroy();
+    for (std::thread *connector : connectors) {
+        if (connector->joinable()) connector->join();
+        delete connector;
+    }
+    if (!event_loops.empty()) {
+        uint64_t wakeup = 1;
+        write(event_loop_wakeup, &wakeup, sizeof wakeup);
+        for (std::thread *loop : event_loops) {
+            if (loop->joinable()) loop->join();
+            delete loop;
+        }
+        while (!sessions.empty()) close_session(*sessions.begin());
+        for (int epoll : event_loop_fds) close(epoll);
+        for (KickQueue *kick_queue : kick_queues) {
+            close(kick_queue->event);
+            delete kick_queue;
+        }
+        close(event_loop_wakeup);
+    }
     for (Session *session : sessions) {
         session->connection->close();
     }
@@ -31,16 +111,34 @@ CloudServer::~CloudServer() {
         if (listener->joinable()) listener->join();
         delete listener;
     }
+    {
+        std::unique_lock locker(tasks_lock);
+        stopping_workers = true;
+    }
+    tasks_notifier.notify_all();
+    for (std::thread *worker : workers) {
+        if (worker->joinable()) worker->join();
+        delete worker;
+    }
 }
 
-void CloudServer::connector_routine() {
+void CloudServer::connector_routine(NetServer *net, size_t shard) {
     while (!shutting_down) {
         try {
-            NetConnection *connection = new BufferedConnection(config.net_buffer_size, net->accept());
-            auto *session = new Session(connection, session_id++);
-            sessions.insert(session);
-            auto *listener = new std::thread(&CloudServer::listener_routine, this, session);
-            listeners.push_back(listener);
+            auto *connection = new BufferedConnection(config.net_buffer_size, net->accept_shard(shard));
+            Session *session;
+            {
+                std::unique_lock locker(lock);
+                session = new Session(connection, session_id++);
+                sessions.insert(session);
+            }
+            if (!event_loops.empty()) {
+                session->event_loop = int(session->id % event_loops.size());
+                watch_session(session, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP);
+            } else {
+                std::unique_lock locker(lock);
+                listeners.push_back(new std::thread(&CloudServer::listener_routine, this, session));
+            }
         } catch (std::runtime_error &error) {
             if (shutting_down) break;
             else std::cerr << "failed to connect client: " << error.what() << std::endl;
@@ -49,1141 +147,1852 @@ void CloudServer::connector_routine() {
 }
 
 void CloudServer::listener_routine(Session *session) {
-    char *body = nullptr;
+    if (!workers.empty()) {
+        session->wakeup = eventfd(0, EFD_NONBLOCK);
+        if (session->wakeup == -1) {
+            std::cerr << "failed to create session wakeup: " << strerror(errno) << std::endl;
+            close_session(session);
+            return;
+        }
+    }
+    SessionWait wait;
+    while ((wait = serve_session(session)) != WAIT_CLOSED) {
+        pollfd descriptors[2] = {{session->connection->get_fd(), POLLIN, 0},
+                                 {session->wakeup,               POLLIN, 0}};
+        if (wait == WAIT_WRITABLE) descriptors[0].events = session->connection->sendable_events();
+        else if (wait == WAIT_KICK) descriptors[0].fd = -1;
+        if (poll(descriptors, session->wakeup == -1 ? 1 : 2, -1) == -1 && errno != EINTR) {
+            std::cerr << "'" << session->login << "' listener stopped: " << strerror(errno) << std::endl;
+            break;
+        }
+        if (descriptors[1].revents) {
+            uint64_t kicks;
+            read(session->wakeup, &kicks, sizeof kicks);
+        }
+    }
+    close_session(session);
+}
+
+void CloudServer::event_loop_routine(size_t loop) {
+    epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    KickQueue *kick_queue = kick_queues[loop];
+    std::vector<Session *> kicked;
+    while (!shutting_down) {
+        int count = epoll_wait(event_loop_fds[loop], events, EVENT_LOOP_MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            std::cerr << "event loop " << loop << " stopped: " << strerror(errno) << std::endl;
+            break;
+        }
+        bool kick = false;
+        for (int i = 0; i < count && !shutting_down; i++) {
+            void *source = events[i].data.ptr;
+            if (!source) continue; // wakeup
+            if (source == kick_queue) kick = true;
+            else step_session(static_cast<Session *>(source));
+        }
+        if (!kick || shutting_down) continue;
+        // kicked sessions go after the events, none of which may refer to a session that is closed by them then
+        {
+            std::unique_lock locker(kick_queue->lock);
+            uint64_t kicks;
+            read(kick_queue->event, &kicks, sizeof kicks);
+            kicked.swap(kick_queue->sessions);
+            for (Session *session : kicked) session->kicked = false;
+        }
+        for (Session *session : kicked) step_session(session);
+        kicked.clear();
+    }
+}
+
+void CloudServer::step_session(Session *session) {
+    SessionWait wait = serve_session(session);
+    if (wait == WAIT_READABLE) watch_session(session, EPOLL_CTL_MOD, EPOLLIN | EPOLLRDHUP);
+    // poll and epoll events have the same values
+    else if (wait == WAIT_WRITABLE) watch_session(session, EPOLL_CTL_MOD, session->connection->sendable_events());
+    else if (wait == WAIT_CLOSED) {
+        {
+            std::unique_lock locker(session->lock);
+            // the loop doesn't wait for the workers, the kick of the last one brings the session back here
+            if (session->in_flight) {
+                session->closing = true;
+                return;
+            }
+        }
+        close_session(session);
+    }
+}
+
+CloudServer::SessionWait CloudServer::serve_session(Session *session) {
+    // nothing but the peer can wake such a session, so it may as well wait in read
+    bool block = event_loops.empty() && workers.empty();
+    {
+        std::unique_lock locker(session->lock);
+        if (session->parked) return WAIT_KICK;
+        if (session->closing) return session->in_flight ? WAIT_KICK : WAIT_CLOSED;
+    }
+    if (session->transfer) {
+        session->transfer->join();
+        delete session->transfer;
+        session->transfer = nullptr;
+    }
     try {
-        char client_header[CLOUD9_FULL_HEADER_LENGTH];
-        read_exact(session->connection, CLOUD9_FULL_HEADER_LENGTH, &client_header);
-        if (memcmp(&client_header, CLOUD9_HEADER, CLOUD9_HEADER_LENGTH) != 0)
-            throw std::runtime_error("invalid header");
-        char server_header[CLOUD9_FULL_HEADER_LENGTH];
-        memcpy(&server_header, CLOUD9_HEADER, CLOUD9_HEADER_LENGTH);
-        buf_send_uint16(server_header + CLOUD9_HEADER_LENGTH, CLOUD9_REL_CODE);
-        send_exact(session->connection, CLOUD9_FULL_HEADER_LENGTH, &server_header);
-        session->connection->flush();
-        if (memcmp(&client_header, &server_header, CLOUD9_FULL_HEADER_LENGTH) != 0)
-            throw std::runtime_error("version mismatch");
-#define INIT_ERR(err) {log_error(session, err); send_uint16(session->connection, err); session->connection->flush(); throw std::runtime_error(init_status_string(err));}
-        auto cmd = read_uint16(session->connection);
-        auto size = read_uint64(session->connection);
-        if (size > INIT_BODY_MAX_SIZE) INIT_ERR(INIT_ERR_BODY_TOO_LARGE);
-        body = new char[size];
-        read_exact(session->connection, size, body);
-        if (cmd == INIT_CMD_AUTH) {
-            if (size == 0) INIT_ERR(INIT_ERR_MALFORMED_CMD);
-            uint8_t login_length = *reinterpret_cast<uint8_t *>(body);
-            if (login_length > size - sizeof(uint8_t)) INIT_ERR(INIT_ERR_MALFORMED_CMD);
-            session->login = std::string(body + sizeof(uint8_t), login_length);
-            std::string password(body + sizeof(uint8_t) + login_length, body + size);
-            log_init(session, std::pair("login", session->login));
-            if (!is_valid_login(session->login)) INIT_ERR(INIT_ERR_AUTH_FAILED);
-            auto[user_head, user_size] = get_user_head(session->login);
-            if (!user_head) INIT_ERR(INIT_ERR_AUTH_FAILED);
-            std::string salt(user_head + USER_HEAD_OFFSET_SALT, USER_PASSWORD_SALT_LENGTH);
-            std::string password_salted = password + salt;
-            char *sha256 = new char[SHA256_DIGEST_LENGTH];
-            SHA256(reinterpret_cast<const unsigned char *>(password_salted.c_str()), password_salted.length(),
-                   reinterpret_cast<unsigned char *>(sha256));
-            bool ok = memcmp(sha256, user_head + USER_HEAD_OFFSET_HASH, SHA256_DIGEST_LENGTH) == 0;
-            delete[] user_head;
-            delete[] sha256;
-            if (ok) {
-                log_response(session);
-                send_uint16(session->connection, INIT_OK);
-            } else INIT_ERR(INIT_ERR_AUTH_FAILED);
-        } else if (cmd == INIT_CMD_REGISTER) {
-            if (size == 0) INIT_ERR(INIT_ERR_MALFORMED_CMD);
-            uint8_t invite_length = *reinterpret_cast<uint8_t *>(body);
-            std::string invite(body + 1, invite_length);
-            if (size <= 1 + invite_length) INIT_ERR(INIT_ERR_MALFORMED_CMD);
-            uint8_t login_length = *reinterpret_cast<uint8_t *>(body + 1 + invite_length);
-            std::string login(body + 1 + invite_length + 1, login_length);
-            std::string password(body + 1 + invite_length + 1 + login_length, body + size);
-            log_init(session, std::pair("invite", invite), std::pair("login", login));
-            if (std::filesystem::exists(get_user_head_path(login))) INIT_ERR(INIT_ERR_USER_EXISTS);
-            if (!use_invite(invite)) INIT_ERR(INIT_ERR_INVALID_INVITE_CODE);
-            if (!is_valid_login(login)) INIT_ERR(INIT_ERR_INVALID_USERNAME);
-            Node home = generate_node();
+        while (!shutting_down) {
+            size_t output_size;
             {
-                std::ofstream home_head(get_node_head_path(home));
-                std::ofstream home_data(get_node_data_path(home));
-                home_head << NODE_TYPE_DIRECTORY;
-                home_head << char(0);
-                home_head << char(login_length);
-                home_head << login;
+                std::unique_lock locker(session->lock);
+                if (!session->failure.empty()) throw std::runtime_error(session->failure);
+                output_size = session->output.size() + session->sending.size() - session->sending_offset;
+            }
+            // responses are sent in batches, but a peer that doesn't read them is not served any further
+            if (output_size >= config.net_buffer_size && !send_output(session)) return WAIT_WRITABLE;
+            size_t header_length = session->stage == Session::STAGE_NEGOTIATION ? CLOUD9_FULL_HEADER_LENGTH :
+                                   session->stage == Session::STAGE_INIT ? INIT_HEADER_LENGTH : REQUEST_HEADER_LENGTH;
+            if (session->frame_header_fullness < header_length) {
+                size_t length = header_length - session->frame_header_fullness;
+                char *header_end = session->frame_header + session->frame_header_fullness;
+                size_t read = block ? session->connection->read(length, header_end) :
+                              session->connection->read_nonblock(length, header_end);
+                if (!read) return send_output(session) ? WAIT_READABLE : WAIT_WRITABLE;
+                session->frame_header_fullness += read;
+                if (session->frame_header_fullness < header_length) continue;
+                if (session->stage == Session::STAGE_NEGOTIATION) {
+                    negotiate(session, session->frame_header);
+                    session->stage = Session::STAGE_INIT;
+                    session->frame_header_fullness = 0;
+                    continue;
+                }
+                uint64_t size = buf_read_uint64(session->frame_header + header_length - sizeof(uint64_t));
+                if (session->stage == Session::STAGE_INIT && size > INIT_BODY_MAX_SIZE) {
+                    init_error(session, INIT_ERR_BODY_TOO_LARGE);
+                }
+                if (session->stage == Session::STAGE_REQUEST && size > REQUEST_BODY_MAX_SIZE) {
+                    ResponseBuffer response;
+                    send_uint32(&response, buf_read_uint32(session->frame_header));
+                    send_uint16(&response, REQUEST_ERR_BODY_TOO_LARGE);
+                    send_uint64(&response, 0);
+                    {
+                        std::unique_lock locker(session->lock);
+                        session->output += response.data;
+                    }
+                    send_output(session, block); // the session ends anyway, so it isn't waited for otherwise
+                    throw std::runtime_error(request_status_string(REQUEST_ERR_BODY_TOO_LARGE));
+                }
+                session->frame_body = new char[size];
+                session->frame_body_size = size;
+                session->frame_body_fullness = 0;
             }
-            std::ofstream user_file(get_user_head_path(login));
-            std::string salt = generate_salt();
-            user_file << salt;
+            if (session->frame_body_fullness < session->frame_body_size) {
+                size_t length = session->frame_body_size - session->frame_body_fullness;
+                char *body_end = session->frame_body + session->frame_body_fullness;
+                size_t read = block ? session->connection->read(length, body_end) :
+                              session->connection->read_nonblock(length, body_end);
+                if (!read) return send_output(session) ? WAIT_READABLE : WAIT_WRITABLE;
+                session->frame_body_fullness += read;
+                if (session->frame_body_fullness < session->frame_body_size) continue;
+            }
+            if (session->stage == Session::STAGE_INIT) {
+                init_session(session, buf_read_uint16(session->frame_header), session->frame_body_size,
+                             session->frame_body);
+                session->stage = Session::STAGE_REQUEST;
+                session->connection->flush();
+                delete[] session->frame_body;
+                session->frame_body = nullptr;
+                session->frame_body_size = session->frame_body_fullness = 0;
+                session->frame_header_fullness = 0;
+                continue;
+            }
+            uint32_t id = buf_read_uint32(session->frame_header);
+            uint16_t cmd = buf_read_uint16(session->frame_header + sizeof(uint32_t));
+            uint64_t size = session->frame_body_size;
+            bool parallel = !workers.empty() && is_read_only(cmd);
+            {
+                std::unique_lock locker(session->lock);
+                // requests that change anything keep their order relative to the others, the finished
+                // request that waits here is started by the kick of the last worker
+                if (parallel ? session->in_flight >= SESSION_MAX_IN_FLIGHT : session->in_flight > 0) {
+                    locker.unlock();
+                    return send_output(session) ? WAIT_KICK : WAIT_WRITABLE;
+                }
+                if (parallel) session->in_flight++;
+            }
+            char *body = session->frame_body;
+            session->frame_body = nullptr;
+            session->frame_body_size = session->frame_body_fullness = 0;
+            session->frame_header_fullness = 0;
+            if (parallel) submit_request(session, id, cmd, size, body);
+            else if (event_loops.empty()) run_request(session, id, cmd, size, body);
+            else if (!is_long_running(cmd)) queue_request(session, id, cmd, size, body);
+            else {
+                {
+                    std::unique_lock locker(session->lock);
+                    session->parked = true;
+                }
+                session->transfer = new std::thread(&CloudServer::transfer_routine, this, session, id, cmd, size,
+                                                    body);
+                return WAIT_KICK;
+            }
+        }
+    } catch (std::exception &exception) {
+        if (!shutting_down && !session->goodbye) {
+            log_exit(session, exception.what());
+            if (session->stage == Session::STAGE_REQUEST) {
+                std::cerr << "'" << session->login << "' session stopped with exception: " << exception.what()
+                          << std::endl;
+            } else std::cerr << "failed to initialize client connection: " << exception.what() << std::endl;
+        }
+    }
+    return WAIT_CLOSED;
+}
+
+void CloudServer::worker_routine() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock locker(tasks_lock);
+            while (tasks.empty() && !stopping_workers) tasks_notifier.wait(locker);
+            if (tasks.empty()) break;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void CloudServer::transfer_routine(Session *session, uint32_t id, uint16_t cmd, uint64_t size, char *body) {
+    try {
+        run_request(session, id, cmd, size, body);
+    } catch (std::exception &exception) {
+        std::unique_lock locker(session->lock);
+        if (session->failure.empty()) session->failure = exception.what();
+    }
+    std::unique_lock locker(session->lock);
+    session->parked = false;
+    kick_session(session);
+}
+
+bool CloudServer::is_read_only(uint16_t cmd) {
+    return cmd == REQUEST_CMD_GET_HOME || cmd == REQUEST_CMD_LIST_DIRECTORY || cmd == REQUEST_CMD_GET_PARENT ||
+           cmd == REQUEST_CMD_GET_NODE_OWNER || cmd == REQUEST_CMD_GET_NODE_INFO ||
+           cmd == REQUEST_CMD_GET_NODE_GROUP || cmd == REQUEST_CMD_GROUP_LIST || cmd == REQUEST_CMD_FD_PREAD ||
+           cmd == REQUEST_CMD_LIST_DIRECTORY_PLUS || cmd == REQUEST_CMD_RESOLVE_PATH ||
+           cmd == REQUEST_CMD_GET_NODE_PATH;
+}
+
+bool CloudServer::is_long_running(uint16_t cmd) {
+    return cmd == REQUEST_CMD_FD_READ_LONG || cmd == REQUEST_CMD_FD_WRITE_LONG || cmd == REQUEST_CMD_FD_PREAD_LONG ||
+           cmd == REQUEST_CMD_FD_PWRITE_LONG || cmd == REQUEST_CMD_COPY_NODE || cmd == REQUEST_CMD_COPY_TREE ||
+           cmd == REQUEST_CMD_REMOVE_TREE;
+}
+
+void CloudServer::submit_request(Session *session, uint32_t id, uint16_t cmd, uint64_t size, char *body) {
+    // the worker never touches the connection, so a peer that doesn't read holds up nobody but its own session
+    std::unique_lock locker(tasks_lock);
+    tasks.emplace_back([this, session, id, cmd, size, body]() {
+        ResponseBuffer response;
+        std::string failure;
+        try {
+            handle_request(session, &response, id, cmd, size, body);
+        } catch (std::exception &exception) {
+            failure = exception.what();
+        }
+        delete[] body;
+        std::unique_lock session_locker(session->lock);
+        if (failure.empty()) session->output += response.data;
+        else if (session->failure.empty()) session->failure = failure;
+        if (--session->in_flight == 0) session->idle.notify_all();
+        kick_session(session);
+    });
+    tasks_notifier.notify_one();
+}
+
+void CloudServer::run_request(Session *session, uint32_t id, uint16_t cmd, uint64_t size, char *body) {
+    try {
+        send_output(session, true);
+        handle_request(session, session->connection, id, cmd, size, body);
+        session->connection->flush();
+    } catch (...) {
+        delete[] body;
+        throw;
+    }
+    delete[] body;
+}
+
+void CloudServer::queue_request(Session *session, uint32_t id, uint16_t cmd, uint64_t size, char *body) {
+    ResponseBuffer response;
+    try {
+        handle_request(session, &response, id, cmd, size, body);
+    } catch (...) {
+        delete[] body;
+        throw;
+    }
+    delete[] body;
+    std::unique_lock locker(session->lock);
+    session->output += response.data;
+}
+
+bool CloudServer::send_output(Session *session, bool block) {
+    while (true) {
+        if (session->sending_offset == session->sending.size()) {
+            session->sending.clear();
+            session->sending_offset = 0;
+            std::unique_lock locker(session->lock);
+            if (session->output.empty()) return true;
+            session->sending.swap(session->output);
+        }
+        size_t length = session->sending.size() - session->sending_offset;
+        const char *data = session->sending.c_str() + session->sending_offset;
+        size_t sent = block ? session->connection->send(length, data) :
+                      session->connection->send_nonblock(length, data);
+        if (!sent) return false;
+        session->sending_offset += sent;
+    }
+}
+
+void CloudServer::kick_session(Session *session) {
+    uint64_t kick = 1;
+    if (session->event_loop == -1) {
+        if (session->wakeup != -1) write(session->wakeup, &kick, sizeof kick);
+        return;
+    }
+    KickQueue *kick_queue = kick_queues[session->event_loop];
+    std::unique_lock locker(kick_queue->lock);
+    if (session->kicked) return;
+    session->kicked = true;
+    kick_queue->sessions.push_back(session);
+    write(kick_queue->event, &kick, sizeof kick);
+}
+
+void CloudServer::wait_idle(Session *session) {
+    std::unique_lock locker(session->lock);
+    while (session->in_flight) session->idle.wait(locker);
+}
+
+void CloudServer::watch_session(Session *session, int op, uint32_t events) {
+    epoll_event event{};
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = session;
+    if (epoll_ctl(event_loop_fds[session->event_loop], op, session->connection->get_fd(), &event)) {
+        throw std::runtime_error(std::string("failed to watch session: ") + strerror(errno));
+    }
+}
+
+void CloudServer::close_session(Session *session) {
+    if (session->event_loop != -1 && session->connection->is_valid()) {
+        epoll_ctl(event_loop_fds[session->event_loop], EPOLL_CTL_DEL, session->connection->get_fd(), nullptr);
+    }
+    session->connection->close(); // ends a transfer that still waits for the peer
+    if (session->transfer) {
+        session->transfer->join();
+        delete session->transfer;
+    }
+    wait_idle(session);
+    if (session->event_loop != -1) {
+        // no worker is left to kick it again
+        KickQueue *kick_queue = kick_queues[session->event_loop];
+        std::unique_lock locker(kick_queue->lock);
+        if (session->kicked) {
+            kick_queue->sessions.erase(std::find(kick_queue->sessions.begin(), kick_queue->sessions.end(), session));
+        }
+    }
+    std::unique_lock locker(lock);
+    for (Session::FileDescriptor fd : session->fds) {
+        if (fd.file != -1) close_fd(session, fd);
+    }
+    delete[] session->frame_body;
+    if (session->wakeup != -1) close(session->wakeup);
+    delete session->connection;
+    sessions.erase(session);
+    delete session;
+}
+
+void CloudServer::negotiate(Session *session, const char *client_header) {
+    uint64_t handshake_time = session->connection->handshake_time();
+    if (handshake_time) log_init(session, std::pair("handshake_us", std::to_string(handshake_time)));
+    if (memcmp(client_header, CLOUD9_HEADER, CLOUD9_HEADER_LENGTH) != 0)
+        throw std::runtime_error("invalid header");
+    char server_header[CLOUD9_FULL_HEADER_LENGTH];
+    memcpy(&server_header, CLOUD9_HEADER, CLOUD9_HEADER_LENGTH);
+    buf_send_uint16(server_header + CLOUD9_HEADER_LENGTH, CLOUD9_REL_CODE);
+    send_exact(session->connection, CLOUD9_FULL_HEADER_LENGTH, &server_header);
+    session->connection->flush();
+    if (memcmp(client_header, &server_header, CLOUD9_FULL_HEADER_LENGTH) != 0)
+        throw std::runtime_error("version mismatch");
+}
+
+void CloudServer::init_error(Session *session, uint16_t error) {
+    log_error(session, error);
+    send_uint16(session->connection, error);
+    session->connection->flush();
+    throw std::runtime_error(init_status_string(error));
+}
+
+void CloudServer::init_session(Session *session, uint16_t cmd, uint64_t size, char *body) {
+    if (cmd == INIT_CMD_AUTH) {
+        if (size == 0) init_error(session, INIT_ERR_MALFORMED_CMD);
+        uint8_t login_length = *reinterpret_cast<uint8_t *>(body);
+        if (login_length > size - sizeof(uint8_t)) init_error(session, INIT_ERR_MALFORMED_CMD);
+        session->login = std::string(body + sizeof(uint8_t), login_length);
+        std::string password(body + sizeof(uint8_t) + login_length, body + size);
+        bool trusted = session->connection->is_trusted();
+        if (trusted) log_init(session, std::pair("login", session->login), std::pair("trusted", "1"));
+        else log_init(session, std::pair("login", session->login));
+        if (!is_valid_login(session->login)) init_error(session, INIT_ERR_AUTH_FAILED);
+        std::string salt, hash;
+        {
+            std::shared_lock global_locker(lock);
+            auto user = users.find(session->login);
+            if (user == users.end()) init_error(session, INIT_ERR_AUTH_FAILED);
+            salt = user->second.salt;
+            hash = user->second.hash;
+        }
+        bool ok = trusted; // the peer runs as the server owner and could read the cloud directly anyway
+        if (!ok) {
             std::string password_salted = password + salt;
             char *sha256 = new char[SHA256_DIGEST_LENGTH];
             SHA256(reinterpret_cast<const unsigned char *>(password_salted.c_str()), password_salted.length(),
                    reinterpret_cast<unsigned char *>(sha256));
-            user_file << std::string(sha256, SHA256_DIGEST_LENGTH);
+            ok = memcmp(sha256, hash.c_str(), SHA256_DIGEST_LENGTH) == 0;
             delete[] sha256;
-            user_file << std::string(reinterpret_cast<const char *>(&home), sizeof(Node));
-            session->login = login;
+        }
+        if (ok) {
             log_response(session);
             send_uint16(session->connection, INIT_OK);
-        } else INIT_ERR(INIT_ERR_INVALID_CMD);
-#undef INIT_ERR
-    } catch (std::exception &exception) {
-        if (!shutting_down) {
-            log_exit(session, exception.what());
-            std::cerr << "failed to initialize client connection: " << exception.what() << std::endl;
+        } else init_error(session, INIT_ERR_AUTH_FAILED);
+    } else if (cmd == INIT_CMD_REGISTER) {
+        if (size == 0) init_error(session, INIT_ERR_MALFORMED_CMD);
+        uint8_t invite_length = *reinterpret_cast<uint8_t *>(body);
+        std::string invite(body + 1, invite_length);
+        if (size <= 1 + invite_length) init_error(session, INIT_ERR_MALFORMED_CMD);
+        uint8_t login_length = *reinterpret_cast<uint8_t *>(body + 1 + invite_length);
+        std::string login(body + 1 + invite_length + 1, login_length);
+        std::string password(body + 1 + invite_length + 1 + login_length, body + size);
+        log_init(session, std::pair("invite", invite), std::pair("login", login));
+        std::unique_lock global_locker(lock); // guards users and two registrations of the same login
+        if (users.count(login)) init_error(session, INIT_ERR_USER_EXISTS);
+        if (!use_invite(invite)) init_error(session, INIT_ERR_INVALID_INVITE_CODE);
+        if (!is_valid_login(login)) init_error(session, INIT_ERR_INVALID_USERNAME);
+        Node home = generate_node();
+        {
+            std::ofstream home_data(get_node_data_path(home));
+            std::string home_head;
+            home_head += NODE_TYPE_DIRECTORY;
+            home_head += char(0);
+            home_head += char(login_length);
+            home_head += login;
+            set_node_head(home, home_head);
         }
-        delete[] body;
-        session->connection->close();
-        delete session->connection;
-        sessions.erase(session);
-        delete session;
+        User user;
+        user.salt = generate_salt();
+        std::string password_salted = password + user.salt;
+        char *sha256 = new char[SHA256_DIGEST_LENGTH];
+        SHA256(reinterpret_cast<const unsigned char *>(password_salted.c_str()), password_salted.length(),
+               reinterpret_cast<unsigned char *>(sha256));
+        user.hash = std::string(sha256, SHA256_DIGEST_LENGTH);
+        delete[] sha256;
+        user.home = home;
+        add_user(login, user);
+        save_user(login);
+        global_locker.unlock();
+        session->login = login;
+        log_response(session);
+        send_uint16(session->connection, INIT_OK);
+    } else init_error(session, INIT_ERR_INVALID_CMD);
+}
+
+void CloudServer::handle_request(Session *session, NetConnection *connection, uint32_t id, uint16_t cmd,
+                                 uint64_t size, char *body) {
+    if (cmd == REQUEST_CMD_BATCH) {
+        handle_batch(session, connection, id, size, body);
         return;
     }
-    bool goodbye = false;
-    try {
-        while (!shutting_down) {
-            session->connection->flush();
-            auto id = read_uint32(session->connection);
-            auto cmd = read_uint16(session->connection);
-            auto size = read_uint64(session->connection);
-            if (size > REQUEST_BODY_MAX_SIZE) {
-                send_uint32(session->connection, id);
-                send_uint16(session->connection, REQUEST_ERR_BODY_TOO_LARGE);
-                send_uint64(session->connection, 0);
-                throw std::runtime_error(request_status_string(REQUEST_ERR_BODY_TOO_LARGE));
+    bool read_only = is_read_only(cmd);
+    std::unique_lock global_locker(lock, std::defer_lock);
+    std::shared_lock shared_locker(lock, std::defer_lock);
+    std::unique_lock session_locker(session->lock, std::defer_lock);
+    if (read_only) {
+        shared_locker.lock();
+    } else {
+        global_locker.lock();
+        session_locker.lock();
+    }
+    send_uint32(connection, id);
+    if (cmd == REQUEST_CMD_GET_HOME) {
+        std::string user = size == 0 ? session->login : std::string(body, size);
+        log_request(session, cmd, std::pair("user", user));
+        auto user_entry = users.find(user);
+        if (user_entry == users.end()) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+        } else {
+            Node home = user_entry->second.home;
+            log_response(session, std::pair("home", node2string(home)));
+            send_uint16(connection, REQUEST_OK);
+            send_uint64(connection, sizeof(Node));
+            send_exact(connection, sizeof(Node), &home);
+        }
+    } else if (cmd == REQUEST_CMD_LIST_DIRECTORY) {
+        if (size != sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        log_request(session, cmd, std::pair("dir", node2string(node)));
+        auto[node_head, head_size] = get_node_head(node);
+        if (!node_head) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint8_t type = *(node_head + NODE_HEAD_OFFSET_TYPE);
+        delete[] node_head;
+        ReadWrite rights = get_user_rights(node, session->login);
+        if (!rights.read) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (type != NODE_TYPE_DIRECTORY) {
+            log_error(session, REQUEST_ERR_NOT_A_DIRECTORY);
+            send_uint16(connection, REQUEST_ERR_NOT_A_DIRECTORY);
+            send_uint64(connection, 0);
+            return;
+        }
+        std::ifstream node_data_file(get_node_data_path(node));
+        std::string node_data((std::istreambuf_iterator<char>(node_data_file)),
+                              std::istreambuf_iterator<char>());
+        log_response(session, std::pair("dir_node_size", std::to_string(node_data.length())));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, node_data.size());
+        send_exact(connection, node_data.size(), node_data.c_str());
+    } else if (cmd == REQUEST_CMD_LIST_DIRECTORY_PLUS) {
+        if (size != sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        log_request(session, cmd, std::pair("dir", node2string(node)));
+        auto[node_head, head_size] = get_node_head(node);
+        if (!node_head) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint8_t type = *(node_head + NODE_HEAD_OFFSET_TYPE);
+        delete[] node_head;
+        ReadWrite rights = get_user_rights(node, session->login);
+        if (!rights.read) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (type != NODE_TYPE_DIRECTORY) {
+            log_error(session, REQUEST_ERR_NOT_A_DIRECTORY);
+            send_uint16(connection, REQUEST_ERR_NOT_A_DIRECTORY);
+            send_uint64(connection, 0);
+            return;
+        }
+        std::ifstream node_data_file(get_node_data_path(node));
+        std::string node_data((std::istreambuf_iterator<char>(node_data_file)),
+                              std::istreambuf_iterator<char>());
+        // every entry shares the owner of the directory, so it is sent once
+        std::string owner = get_node_owner(node);
+        std::string response;
+        response += char(owner.length());
+        response += owner;
+        size_t count = 0;
+        for (size_t offset = 0; offset + sizeof(Node) < node_data.size();) {
+            Node child = *reinterpret_cast<const Node *>(node_data.c_str() + offset);
+            size_t entry_size = sizeof(Node) + 1 + uint8_t(node_data[offset + sizeof(Node)]);
+            std::string entry = node_data.substr(offset, entry_size);
+            offset += entry_size;
+            auto[child_head, child_head_size] = get_node_head(child);
+            if (!child_head) continue;
+            char attributes[sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint8_t)];
+            attributes[0] = char(*(child_head + NODE_HEAD_OFFSET_TYPE));
+            buf_send_uint64(attributes + 1, std::filesystem::file_size(get_node_data_path(child)));
+            attributes[1 + sizeof(uint64_t)] = char(*(child_head + NODE_HEAD_OFFSET_RIGHTS));
+            std::string group = get_node_group(child_head);
+            delete[] child_head;
+            response += entry;
+            response.append(attributes, sizeof attributes);
+            response += char(group.length());
+            response += group;
+            count++;
+        }
+        log_response(session, std::pair("entries", std::to_string(count)));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, response.size());
+        send_exact(connection, response.size(), response.c_str());
+    } else if (cmd == REQUEST_CMD_RESOLVE_PATH) {
+        if (size < sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node base = *reinterpret_cast<Node *>(body);
+        std::string path(body + sizeof(Node), size - sizeof(Node));
+        log_request(session, cmd, std::pair("base", node2string(base)), std::pair("path", path));
+        Node node;
+        uint16_t error = resolve_path(session, base, path, node);
+        if (error != REQUEST_OK) {
+            log_error(session, error);
+            send_uint16(connection, error);
+            send_uint64(connection, 0);
+            return;
+        }
+        log_response(session, std::pair("node", node2string(node)));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, sizeof(Node));
+        send_exact(connection, sizeof(Node), &node);
+    } else if (cmd == REQUEST_CMD_GET_NODE_PATH) {
+        if (size != sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        log_request(session, cmd, std::pair("node", node2string(node)));
+        std::string path;
+        uint16_t error = get_node_path(session, node, path);
+        if (error != REQUEST_OK) {
+            log_error(session, error);
+            send_uint16(connection, error);
+            send_uint64(connection, 0);
+            return;
+        }
+        log_response(session, std::pair("path", path));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, path.length());
+        send_exact(connection, path.length(), path.c_str());
+    } else if (cmd == REQUEST_CMD_GOODBYE) {
+        log_request(session, REQUEST_CMD_GOODBYE);
+        session->goodbye = true;
+        log_response(session);
+        log_exit(session, "leaving by own choice");
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, size);
+        send_exact(connection, size, body);
+    } else if (cmd == REQUEST_CMD_GET_PARENT) {
+        if (size != sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        log_request(session, cmd, std::pair("node", node2string(node)));
+        uint16_t error = REQUEST_OK;
+        Node parent;
+        bool ok = get_parent(node, parent, error);
+        if (ok) {
+            log_response(session, std::pair("parent", node2string(parent)));
+            send_uint16(connection, REQUEST_OK);
+            send_uint64(connection, sizeof(Node));
+            send_exact(connection, sizeof(Node), &parent);
+        } else {
+            if (error != REQUEST_OK) log_error(session, error);
+            else log_response(session, std::pair("parent", ""));
+            send_uint16(connection, error);
+            send_uint64(connection, 0);
+        }
+    } else if (cmd == REQUEST_CMD_MAKE_NODE) {
+        if (size < sizeof(Node) + 1) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        auto name_len = *reinterpret_cast<uint8_t *>(body + sizeof(Node));
+        if (sizeof(Node) + 1 + name_len + 1 != size) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint8_t type = body[size - 1];
+        std::string name(body + sizeof(Node) + 1, name_len);
+        Node parent = *reinterpret_cast<Node *>(body);
+        log_request(session, cmd, std::pair("name", name), std::pair("type", std::to_string(type)),
+                    std::pair("parent", node2string(parent)));
+        if (!is_valid_name(name)) {
+            log_error(session, REQUEST_ERR_INVALID_NAME);
+            send_uint16(connection, REQUEST_ERR_INVALID_NAME);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (type != NODE_TYPE_FILE && type != NODE_TYPE_DIRECTORY) {
+            log_error(session, REQUEST_ERR_INVALID_TYPE);
+            send_uint16(connection, REQUEST_ERR_INVALID_TYPE);
+            send_uint64(connection, 0);
+            return;
+        }
+        auto[parent_head, parent_head_size] = get_node_head(parent);
+        if (!parent_head) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!get_user_rights(parent, session->login).write) {
+            delete[] parent_head;
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (*reinterpret_cast<uint8_t *>(parent_head + NODE_HEAD_OFFSET_TYPE) != NODE_TYPE_DIRECTORY) {
+            delete[] parent_head;
+            log_error(session, REQUEST_ERR_NOT_A_DIRECTORY);
+            send_uint16(connection, REQUEST_ERR_NOT_A_DIRECTORY);
+            send_uint64(connection, 0);
+            return;
+        }
+        auto[parent_data, parent_data_size] = get_node_data(parent);
+        {
+            auto *pos = parent_data;
+            bool exists = false;
+            while (pos < parent_data + parent_data_size) {
+                pos += sizeof(Node);
+                uint8_t child_name_len = *reinterpret_cast<uint8_t *>(pos);
+                pos++;
+                std::string child_name(pos, child_name_len);
+                if (child_name == name) {
+                    exists = true;
+                    break;
+                }
+                pos += child_name_len;
             }
-            delete[] body;
-            body = new char[size];
-            read_exact(session->connection, size, body);
-            std::unique_lock global_locker(lock);
-            std::unique_lock session_locker(session->lock);
-            send_uint32(session->connection, id);
-            if (cmd == REQUEST_CMD_GET_HOME) {
-                std::string user = size == 0 ? session->login : std::string(body, size);
-                log_request(session, cmd, std::pair("user", user));
-                auto[user_head, user_size] = get_user_head(user);
-                if (!user_head) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                } else {
-                    Node home = *reinterpret_cast<const Node *>(user_head + USER_HEAD_OFFSET_HOME);
-                    delete[] user_head;
-                    log_response(session, std::pair("home", node2string(home)));
-                    send_uint16(session->connection, REQUEST_OK);
-                    send_uint64(session->connection, sizeof(Node));
-                    send_exact(session->connection, sizeof(Node), &home);
-                }
-            } else if (cmd == REQUEST_CMD_LIST_DIRECTORY) {
-                if (size != sizeof(Node)) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                log_request(session, cmd, std::pair("dir", node2string(node)));
-                auto[node_head, head_size] = get_node_head(node);
-                if (!node_head) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                uint8_t type = *(node_head + NODE_HEAD_OFFSET_TYPE);
-                delete[] node_head;
-                ReadWrite rights = get_user_rights(node, session->login);
-                if (!rights.read) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (type != NODE_TYPE_DIRECTORY) {
-                    log_error(session, REQUEST_ERR_NOT_A_DIRECTORY);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_A_DIRECTORY);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                std::ifstream node_data_file(get_node_data_path(node));
-                std::string node_data((std::istreambuf_iterator<char>(node_data_file)),
-                                      std::istreambuf_iterator<char>());
-                log_response(session, std::pair("dir_node_size", std::to_string(node_data.length())));
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, node_data.size());
-                send_exact(session->connection, node_data.size(), node_data.c_str());
-            } else if (cmd == REQUEST_CMD_GOODBYE) {
-                log_request(session, REQUEST_CMD_GOODBYE);
-                goodbye = true;
-                log_response(session);
-                log_exit(session, "leaving by own choice");
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, size);
-                send_exact(session->connection, size, body);
-            } else if (cmd == REQUEST_CMD_GET_PARENT) {
-                if (size != sizeof(Node)) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                log_request(session, cmd, std::pair("node", node2string(node)));
-                uint16_t error = REQUEST_OK;
-                Node parent;
-                bool ok = get_parent(node, parent, error);
-                if (ok) {
-                    log_response(session, std::pair("parent", node2string(parent)));
-                    send_uint16(session->connection, REQUEST_OK);
-                    send_uint64(session->connection, sizeof(Node));
-                    send_exact(session->connection, sizeof(Node), &parent);
-                } else {
-                    if (error != REQUEST_OK) log_error(session, error);
-                    else log_response(session, std::pair("parent", ""));
-                    send_uint16(session->connection, error);
-                    send_uint64(session->connection, 0);
-                }
-            } else if (cmd == REQUEST_CMD_MAKE_NODE) {
-                if (size < sizeof(Node) + 1) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                auto name_len = *reinterpret_cast<uint8_t *>(body + sizeof(Node));
-                if (sizeof(Node) + 1 + name_len + 1 != size) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                uint8_t type = body[size - 1];
-                std::string name(body + sizeof(Node) + 1, name_len);
-                Node parent = *reinterpret_cast<Node *>(body);
-                log_request(session, cmd, std::pair("name", name), std::pair("type", std::to_string(type)),
-                            std::pair("parent", node2string(parent)));
-                if (!is_valid_name(name)) {
-                    log_error(session, REQUEST_ERR_INVALID_NAME);
-                    send_uint16(session->connection, REQUEST_ERR_INVALID_NAME);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (type != NODE_TYPE_FILE && type != NODE_TYPE_DIRECTORY) {
-                    log_error(session, REQUEST_ERR_INVALID_TYPE);
-                    send_uint16(session->connection, REQUEST_ERR_INVALID_TYPE);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                auto[parent_head, parent_head_size] = get_node_head(parent);
-                if (!parent_head) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!get_user_rights(parent, session->login).write) {
-                    delete[] parent_head;
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (*reinterpret_cast<uint8_t *>(parent_head + NODE_HEAD_OFFSET_TYPE) != NODE_TYPE_DIRECTORY) {
-                    delete[] parent_head;
-                    log_error(session, REQUEST_ERR_NOT_A_DIRECTORY);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_A_DIRECTORY);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                auto[parent_data, parent_data_size] = get_node_data(parent);
-                {
-                    auto *pos = parent_data;
-                    bool exists = false;
-                    while (pos < parent_data + parent_data_size) {
-                        pos += sizeof(Node);
-                        uint8_t child_name_len = *reinterpret_cast<uint8_t *>(pos);
-                        pos++;
-                        std::string child_name(pos, child_name_len);
-                        if (child_name == name) {
-                            exists = true;
-                            break;
-                        }
-                        pos += child_name_len;
-                    }
-                    if (exists) {
-                        delete[] parent_data;
-                        delete[] parent_head;
-                        log_error(session, REQUEST_ERR_EXISTS);
-                        send_uint16(session->connection, REQUEST_ERR_EXISTS);
-                        send_uint64(session->connection, 0);
-                        continue;
-                    }
-                }
-                std::string parent_data_string(parent_data, parent_data_size);
+            if (exists) {
                 delete[] parent_data;
-                Node node = generate_node();
-                parent_data_string += std::string(reinterpret_cast<const char *>(&node), sizeof(Node));
-                parent_data_string += ' ';
-                parent_data_string.back() = name_len;
-                parent_data_string += name;
-                {
-                    std::ofstream parent_data_file(get_node_data_path(parent));
-                    parent_data_file << parent_data_string;
-                }
-                {
-                    std::ofstream data_stream(get_node_data_path(node));
-                    std::ofstream head_stream(get_node_head_path(node));
-                    std::string header;
-                    header += type;
-                    header += parent_head[NODE_HEAD_OFFSET_RIGHTS];
-                    header += parent_head[NODE_HEAD_OFFSET_OWNER_GROUP_SIZE];
-                    header += std::string(
-                            parent_head + NODE_HEAD_OFFSET_OWNER_GROUP,
-                            (size_t) *reinterpret_cast<uint8_t *>(parent_head + NODE_HEAD_OFFSET_OWNER_GROUP_SIZE)
-                    );
-                    header += std::string(reinterpret_cast<const char *>(&parent), sizeof(Node));
-                    head_stream << header;
-                }
                 delete[] parent_head;
-                log_response(session, std::pair("node", node2string(node)));
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, sizeof(Node));
-                send_exact(session->connection, sizeof(Node), &node);
-            } else if (cmd == REQUEST_CMD_GET_NODE_OWNER) {
-                if (size != sizeof(Node)) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                log_request(session, cmd, std::pair("node", node2string(node)));
-                if (!node_exists(node)) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                std::string owner = get_node_owner(node);
-                log_response(session, std::pair("owner", owner));
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, owner.length());
-                send_exact(session->connection, owner.length(), owner.c_str());
-            } else if (cmd == REQUEST_CMD_FD_OPEN) {
-                if (size != sizeof(Node) + 1) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                log_request(session, cmd, std::pair("node", node2string(node)));
-                if (!node_exists(node)) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                auto *node_head = get_node_head(node).first;
-                if (*reinterpret_cast<uint8_t *>(node_head + NODE_HEAD_OFFSET_TYPE) != NODE_TYPE_FILE) {
-                    delete[] node_head;
-                    log_error(session, REQUEST_ERR_NOT_A_FILE);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_A_FILE);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                delete[] node_head;
-                uint8_t mode = *reinterpret_cast<uint8_t *>(body + sizeof(Node));
-                bool read = mode & NODE_FD_MODE_READ;
-                bool write = mode & NODE_FD_MODE_WRITE;
-                ReadWrite rights = get_user_rights(node, session->login);
-                if ((read && !rights.read) || (write && !rights.write)) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if ((read && writers[node]) || (write && (writers[node] || !readers[node].empty()))) {
-                    log_error(session, REQUEST_ERR_BUSY);
-                    send_uint16(session->connection, REQUEST_ERR_BUSY);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                size_t fd;
-                for (fd = 0; fd < session->fds.size(); fd++) {
-                    if (!session->fds[fd].stream) break;
-                }
-                if (fd == session->fds.size()) {
-                    if (fd > 0xFF) {
-                        log_error(session, REQUEST_ERR_TOO_MANY_FDS);
-                        send_uint16(session->connection, REQUEST_ERR_TOO_MANY_FDS);
-                        send_uint64(session->connection, 0);
-                        continue;
-                    } else session->fds.emplace_back();
-                }
-                auto s_mode = std::ios_base::binary;
-                if (read) s_mode |= std::ios_base::in;
-                if (write) s_mode |= std::ios_base::out;
-                auto *stream = new std::fstream(get_node_data_path(node), s_mode);
-                session->fds[fd].node = node;
-                session->fds[fd].stream = stream;
-                session->fds[fd].mode = mode;
-                if (read) readers[node].insert(session);
-                if (write) writers[node] = session;
-                log_response(session, std::pair("fd", std::to_string(fd)));
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, 1);
-                send_uint8(session->connection, fd);
-            } else if (cmd == REQUEST_CMD_FD_CLOSE) {
-                if (size != 1) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                uint8_t fd = *reinterpret_cast<uint8_t *>(body);
-                log_request(session, cmd, std::pair("fd", std::to_string(fd)));
-                if (fd >= session->fds.size()) {
-                    log_error(session, REQUEST_ERR_BAD_FD);
-                    send_uint16(session->connection, REQUEST_ERR_BAD_FD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Session::FileDescriptor descriptor = session->fds[fd];
-                if (!descriptor.stream) {
-                    log_error(session, REQUEST_ERR_BAD_FD);
-                    send_uint16(session->connection, REQUEST_ERR_BAD_FD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                close_fd(session, descriptor);
-                session->fds[fd].stream = nullptr;
-                log_response(session);
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, 1);
-                send_uint8(session->connection, fd);
-            } else if (cmd == REQUEST_CMD_FD_WRITE) {
-                if (size < 1) {
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                uint8_t fd = *reinterpret_cast<uint8_t *>(body);
-                if (fd >= session->fds.size()) {
-                    send_uint16(session->connection, REQUEST_ERR_BAD_FD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Session::FileDescriptor descriptor = session->fds[fd];
-                if (!descriptor.stream) {
-                    send_uint16(session->connection, REQUEST_ERR_BAD_FD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!(descriptor.mode & NODE_FD_MODE_WRITE)) {
-                    send_uint16(session->connection, REQUEST_ERR_NOT_SUPPORTED);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                descriptor.stream->write(body + 1, size - 1);
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, 0);
-            } else if (cmd == REQUEST_CMD_FD_READ) {
-                if (size != 1 + sizeof(uint32_t)) {
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                uint8_t fd = *reinterpret_cast<uint8_t *>(body);
-                if (fd >= session->fds.size()) {
-                    send_uint16(session->connection, REQUEST_ERR_BAD_FD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Session::FileDescriptor descriptor = session->fds[fd];
-                if (!descriptor.stream) {
-                    send_uint16(session->connection, REQUEST_ERR_BAD_FD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!(descriptor.mode & NODE_FD_MODE_READ)) {
-                    send_uint16(session->connection, REQUEST_ERR_NOT_SUPPORTED);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (descriptor.stream->eof()) {
-                    send_uint16(session->connection, REQUEST_ERR_END_OF_FILE);
-                    send_uint64(session->connection, 0);
-                    continue;
-                } else {
-                    uint32_t count = buf_read_uint32(body + 1);
-                    if (count > config.data_buffer_size) {
-                        send_uint16(session->connection, REQUEST_ERR_READ_BLOCK_IS_TOO_LARGE);
-                        send_uint64(session->connection, 0);
-                        continue;
-                    } else {
-                        char *buffer = new char[count];
-                        descriptor.stream->read(buffer, count);
-                        uint32_t read = descriptor.stream->gcount();
-                        try {
-                            send_uint16(session->connection, REQUEST_OK);
-                            send_uint64(session->connection, read);
-                            send_exact(session->connection, read, buffer);
-                        } catch (...) {
-                            delete[] buffer;
-                            throw;
-                        }
-                        delete[] buffer;
-                    }
-                }
-            } else if (cmd == REQUEST_CMD_GET_NODE_INFO) {
-                if (size != sizeof(Node)) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                log_request(session, cmd, std::pair("node", node2string(node)));
-                if (!node_exists(node)) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                auto[node_head, node_size] = get_node_head(node);
-                uint8_t file_type = *reinterpret_cast<uint8_t *>(node_head + NODE_HEAD_OFFSET_TYPE);
-                uint8_t file_rights = *reinterpret_cast<uint8_t *>(node_head + NODE_HEAD_OFFSET_RIGHTS);
-                delete[] node_head;
-                uint64_t file_size = std::filesystem::file_size(get_node_data_path(node));
-                log_response(session,
-                             std::pair("type", std::to_string(file_type)),
-                             std::pair("size", std::to_string(file_size)),
-                             std::pair("rights", rights2string(file_rights)));
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint8_t));
-                send_uint8(session->connection, file_type);
-                send_uint64(session->connection, file_size);
-                send_uint8(session->connection, file_rights);
-            } else if (cmd == REQUEST_CMD_FD_READ_LONG) {
-                if (size != 1 + sizeof(uint64_t)) {
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                uint8_t fd = *reinterpret_cast<uint8_t *>(body);
-                uint64_t count = buf_read_uint64(body + 1);
-                if (fd >= session->fds.size()) {
-                    send_uint16(session->connection, REQUEST_ERR_BAD_FD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Session::FileDescriptor descriptor = session->fds[fd];
-                if (!descriptor.stream) {
-                    send_uint16(session->connection, REQUEST_ERR_BAD_FD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!(descriptor.mode & NODE_FD_MODE_READ)) {
-                    send_uint16(session->connection, REQUEST_ERR_NOT_SUPPORTED);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                {
-                    uint64_t pos = descriptor.stream->tellg();
-                    descriptor.stream->seekg(0, std::fstream::end);
-                    uint64_t length = descriptor.stream->tellg();
-                    descriptor.stream->seekg(pos, std::fstream::beg);
-                    if (pos + count > length) {
-                        send_uint16(session->connection, REQUEST_ERR_END_OF_FILE);
-                        send_uint64(session->connection, 0);
-                    }
-                }
-                send_uint16(session->connection, REQUEST_SWITCH_OK);
-                send_uint64(session->connection, 0);
-                session->connection->flush();
-                global_locker.unlock();
-                char *buffer = new char[config.data_buffer_size];
-                uint64_t done = 0;
-                try {
-                    while (done < count) {
-                        uint32_t read = std::min(count - done, uint64_t(config.data_buffer_size));
-                        descriptor.stream->read(buffer, read);
-                        send_exact(session->connection, read, buffer);
-                        done += uint64_t(read);
-                    }
-                } catch (...) {
-                    delete[] buffer;
-                    throw;
-                }
-                delete[] buffer;
-            } else if (cmd == REQUEST_CMD_FD_WRITE_LONG) {
-                if (size != 1 + sizeof(uint64_t)) {
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                uint8_t fd = *reinterpret_cast<uint8_t *>(body);
-                uint64_t count = buf_read_uint64(body + 1);
-                if (fd >= session->fds.size()) {
-                    send_uint16(session->connection, REQUEST_ERR_BAD_FD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Session::FileDescriptor descriptor = session->fds[fd];
-                if (!descriptor.stream) {
-                    send_uint16(session->connection, REQUEST_ERR_BAD_FD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!(descriptor.mode & NODE_FD_MODE_WRITE)) {
-                    send_uint16(session->connection, REQUEST_ERR_NOT_SUPPORTED);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                send_uint16(session->connection, REQUEST_SWITCH_OK);
-                send_uint64(session->connection, 0);
-                session->connection->flush();
-                global_locker.unlock();
-                uint64_t done = 0;
-                char *buffer = new char[config.data_buffer_size];
+                log_error(session, REQUEST_ERR_EXISTS);
+                send_uint16(connection, REQUEST_ERR_EXISTS);
+                send_uint64(connection, 0);
+                return;
+            }
+        }
+        std::string parent_data_string(parent_data, parent_data_size);
+        delete[] parent_data;
+        Node node = generate_node();
+        parent_data_string += std::string(reinterpret_cast<const char *>(&node), sizeof(Node));
+        parent_data_string += ' ';
+        parent_data_string.back() = name_len;
+        parent_data_string += name;
+        {
+            std::ofstream parent_data_file(get_node_data_path(parent));
+            parent_data_file << parent_data_string;
+        }
+        {
+            std::ofstream data_stream(get_node_data_path(node));
+            std::string header;
+            header += type;
+            header += parent_head[NODE_HEAD_OFFSET_RIGHTS];
+            header += parent_head[NODE_HEAD_OFFSET_OWNER_GROUP_SIZE];
+            header += std::string(
+                    parent_head + NODE_HEAD_OFFSET_OWNER_GROUP,
+                    (size_t) *reinterpret_cast<uint8_t *>(parent_head + NODE_HEAD_OFFSET_OWNER_GROUP_SIZE)
+            );
+            header += std::string(reinterpret_cast<const char *>(&parent), sizeof(Node));
+            set_node_head(node, header);
+        }
+        delete[] parent_head;
+        log_response(session, std::pair("node", node2string(node)));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, sizeof(Node));
+        send_exact(connection, sizeof(Node), &node);
+    } else if (cmd == REQUEST_CMD_GET_NODE_OWNER) {
+        if (size != sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        log_request(session, cmd, std::pair("node", node2string(node)));
+        if (!node_exists(node)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        std::string owner = get_node_owner(node);
+        log_response(session, std::pair("owner", owner));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, owner.length());
+        send_exact(connection, owner.length(), owner.c_str());
+    } else if (cmd == REQUEST_CMD_FD_OPEN) {
+        if (size != sizeof(Node) + 1) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        log_request(session, cmd, std::pair("node", node2string(node)));
+        if (!node_exists(node)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        auto *node_head = get_node_head(node).first;
+        if (*reinterpret_cast<uint8_t *>(node_head + NODE_HEAD_OFFSET_TYPE) != NODE_TYPE_FILE) {
+            delete[] node_head;
+            log_error(session, REQUEST_ERR_NOT_A_FILE);
+            send_uint16(connection, REQUEST_ERR_NOT_A_FILE);
+            send_uint64(connection, 0);
+            return;
+        }
+        delete[] node_head;
+        uint8_t mode = *reinterpret_cast<uint8_t *>(body + sizeof(Node));
+        bool read = mode & NODE_FD_MODE_READ;
+        bool write = mode & NODE_FD_MODE_WRITE;
+        bool shared = write && (mode & NODE_FD_MODE_SHARED_WRITE);
+        ReadWrite rights = get_user_rights(node, session->login);
+        if ((read && !rights.read) || (write && !rights.write)) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        // a file held by shared writers only admits more write only shared writers
+        bool shared_busy = shared_writers.count(node) && (read || !shared);
+        if (writers[node] || shared_busy || (write && !readers[node].empty())) {
+            log_error(session, REQUEST_ERR_BUSY);
+            send_uint16(connection, REQUEST_ERR_BUSY);
+            send_uint64(connection, 0);
+            return;
+        }
+        size_t fd;
+        for (fd = 0; fd < session->fds.size(); fd++) {
+            if (session->fds[fd].file == -1) break;
+        }
+        if (fd == session->fds.size()) {
+            if (fd > 0xFF) {
+                log_error(session, REQUEST_ERR_TOO_MANY_FDS);
+                send_uint16(connection, REQUEST_ERR_TOO_MANY_FDS);
+                send_uint64(connection, 0);
+                return;
+            } else session->fds.emplace_back();
+        }
+        int flags = O_RDONLY;
+        if (read && write) flags = O_RDWR;
+        else if (write) flags = O_WRONLY | O_CREAT | (shared || (mode & NODE_FD_MODE_NO_TRUNCATE) ? 0 : O_TRUNC);
+        int file = open(get_node_data_path(node).c_str(), flags, 0644);
+        if (file == -1) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        session->fds[fd] = Session::FileDescriptor();
+        session->fds[fd].node = node;
+        session->fds[fd].file = file;
+        session->fds[fd].mode = mode;
+        if (read) readers[node].insert(session);
+        if (shared) shared_writers[node]++;
+        else if (write) writers[node] = session;
+        log_response(session, std::pair("fd", std::to_string(fd)));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 1);
+        send_uint8(connection, fd);
+    } else if (cmd == REQUEST_CMD_FD_CLOSE) {
+        if (size != 1) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint8_t fd = *reinterpret_cast<uint8_t *>(body);
+        log_request(session, cmd, std::pair("fd", std::to_string(fd)));
+        if (fd >= session->fds.size()) {
+            log_error(session, REQUEST_ERR_BAD_FD);
+            send_uint16(connection, REQUEST_ERR_BAD_FD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Session::FileDescriptor &descriptor = session->fds[fd];
+        if (descriptor.file == -1) {
+            log_error(session, REQUEST_ERR_BAD_FD);
+            send_uint16(connection, REQUEST_ERR_BAD_FD);
+            send_uint64(connection, 0);
+            return;
+        }
+        close_fd(session, descriptor);
+        session->fds[fd].file = -1;
+        log_response(session);
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 1);
+        send_uint8(connection, fd);
+    } else if (cmd == REQUEST_CMD_FD_WRITE) {
+        if (size < 1) {
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint8_t fd = *reinterpret_cast<uint8_t *>(body);
+        if (fd >= session->fds.size()) {
+            send_uint16(connection, REQUEST_ERR_BAD_FD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Session::FileDescriptor &descriptor = session->fds[fd];
+        if (descriptor.file == -1) {
+            send_uint16(connection, REQUEST_ERR_BAD_FD);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!(descriptor.mode & NODE_FD_MODE_WRITE)) {
+            send_uint16(connection, REQUEST_ERR_NOT_SUPPORTED);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint64_t written = 0;
+        while (written < size - 1) {
+            ssize_t status = pwrite(descriptor.file, body + 1 + written, size - 1 - written,
+                                    descriptor.position + written);
+            if (status == -1) throw std::runtime_error(std::string("file write error: ") + strerror(errno));
+            written += status;
+        }
+        descriptor.position += written;
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 0);
+    } else if (cmd == REQUEST_CMD_FD_READ) {
+        if (size != 1 + sizeof(uint32_t)) {
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint8_t fd = *reinterpret_cast<uint8_t *>(body);
+        if (fd >= session->fds.size()) {
+            send_uint16(connection, REQUEST_ERR_BAD_FD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Session::FileDescriptor &descriptor = session->fds[fd];
+        if (descriptor.file == -1) {
+            send_uint16(connection, REQUEST_ERR_BAD_FD);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!(descriptor.mode & NODE_FD_MODE_READ)) {
+            send_uint16(connection, REQUEST_ERR_NOT_SUPPORTED);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (descriptor.eof) {
+            send_uint16(connection, REQUEST_ERR_END_OF_FILE);
+            send_uint64(connection, 0);
+            return;
+        } else {
+            uint32_t count = buf_read_uint32(body + 1);
+            if (count > config.data_buffer_size) {
+                send_uint16(connection, REQUEST_ERR_READ_BLOCK_IS_TOO_LARGE);
+                send_uint64(connection, 0);
+                return;
+            } else {
+                char *buffer = new char[count];
+                ssize_t status = pread(descriptor.file, buffer, count, descriptor.position);
+                uint32_t read = status == -1 ? 0 : status;
+                if (read < count) descriptor.eof = true;
+                descriptor.position += read;
                 try {
-                    while (done < count) {
-                        uint64_t read = session->connection->read(
-                                std::min(count - done, uint64_t(config.data_buffer_size)),
-                                buffer);
-                        descriptor.stream->write(buffer, read);
-                        done += read;
-                    }
+                    send_uint16(connection, REQUEST_OK);
+                    send_uint64(connection, read);
+                    send_exact(connection, read, buffer);
                 } catch (...) {
                     delete[] buffer;
                     throw;
                 }
                 delete[] buffer;
-            } else if (cmd == REQUEST_CMD_SET_NODE_RIGHTS) {
-                if (size != sizeof(Node) + 1) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                uint8_t rights = *reinterpret_cast<uint8_t *>(body + sizeof(Node));
-                rights &= uint8_t(NODE_RIGHTS_GROUP_READ | NODE_RIGHTS_GROUP_WRITE | NODE_RIGHTS_ALL_READ |
-                                  NODE_RIGHTS_ALL_WRITE);
-                log_request(session, cmd, std::pair("node", node2string(node)),
-                            std::pair("rights", rights2string(rights)));
-                if (!node_exists(node)) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (get_node_owner(node) != session->login) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                auto[node_head, node_size] = get_node_head(node);
-                std::ofstream node_stream(get_node_head_path(node));
-                *(reinterpret_cast<uint8_t *>(node_head + NODE_HEAD_OFFSET_RIGHTS)) = rights;
-                node_stream.write(node_head, node_size);
-                delete[] node_head;
-                log_response(session);
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, 0);
-            } else if (cmd == REQUEST_CMD_GROUP_INVITE) {
-                std::string user(body, size);
-                log_request(session, cmd, std::pair("user", user));
-                if (!std::filesystem::exists(get_user_head_path(user))) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (is_member(user, session->login)) {
-                    log_error(session, REQUEST_ERR_EXISTS);
-                    send_uint16(session->connection, REQUEST_ERR_EXISTS);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                std::ofstream user_file(get_user_head_path(user), std::fstream::out | std::fstream::app);
-                uint8_t length = session->login.length();
-                user_file.write(reinterpret_cast<char *>(&length), 1);
-                user_file << session->login;
-                log_response(session);
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, 0);
-            } else if (cmd == REQUEST_CMD_GET_NODE_GROUP) {
-                if (size != sizeof(Node)) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                log_request(session, cmd, std::pair("node", node2string(node)));
-                auto[node_head, node_size] = get_node_head(node);
-                if (!node_head) {
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                std::string group = get_node_group(node_head);
-                delete[] node_head;
-                log_response(session, std::pair("group", group));
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, group.length());
-                send_exact(session->connection, group.length(), group.c_str());
-            } else if (cmd == REQUEST_CMD_REMOVE_NODE) {
-                if (size != sizeof(Node)) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                log_request(session, cmd, std::pair("node", node2string(node)));
-                // node doesnt exists
-                if (!node_exists(node)) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                // node is nonempty dir
-                auto[node_head, node_head_size] = get_node_head(node);
-                uint8_t type = *(node_head + NODE_HEAD_OFFSET_TYPE);
-                delete[] node_head;
-                if (type == NODE_TYPE_DIRECTORY) {
-                    auto[node_data, node_data_size] = get_node_data(node);
-                    delete[] node_data;
-                    if (node_data_size) {
-                        log_error(session, REQUEST_ERR_DIRECTORY_IS_NOT_EMPTY);
-                        send_uint16(session->connection, REQUEST_ERR_DIRECTORY_IS_NOT_EMPTY);
-                        send_uint64(session->connection, 0);
-                        continue;
-                    }
-                }
-                // no rights
-                if (!get_user_rights(node, session->login).write) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                // is home
-                uint16_t error = REQUEST_OK;
-                Node parent;
-                bool ok = get_parent(node, parent, error);
-                if (!ok) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                // cut parent link to node
-                auto[parent_head, parent_head_size] = get_node_head(parent);
-                auto[parent_data, parent_data_size] = get_node_data(parent);
-                auto[cut_pos, cut_sz] = find_child_by_node(parent_data, parent_data_size, node);
-                if (cut_pos == -1) {
-                    delete[] parent_data;
-                    delete[] parent_head;
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                std::string parent_data_string(parent_data, parent_data_size);
-                std::string new_parent_data_string =
-                        parent_data_string.substr(0, cut_pos) +
-                        parent_data_string.substr(cut_pos + cut_sz, parent_data_string.size() - cut_pos - cut_sz);
-                delete[] parent_data;
-                delete[] parent_head;
-                {
-                    std::ofstream parent_data_file(get_node_data_path(parent));
-                    parent_data_file << new_parent_data_string;
-                }
-                // del files char/data
-                std::filesystem::remove(get_node_data_path(node));
-                std::filesystem::remove(get_node_head_path(node));
-                log_response(session);
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, 0);
-            } else if (cmd == REQUEST_CMD_SET_NODE_GROUP) {
-                if (size <= sizeof(Node)) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                std::string group(body + sizeof(Node), body + size);
-                log_request(session, cmd, std::pair("node", node2string(node)), std::pair("group", group));
-                auto[node_head_ptr, node_size] = get_node_head(node);
-                if (!node_head_ptr) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                std::string node_head(node_head_ptr, node_size);
-                delete[] node_head_ptr;
-                if (get_node_owner(node) != session->login) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!is_member(session->login, group)) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                std::string node_head1 = node_head.substr(0, NODE_HEAD_OFFSET_OWNER_GROUP_SIZE);
-                std::string node_head2 = node_head.substr(
-                        NODE_HEAD_OFFSET_OWNER_GROUP + get_node_group(node_head.c_str()).length());
-                std::string node_head0 = " " + group;
-                node_head0[0] = group.length();
-                node_head = node_head1 + node_head0 + node_head2;
-                std::ofstream node_head_file(get_node_head_path(node));
-                node_head_file << node_head;
-                log_response(session);
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, 0);
-            } else if (cmd == REQUEST_CMD_GROUP_KICK) {
-                std::string user(body, size);
-                log_request(session, cmd, std::pair("user", user));
-                if (user == session->login) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!is_member(user, session->login)) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                remove_from_group(session->login, user);
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, 0);
-            } else if (cmd == REQUEST_CMD_GROUP_LIST) {
-                log_request(session, cmd);
-                if (size != 0) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                auto[head, size] = get_user_head(session->login);
-                std::string groups(head + USER_HEAD_OFFSET_GROUPS, head + size);
-                log_response(session, std::pair("groups_size", std::to_string(groups.length())));
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, groups.length());
-                send_exact(session->connection, groups.length(), groups.c_str());
-            } else if (cmd == REQUEST_CMD_MOVE_NODE) {
-                if (size != sizeof(Node) * 2) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                Node new_parent = *reinterpret_cast<Node *>(body + sizeof(Node));
-                log_request(session, cmd, std::pair("node", node2string(node)));
-                // nodes doesnt exists
-                if (!node_exists(node)) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!node_exists(new_parent)) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                // new_parent is dir
-                auto[np_head, np_head_size] = get_node_head(new_parent);
-                uint8_t type = *(np_head + NODE_HEAD_OFFSET_TYPE);
-                delete[] np_head;
-                if (type != NODE_TYPE_DIRECTORY) {
-                    log_error(session, REQUEST_ERR_NOT_A_DIRECTORY);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_A_DIRECTORY);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                // node is home
-                uint16_t error = REQUEST_OK;
-                Node parent;
-                bool ok = get_parent(node, parent, error);
-                if (!ok) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                //no rights
-                if (!get_user_rights(parent, session->login).write ||
-                    !get_user_rights(new_parent, session->login).write) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                // new_parent is subdir of node
-                Node cur = new_parent;
-                bool bad = false;
-                while (true) {
-                    if (cur == node) {
-                        bad = true;
-                        break;
-                    }
-                    if (!get_parent(cur, cur, error)) {
-                        break;
-                    }
-                }
-                if (bad) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                // cut parent link to node
-                auto[parent_head, parent_head_size] = get_node_head(parent);
-                auto[parent_data, parent_data_size] = get_node_data(parent);
-                auto[cut_pos, cut_sz] = find_child_by_node(parent_data, parent_data_size, node);
-                auto[np_data, np_data_size] = get_node_data(new_parent);
-                std::string np_data_string(np_data, np_data_size);
-                auto[child_pos, child_sz] = find_child_by_name(
-                        np_data, np_data_size,
-                        std::string(parent_data + cut_pos + sizeof(Node) + 1, parent_data + cut_pos + cut_sz)
-                );
-                delete[] np_data;
-                if (child_pos != -1) {
-                    delete[] parent_data;
-                    delete[] parent_head;
-                    log_error(session, REQUEST_ERR_EXISTS);
-                    send_uint16(session->connection, REQUEST_ERR_EXISTS);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                std::string parent_data_string(parent_data, parent_data_size);
-                std::string new_parent_data_string =
-                        parent_data_string.substr(0, cut_pos) +
-                        parent_data_string.substr(cut_pos + cut_sz, parent_data_string.size() - cut_pos - cut_sz);
-                std::string about_node = parent_data_string.substr(cut_pos, cut_sz);
-                delete[] parent_head;
-                {
-                    std::ofstream parent_data_file(get_node_data_path(parent));
-                    parent_data_file << new_parent_data_string;
-                }
-                // add link of new_parent to node
-                np_data_string += about_node;
-                {
-                    std::ofstream np_data_file(get_node_data_path(new_parent));
-                    np_data_file << np_data_string;
-                }
-                delete[] parent_data;
-                auto[node_head, node_size] = get_node_head(node);
-                std::memcpy(node_head + NODE_HEAD_OFFSET_OWNER_GROUP +
-                            *(reinterpret_cast<uint8_t *>(node_head + NODE_HEAD_OFFSET_OWNER_GROUP_SIZE)),
-                            &new_parent,
-                            sizeof(Node));
-                {
-                    std::ofstream node_head_file(get_node_head_path(node));
-                    node_head_file << std::string(node_head, node_size);
-                }
-                delete[] node_head;
-                log_response(session);
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, 0);
-            } else if (cmd == REQUEST_CMD_COPY_NODE) {
-                if (size < sizeof(Node)) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                std::string name(body + sizeof(Node), body + size);
-                log_request(session, cmd, std::pair("node", node2string(node)), std::pair("name", name));
-                if (!node_exists(node)) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!is_valid_name(name)) {
-                    log_error(session, REQUEST_ERR_INVALID_NAME);
-                    send_uint16(session->connection, REQUEST_ERR_INVALID_NAME);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                uint16_t error = 0;
-                Node parent;
-                if (!get_parent(node, parent, error)) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                auto[parent_data, parent_size] = get_node_data(parent);
-                std::string parent_data_string(parent_data, parent_size);
-                auto[child_pos, child_sz] = find_child_by_name(parent_data, parent_size, name);
-                delete[] parent_data;
-                if (child_pos != -1) {
-                    log_error(session, REQUEST_ERR_EXISTS);
-                    send_uint16(session->connection, REQUEST_ERR_EXISTS);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!get_user_rights(parent, session->login).write) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                auto[node_head, node_head_size] = get_node_head(node);
-                uint8_t type = *reinterpret_cast<char *>(node_head + NODE_HEAD_OFFSET_TYPE);
-                delete[] node_head;
-                if (type == NODE_TYPE_DIRECTORY) {
-                    auto[node_data, node_data_size] = get_node_data(node);
-                    delete[] node_data;
-                    if (node_data_size) {
-                        log_error(session, REQUEST_ERR_DIRECTORY_IS_NOT_EMPTY);
-                        send_uint16(session->connection, REQUEST_ERR_DIRECTORY_IS_NOT_EMPTY);
-                        send_uint64(session->connection, 0);
-                        continue;
-                    }
-                }
-                Node clone = generate_node();
-                std::filesystem::copy(get_node_head_path(node), get_node_head_path(clone));
-                writers[clone] = session;
-                global_locker.unlock();
-                std::filesystem::copy(get_node_data_path(node), get_node_data_path(clone));
-                global_locker.lock();
-                writers.erase(clone);
-                parent_data_string += std::string(reinterpret_cast<char *>(&clone), sizeof(Node));
-                parent_data_string += name.length();
-                parent_data_string += name;
-                std::ofstream parent_data_file(get_node_data_path(parent));
-                parent_data_file << parent_data_string;
-                log_response(session);
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, sizeof(Node));
-                send_exact(session->connection, sizeof(Node), &clone);
-            } else if (cmd == REQUEST_CMD_RENAME_NODE) {
-                if (size < sizeof(Node)) {
-                    log_request(session, cmd);
-                    log_error(session, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint16(session->connection, REQUEST_ERR_MALFORMED_CMD);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                Node node = *reinterpret_cast<Node *>(body);
-                std::string name(body + sizeof(Node), body + size);
-                log_request(session, cmd, std::pair("node", node2string(node)), std::pair("name", name));
-                if (!node_exists(node)) {
-                    log_error(session, REQUEST_ERR_NOT_FOUND);
-                    send_uint16(session->connection, REQUEST_ERR_NOT_FOUND);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!is_valid_name(name)) {
-                    log_error(session, REQUEST_ERR_INVALID_NAME);
-                    send_uint16(session->connection, REQUEST_ERR_INVALID_NAME);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                uint16_t error = 0;
-                Node parent;
-                if (!get_parent(node, parent, error)) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                if (!get_user_rights(parent, session->login).write) {
-                    log_error(session, REQUEST_ERR_FORBIDDEN);
-                    send_uint16(session->connection, REQUEST_ERR_FORBIDDEN);
-                    send_uint64(session->connection, 0);
-                    continue;
-                }
-                auto[parent_data, parent_size] = get_node_data(parent);
-                auto[child_pos, child_sz] = find_child_by_node(parent_data, parent_size, node);
-                std::string parent_string(parent_data, parent_size);
-                delete[] parent_data;
-                std::string new_entry(reinterpret_cast<char *>(&node), sizeof(Node) + 1);
-                new_entry.back() = name.length();
-                new_entry += name;
-                parent_string =
-                        parent_string.substr(0, child_pos) +
-                        new_entry +
-                        parent_string.substr(child_pos + child_sz);
-                std::ofstream(get_node_data_path(parent)) << parent_string;
-                log_response(session);
-                send_uint16(session->connection, REQUEST_OK);
-                send_uint64(session->connection, 0);
-            } else {
-                log_request(session, cmd);
-                log_error(session, REQUEST_ERR_INVALID_CMD);
-                send_uint16(session->connection, REQUEST_ERR_INVALID_CMD);
-                send_uint64(session->connection, 0);
             }
         }
-    } catch (std::exception &exception) {
-        if (!shutting_down && !goodbye) {
-            log_exit(session, exception.what());
-            std::cerr << "'" << session->login << "' listener stopped with exception: " << exception.what()
-                      << std::endl;
+    } else if (cmd == REQUEST_CMD_GET_NODE_INFO) {
+        if (size != sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        log_request(session, cmd, std::pair("node", node2string(node)));
+        if (!node_exists(node)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        auto[node_head, node_size] = get_node_head(node);
+        uint8_t file_type = *reinterpret_cast<uint8_t *>(node_head + NODE_HEAD_OFFSET_TYPE);
+        uint8_t file_rights = *reinterpret_cast<uint8_t *>(node_head + NODE_HEAD_OFFSET_RIGHTS);
+        delete[] node_head;
+        uint64_t file_size = std::filesystem::file_size(get_node_data_path(node));
+        log_response(session,
+                     std::pair("type", std::to_string(file_type)),
+                     std::pair("size", std::to_string(file_size)),
+                     std::pair("rights", rights2string(file_rights)));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint8_t));
+        send_uint8(connection, file_type);
+        send_uint64(connection, file_size);
+        send_uint8(connection, file_rights);
+    } else if (cmd == REQUEST_CMD_FD_READ_LONG) {
+        if (size != 1 + sizeof(uint64_t)) {
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint8_t fd = *reinterpret_cast<uint8_t *>(body);
+        uint64_t count = buf_read_uint64(body + 1);
+        if (fd >= session->fds.size()) {
+            send_uint16(connection, REQUEST_ERR_BAD_FD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Session::FileDescriptor &descriptor = session->fds[fd];
+        if (descriptor.file == -1) {
+            send_uint16(connection, REQUEST_ERR_BAD_FD);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!(descriptor.mode & NODE_FD_MODE_READ)) {
+            send_uint16(connection, REQUEST_ERR_NOT_SUPPORTED);
+            send_uint64(connection, 0);
+            return;
+        }
+        {
+            struct stat file_stat{};
+            if (fstat(descriptor.file, &file_stat)) {
+                send_uint16(connection, REQUEST_ERR_BAD_FD);
+                send_uint64(connection, 0);
+                return;
+            }
+            uint64_t file_size = file_stat.st_size;
+            if (descriptor.position > file_size || count > file_size - descriptor.position) {
+                send_uint16(connection, REQUEST_ERR_END_OF_FILE);
+                send_uint64(connection, 0);
+                return;
+            }
+        }
+        send_uint16(connection, REQUEST_SWITCH_OK);
+        send_uint64(connection, 0);
+        connection->flush();
+        global_locker.unlock();
+        char *buffer = new char[config.data_buffer_size];
+        uint64_t done = 0;
+        try {
+            while (done < count) {
+                size_t sent = connection->send_file(
+                        descriptor.file, descriptor.position,
+                        std::min(count - done, uint64_t(config.data_buffer_size)), buffer);
+                descriptor.position += sent;
+                done += uint64_t(sent);
+            }
+        } catch (...) {
+            delete[] buffer;
+            throw;
+        }
+        delete[] buffer;
+    } else if (cmd == REQUEST_CMD_FD_WRITE_LONG) {
+        if (size != 1 + sizeof(uint64_t)) {
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint8_t fd = *reinterpret_cast<uint8_t *>(body);
+        uint64_t count = buf_read_uint64(body + 1);
+        if (fd >= session->fds.size()) {
+            send_uint16(connection, REQUEST_ERR_BAD_FD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Session::FileDescriptor &descriptor = session->fds[fd];
+        if (descriptor.file == -1) {
+            send_uint16(connection, REQUEST_ERR_BAD_FD);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!(descriptor.mode & NODE_FD_MODE_WRITE)) {
+            send_uint16(connection, REQUEST_ERR_NOT_SUPPORTED);
+            send_uint64(connection, 0);
+            return;
+        }
+        send_uint16(connection, REQUEST_SWITCH_OK);
+        send_uint64(connection, 0);
+        connection->flush();
+        global_locker.unlock();
+        uint64_t done = 0;
+        char *buffer = new char[config.data_buffer_size];
+        try {
+            while (done < count) {
+                uint64_t read = connection->read_file(
+                        descriptor.file, descriptor.position,
+                        std::min(count - done, uint64_t(config.data_buffer_size)), buffer);
+                descriptor.position += read;
+                done += read;
+            }
+        } catch (...) {
+            delete[] buffer;
+            throw;
+        }
+        delete[] buffer;
+    } else if (cmd == REQUEST_CMD_SET_NODE_RIGHTS) {
+        if (size != sizeof(Node) + 1) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        uint8_t rights = *reinterpret_cast<uint8_t *>(body + sizeof(Node));
+        rights &= uint8_t(NODE_RIGHTS_GROUP_READ | NODE_RIGHTS_GROUP_WRITE | NODE_RIGHTS_ALL_READ |
+                          NODE_RIGHTS_ALL_WRITE);
+        log_request(session, cmd, std::pair("node", node2string(node)),
+                    std::pair("rights", rights2string(rights)));
+        if (!node_exists(node)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (get_node_owner(node) != session->login) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        auto[node_head, node_size] = get_node_head(node);
+        *(reinterpret_cast<uint8_t *>(node_head + NODE_HEAD_OFFSET_RIGHTS)) = rights;
+        set_node_head(node, std::string(node_head, node_size));
+        delete[] node_head;
+        log_response(session);
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 0);
+    } else if (cmd == REQUEST_CMD_GROUP_INVITE) {
+        std::string user(body, size);
+        log_request(session, cmd, std::pair("user", user));
+        if (!users.count(user)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (is_member(user, session->login)) {
+            log_error(session, REQUEST_ERR_EXISTS);
+            send_uint16(connection, REQUEST_ERR_EXISTS);
+            send_uint64(connection, 0);
+            return;
+        }
+        {
+            std::ofstream user_file(get_user_head_path(user), std::fstream::out | std::fstream::app);
+            uint8_t length = session->login.length();
+            user_file.write(reinterpret_cast<char *>(&length), 1);
+            user_file << session->login;
+        }
+        users[user].groups.insert(session->login);
+        group_members[session->login].insert(user);
+        log_response(session);
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 0);
+    } else if (cmd == REQUEST_CMD_GET_NODE_GROUP) {
+        if (size != sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        log_request(session, cmd, std::pair("node", node2string(node)));
+        auto[node_head, node_size] = get_node_head(node);
+        if (!node_head) {
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        std::string group = get_node_group(node_head);
+        delete[] node_head;
+        log_response(session, std::pair("group", group));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, group.length());
+        send_exact(connection, group.length(), group.c_str());
+    } else if (cmd == REQUEST_CMD_REMOVE_NODE) {
+        if (size != sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        log_request(session, cmd, std::pair("node", node2string(node)));
+        uint16_t error = remove_node(session, node);
+        if (error != REQUEST_OK) {
+            log_error(session, error);
+            send_uint16(connection, error);
+            send_uint64(connection, 0);
+            return;
+        }
+        log_response(session);
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 0);
+    } else if (cmd == REQUEST_CMD_REMOVE_TREE) {
+        if (size != sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        log_request(session, cmd, std::pair("node", node2string(node)));
+        if (!node_exists(node)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        // homes are not removed, so they are refused before their content is touched
+        uint16_t error = REQUEST_OK;
+        Node parent;
+        if (!get_user_rights(node, session->login).write || !get_parent(node, parent, error)) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        TreeProgress progress;
+        remove_tree(session, node, progress, global_locker, session_locker);
+        std::string response = progress.encode();
+        log_response(session, std::pair("removed", std::to_string(progress.done)),
+                     std::pair("failed", std::to_string(progress.failed)));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, response.size());
+        send_exact(connection, response.size(), response.c_str());
+    } else if (cmd == REQUEST_CMD_SET_NODE_GROUP) {
+        if (size <= sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        std::string group(body + sizeof(Node), body + size);
+        log_request(session, cmd, std::pair("node", node2string(node)), std::pair("group", group));
+        auto[node_head_ptr, node_size] = get_node_head(node);
+        if (!node_head_ptr) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        std::string node_head(node_head_ptr, node_size);
+        delete[] node_head_ptr;
+        if (get_node_owner(node) != session->login) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!is_member(session->login, group)) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        std::string node_head1 = node_head.substr(0, NODE_HEAD_OFFSET_OWNER_GROUP_SIZE);
+        std::string node_head2 = node_head.substr(
+                NODE_HEAD_OFFSET_OWNER_GROUP + get_node_group(node_head.c_str()).length());
+        std::string node_head0 = " " + group;
+        node_head0[0] = group.length();
+        node_head = node_head1 + node_head0 + node_head2;
+        set_node_head(node, node_head);
+        log_response(session);
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 0);
+    } else if (cmd == REQUEST_CMD_GROUP_KICK) {
+        std::string user(body, size);
+        log_request(session, cmd, std::pair("user", user));
+        if (user == session->login) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!is_member(user, session->login)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        remove_from_group(session->login, user);
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 0);
+    } else if (cmd == REQUEST_CMD_GROUP_LIST) {
+        log_request(session, cmd);
+        if (size != 0) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        std::string groups;
+        for (const std::string &group : users.at(session->login).groups) {
+            groups += char(group.length());
+            groups += group;
+        }
+        log_response(session, std::pair("groups_size", std::to_string(groups.length())));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, groups.length());
+        send_exact(connection, groups.length(), groups.c_str());
+    } else if (cmd == REQUEST_CMD_MOVE_NODE) {
+        if (size != sizeof(Node) * 2) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        Node new_parent = *reinterpret_cast<Node *>(body + sizeof(Node));
+        log_request(session, cmd, std::pair("node", node2string(node)));
+        // nodes doesnt exists
+        if (!node_exists(node)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!node_exists(new_parent)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        // new_parent is dir
+        auto[np_head, np_head_size] = get_node_head(new_parent);
+        uint8_t type = *(np_head + NODE_HEAD_OFFSET_TYPE);
+        delete[] np_head;
+        if (type != NODE_TYPE_DIRECTORY) {
+            log_error(session, REQUEST_ERR_NOT_A_DIRECTORY);
+            send_uint16(connection, REQUEST_ERR_NOT_A_DIRECTORY);
+            send_uint64(connection, 0);
+            return;
+        }
+        // node is home
+        uint16_t error = REQUEST_OK;
+        Node parent;
+        bool ok = get_parent(node, parent, error);
+        if (!ok) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        //no rights
+        if (!get_user_rights(parent, session->login).write ||
+            !get_user_rights(new_parent, session->login).write) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        // new_parent is subdir of node
+        Node cur = new_parent;
+        bool bad = false;
+        while (true) {
+            if (cur == node) {
+                bad = true;
+                break;
+            }
+            if (!get_parent(cur, cur, error)) {
+                break;
+            }
+        }
+        if (bad) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        // cut parent link to node
+        auto[parent_head, parent_head_size] = get_node_head(parent);
+        auto[parent_data, parent_data_size] = get_node_data(parent);
+        auto[cut_pos, cut_sz] = find_child_by_node(parent_data, parent_data_size, node);
+        auto[np_data, np_data_size] = get_node_data(new_parent);
+        std::string np_data_string(np_data, np_data_size);
+        auto[child_pos, child_sz] = find_child_by_name(
+                np_data, np_data_size,
+                std::string(parent_data + cut_pos + sizeof(Node) + 1, parent_data + cut_pos + cut_sz)
+        );
+        delete[] np_data;
+        if (child_pos != -1) {
+            delete[] parent_data;
+            delete[] parent_head;
+            log_error(session, REQUEST_ERR_EXISTS);
+            send_uint16(connection, REQUEST_ERR_EXISTS);
+            send_uint64(connection, 0);
+            return;
+        }
+        std::string parent_data_string(parent_data, parent_data_size);
+        std::string new_parent_data_string =
+                parent_data_string.substr(0, cut_pos) +
+                parent_data_string.substr(cut_pos + cut_sz, parent_data_string.size() - cut_pos - cut_sz);
+        std::string about_node = parent_data_string.substr(cut_pos, cut_sz);
+        delete[] parent_head;
+        {
+            std::ofstream parent_data_file(get_node_data_path(parent));
+            parent_data_file << new_parent_data_string;
+        }
+        // add link of new_parent to node
+        np_data_string += about_node;
+        {
+            std::ofstream np_data_file(get_node_data_path(new_parent));
+            np_data_file << np_data_string;
+        }
+        delete[] parent_data;
+        auto[node_head, node_size] = get_node_head(node);
+        std::memcpy(node_head + NODE_HEAD_OFFSET_OWNER_GROUP +
+                    *(reinterpret_cast<uint8_t *>(node_head + NODE_HEAD_OFFSET_OWNER_GROUP_SIZE)),
+                    &new_parent,
+                    sizeof(Node));
+        set_node_head(node, std::string(node_head, node_size));
+        delete[] node_head;
+        // the descendants of the node aren't known here, so a move to another home forgets all the homes
+        if (get_node_home(parent) != get_node_home(new_parent)) home_cache.clear();
+        log_response(session);
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 0);
+    } else if (cmd == REQUEST_CMD_COPY_NODE) {
+        if (size < sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        std::string name(body + sizeof(Node), body + size);
+        log_request(session, cmd, std::pair("node", node2string(node)), std::pair("name", name));
+        if (!node_exists(node)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!is_valid_name(name)) {
+            log_error(session, REQUEST_ERR_INVALID_NAME);
+            send_uint16(connection, REQUEST_ERR_INVALID_NAME);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint16_t error = 0;
+        Node parent;
+        if (!get_parent(node, parent, error)) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        auto[parent_data, parent_size] = get_node_data(parent);
+        std::string parent_data_string(parent_data, parent_size);
+        auto[child_pos, child_sz] = find_child_by_name(parent_data, parent_size, name);
+        delete[] parent_data;
+        if (child_pos != -1) {
+            log_error(session, REQUEST_ERR_EXISTS);
+            send_uint16(connection, REQUEST_ERR_EXISTS);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!get_user_rights(parent, session->login).write) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        auto[node_head, node_head_size] = get_node_head(node);
+        std::string node_head_string(node_head, node_head_size);
+        uint8_t type = *reinterpret_cast<char *>(node_head + NODE_HEAD_OFFSET_TYPE);
+        delete[] node_head;
+        if (type == NODE_TYPE_DIRECTORY) {
+            auto[node_data, node_data_size] = get_node_data(node);
+            delete[] node_data;
+            if (node_data_size) {
+                log_error(session, REQUEST_ERR_DIRECTORY_IS_NOT_EMPTY);
+                send_uint16(connection, REQUEST_ERR_DIRECTORY_IS_NOT_EMPTY);
+                send_uint64(connection, 0);
+                return;
+            }
+        }
+        Node clone = generate_node();
+        set_node_head(clone, node_head_string);
+        writers[clone] = session;
+        global_locker.unlock();
+        std::filesystem::copy(get_node_data_path(node), get_node_data_path(clone));
+        global_locker.lock();
+        writers.erase(clone);
+        parent_data_string += std::string(reinterpret_cast<char *>(&clone), sizeof(Node));
+        parent_data_string += name.length();
+        parent_data_string += name;
+        std::ofstream parent_data_file(get_node_data_path(parent));
+        parent_data_file << parent_data_string;
+        log_response(session);
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, sizeof(Node));
+        send_exact(connection, sizeof(Node), &clone);
+    } else if (cmd == REQUEST_CMD_COPY_TREE) {
+        if (size < sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        std::string name(body + sizeof(Node), body + size);
+        log_request(session, cmd, std::pair("node", node2string(node)), std::pair("name", name));
+        if (!node_exists(node)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!is_valid_name(name)) {
+            log_error(session, REQUEST_ERR_INVALID_NAME);
+            send_uint16(connection, REQUEST_ERR_INVALID_NAME);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint16_t error = 0;
+        Node parent;
+        if (!get_parent(node, parent, error) || !get_user_rights(parent, session->login).write) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        TreeProgress progress;
+        Node clone;
+        error = copy_tree(session, node, parent, name, clone, progress, global_locker, session_locker);
+        if (error != REQUEST_OK) {
+            log_error(session, error);
+            send_uint16(connection, error);
+            send_uint64(connection, 0);
+            return;
+        }
+        std::string response(reinterpret_cast<char *>(&clone), sizeof(Node));
+        response += progress.encode();
+        log_response(session, std::pair("clone", node2string(clone)),
+                     std::pair("copied", std::to_string(progress.done)),
+                     std::pair("failed", std::to_string(progress.failed)));
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, response.size());
+        send_exact(connection, response.size(), response.c_str());
+    } else if (cmd == REQUEST_CMD_RENAME_NODE) {
+        if (size < sizeof(Node)) {
+            log_request(session, cmd);
+            log_error(session, REQUEST_ERR_MALFORMED_CMD);
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        Node node = *reinterpret_cast<Node *>(body);
+        std::string name(body + sizeof(Node), body + size);
+        log_request(session, cmd, std::pair("node", node2string(node)), std::pair("name", name));
+        if (!node_exists(node)) {
+            log_error(session, REQUEST_ERR_NOT_FOUND);
+            send_uint16(connection, REQUEST_ERR_NOT_FOUND);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!is_valid_name(name)) {
+            log_error(session, REQUEST_ERR_INVALID_NAME);
+            send_uint16(connection, REQUEST_ERR_INVALID_NAME);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint16_t error = 0;
+        Node parent;
+        if (!get_parent(node, parent, error)) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (!get_user_rights(parent, session->login).write) {
+            log_error(session, REQUEST_ERR_FORBIDDEN);
+            send_uint16(connection, REQUEST_ERR_FORBIDDEN);
+            send_uint64(connection, 0);
+            return;
+        }
+        auto[parent_data, parent_size] = get_node_data(parent);
+        auto[child_pos, child_sz] = find_child_by_node(parent_data, parent_size, node);
+        std::string parent_string(parent_data, parent_size);
+        delete[] parent_data;
+        std::string new_entry(reinterpret_cast<char *>(&node), sizeof(Node) + 1);
+        new_entry.back() = name.length();
+        new_entry += name;
+        parent_string =
+                parent_string.substr(0, child_pos) +
+                new_entry +
+                parent_string.substr(child_pos + child_sz);
+        std::ofstream(get_node_data_path(parent)) << parent_string;
+        log_response(session);
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 0);
+    } else if (cmd == REQUEST_CMD_FD_PREAD) {
+        if (size != 1 + sizeof(uint64_t) + sizeof(uint32_t)) {
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint8_t fd = *reinterpret_cast<uint8_t *>(body);
+        uint64_t offset = buf_read_uint64(body + 1);
+        uint32_t count = buf_read_uint32(body + 1 + sizeof(uint64_t));
+        uint16_t status = check_fd(session, fd, NODE_FD_MODE_READ);
+        if (status == REQUEST_OK && count > config.data_buffer_size) status = REQUEST_ERR_READ_BLOCK_IS_TOO_LARGE;
+        if (status != REQUEST_OK) {
+            send_uint16(connection, status);
+            send_uint64(connection, 0);
+            return;
+        }
+        char *buffer = new char[count];
+        uint32_t read = 0;
+        while (read < count) {
+            ssize_t part = pread(session->fds[fd].file, buffer + read, count - read, offset + read);
+            if (part <= 0) break;
+            read += part;
+        }
+        try {
+            send_uint16(connection, REQUEST_OK);
+            send_uint64(connection, read);
+            send_exact(connection, read, buffer);
+        } catch (...) {
+            delete[] buffer;
+            throw;
+        }
+        delete[] buffer;
+    } else if (cmd == REQUEST_CMD_FD_PWRITE) {
+        if (size < 1 + sizeof(uint64_t)) {
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint8_t fd = *reinterpret_cast<uint8_t *>(body);
+        uint64_t offset = buf_read_uint64(body + 1);
+        uint16_t status = check_fd(session, fd, NODE_FD_MODE_WRITE);
+        if (status != REQUEST_OK) {
+            send_uint16(connection, status);
+            send_uint64(connection, 0);
+            return;
+        }
+        const char *data = body + 1 + sizeof(uint64_t);
+        uint64_t count = size - 1 - sizeof(uint64_t);
+        uint64_t written = 0;
+        while (written < count) {
+            ssize_t part = pwrite(session->fds[fd].file, data + written, count - written, offset + written);
+            if (part == -1) throw std::runtime_error(std::string("file write error: ") + strerror(errno));
+            written += part;
+        }
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 0);
+    } else if (cmd == REQUEST_CMD_FD_TRUNCATE) {
+        if (size != 1 + sizeof(uint64_t)) {
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        uint8_t fd = *reinterpret_cast<uint8_t *>(body);
+        uint64_t length = buf_read_uint64(body + 1);
+        uint16_t status = check_fd(session, fd, NODE_FD_MODE_WRITE);
+        if (status == REQUEST_OK && length > uint64_t(std::numeric_limits<off_t>::max())) {
+            status = REQUEST_ERR_MALFORMED_CMD;
+        }
+        if (status != REQUEST_OK) {
+            send_uint16(connection, status);
+            send_uint64(connection, 0);
+            return;
+        }
+        if (ftruncate(session->fds[fd].file, off_t(length))) {
+            throw std::runtime_error(std::string("file truncate error: ") + strerror(errno));
+        }
+        send_uint16(connection, REQUEST_OK);
+        send_uint64(connection, 0);
+    } else if (cmd == REQUEST_CMD_FD_PREAD_LONG || cmd == REQUEST_CMD_FD_PWRITE_LONG) {
+        if (size != 1 + sizeof(uint64_t) * 2) {
+            send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+            send_uint64(connection, 0);
+            return;
+        }
+        bool read = cmd == REQUEST_CMD_FD_PREAD_LONG;
+        uint8_t fd = *reinterpret_cast<uint8_t *>(body);
+        uint64_t offset = buf_read_uint64(body + 1);
+        uint64_t count = buf_read_uint64(body + 1 + sizeof(uint64_t));
+        uint16_t status = check_fd(session, fd, read ? NODE_FD_MODE_READ : NODE_FD_MODE_WRITE);
+        if (status == REQUEST_OK && read) {
+            struct stat file_stat{};
+            if (fstat(session->fds[fd].file, &file_stat)) status = REQUEST_ERR_BAD_FD;
+            else if (offset > uint64_t(file_stat.st_size) || count > uint64_t(file_stat.st_size) - offset) {
+                status = REQUEST_ERR_END_OF_FILE;
+            }
+        }
+        if (status != REQUEST_OK) {
+            send_uint16(connection, status);
+            send_uint64(connection, 0);
+            return;
+        }
+        int file = session->fds[fd].file;
+        send_uint16(connection, REQUEST_SWITCH_OK);
+        send_uint64(connection, 0);
+        connection->flush();
+        global_locker.unlock();
+        char *buffer = new char[config.data_buffer_size];
+        uint64_t done = 0;
+        try {
+            while (done < count) {
+                size_t block = std::min(count - done, uint64_t(config.data_buffer_size));
+                done += read ? connection->send_file(file, offset + done, block, buffer) :
+                        connection->read_file(file, offset + done, block, buffer);
+            }
+        } catch (...) {
+            delete[] buffer;
+            throw;
         }
+        delete[] buffer;
+    } else {
+        log_request(session, cmd);
+        log_error(session, REQUEST_ERR_INVALID_CMD);
+        send_uint16(connection, REQUEST_ERR_INVALID_CMD);
+        send_uint64(connection, 0);
     }
-    std::unique_lock locker(lock);
-    for (Session::FileDescriptor fd : session->fds) {
-        if (fd.stream) close_fd(session, fd);
+}
+
+void CloudServer::handle_batch(Session *session, NetConnection *connection, uint32_t id, uint64_t size, char *body) {
+    std::vector<std::pair<uint16_t, std::string>> entries;
+    std::vector<uint8_t> refs;
+    bool malformed = size == 0;
+    for (uint64_t pos = 0; pos < size && !malformed;) {
+        if (size - pos < BATCH_ENTRY_HEADER_LENGTH) {
+            malformed = true;
+            break;
+        }
+        uint16_t entry_cmd = buf_read_uint16(body + pos);
+        uint8_t ref = *reinterpret_cast<uint8_t *>(body + pos + sizeof(uint16_t));
+        uint64_t entry_size = buf_read_uint64(body + pos + sizeof(uint16_t) + sizeof(uint8_t));
+        pos += BATCH_ENTRY_HEADER_LENGTH;
+        if (entry_size > size - pos || ref > entries.size()) malformed = true;
+        else {
+            entries.emplace_back(entry_cmd, std::string(body + pos, entry_size));
+            refs.push_back(ref);
+            pos += entry_size;
+        }
     }
-    delete[] body;
-    session->connection->close();
-    delete session->connection;
-    sessions.erase(session);
-    delete session;
+    log_request(session, REQUEST_CMD_BATCH, std::pair("count", std::to_string(entries.size())));
+    if (malformed) {
+        log_error(session, REQUEST_ERR_MALFORMED_CMD);
+        send_uint32(connection, id);
+        send_uint16(connection, REQUEST_ERR_MALFORMED_CMD);
+        send_uint64(connection, 0);
+        return;
+    }
+    std::vector<std::string> results;
+    std::string response;
+    for (size_t i = 0; i < entries.size(); i++) {
+        auto &[entry_cmd, entry_body] = entries[i];
+        uint16_t status = REQUEST_OK;
+        std::string result;
+        // the batch runs wherever the batch itself runs, which may be an event loop
+        if (entry_cmd == REQUEST_CMD_BATCH || entry_cmd == REQUEST_CMD_GOODBYE || is_long_running(entry_cmd)) {
+            status = REQUEST_ERR_NOT_SUPPORTED;
+        } else if (refs[i] && results[i - refs[i]].size() > entry_body.size()) {
+            status = REQUEST_ERR_MALFORMED_CMD;
+        } else {
+            if (refs[i]) entry_body.replace(0, results[i - refs[i]].size(), results[i - refs[i]]);
+            ResponseBuffer buffer;
+            handle_request(session, &buffer, id, entry_cmd, entry_body.size(), entry_body.data());
+            status = buf_read_uint16(buffer.data.c_str() + sizeof(uint32_t));
+            result = buffer.data.substr(REQUEST_HEADER_LENGTH);
+        }
+        char header[BATCH_RESULT_HEADER_LENGTH];
+        buf_send_uint16(header, status);
+        buf_send_uint64(header + sizeof(uint16_t), result.size());
+        response.append(header, BATCH_RESULT_HEADER_LENGTH);
+        response += result;
+        results.push_back(std::move(result));
+        if (status != REQUEST_OK) break;
+    }
+    log_response(session, std::pair("done", std::to_string(results.size())));
+    send_uint32(connection, id);
+    send_uint16(connection, REQUEST_OK);
+    send_uint64(connection, response.size());
+    send_exact(connection, response.size(), response.c_str());
+}
+
+NodeCacheStats CloudServer::get_node_cache_stats() {
+    return node_cache.stats();
 }
 
 void CloudServer::wait_destroy() {
-    if (connector->joinable()) connector->join();
+    for (std::thread *connector : connectors) {
+        if (connector->joinable()) connector->join();
+    }
 }
 
 std::pair<char *, size_t> CloudServer::get_node_head(Node node) {
-    std::string node_file_path = get_node_head_path(node);
-    if (!std::filesystem::is_regular_file(node_file_path)) return {nullptr, 0};
-    std::ifstream node_file(node_file_path);
-    std::string node_string((std::istreambuf_iterator<char>(node_file)), std::istreambuf_iterator<char>());
+    std::string node_string;
+    if (!node_cache.get(node, node_string)) {
+        std::string node_file_path = get_node_head_path(node);
+        if (!std::filesystem::is_regular_file(node_file_path)) return {nullptr, 0};
+        std::ifstream node_file(node_file_path);
+        node_string.assign((std::istreambuf_iterator<char>(node_file)), std::istreambuf_iterator<char>());
+        node_cache.put(node, node_string);
+    }
     char *node_head = new char[node_string.size() + 1];
     memcpy(node_head, node_string.c_str(), node_string.length());
     return {node_head, node_string.length()};
 }
 
+void CloudServer::set_node_head(Node node, const std::string &head) {
+    {
+        std::ofstream node_file(get_node_head_path(node));
+        node_file << head;
+    }
+    node_cache.put(node, head);
+}
+
+void CloudServer::remove_node_head(Node node) {
+    node_cache.erase(node);
+    home_cache.erase(node);
+    std::filesystem::remove(get_node_head_path(node));
+}
+
 std::pair<char *, size_t> CloudServer::get_node_data(Node node) {
     std::string node_file_path = get_node_data_path(node);
     if (!std::filesystem::is_regular_file(node_file_path)) return {nullptr, 0};
@@ -1236,20 +2045,43 @@ bool CloudServer::get_parent(Node node, Node &parent, uint16_t &error) {
 }
 
 bool CloudServer::get_home_owner(Node node, uint16_t &error, std::string &owner) {
-    bool found = false;
+    auto home_owner = home_owners.find(node);
+    if (home_owner == home_owners.end()) return false;
+    owner = home_owner->second;
+    return true;
+}
+
+void CloudServer::load_users() {
+    if (!std::filesystem::is_directory(config.users_directory)) return;
     for (const auto &entry : std::filesystem::directory_iterator(config.users_directory)) {
         std::ifstream user_file(entry.path());
         std::string user_string((std::istreambuf_iterator<char>(user_file)),
                                 std::istreambuf_iterator<char>());
-        const Node *home = reinterpret_cast<const Node *>(user_string.c_str() + USER_PASSWORD_SALT_LENGTH +
-                                                          SHA256_DIGEST_LENGTH);
-        if (*home == node) {
-            found = true;
-            owner = entry.path().filename();
-            break;
+        if (user_string.length() < USER_HEAD_OFFSET_GROUPS) continue;
+        User user;
+        user.salt = user_string.substr(USER_HEAD_OFFSET_SALT, USER_PASSWORD_SALT_LENGTH);
+        user.hash = user_string.substr(USER_HEAD_OFFSET_HASH, SHA256_DIGEST_LENGTH);
+        user.home = *reinterpret_cast<const Node *>(user_string.c_str() + USER_HEAD_OFFSET_HOME);
+        size_t pos = USER_HEAD_OFFSET_GROUPS;
+        while (pos < user_string.length()) {
+            uint8_t length = user_string[pos];
+            pos++;
+            user.groups.insert(user_string.substr(pos, length));
+            pos += length;
         }
+        add_user(entry.path().filename(), user);
     }
-    return found;
+}
+
+void CloudServer::add_user(const std::string &login, const User &user) {
+    users[login] = user;
+    home_owners[user.home] = login;
+    for (const std::string &group : user.groups) group_members[group].insert(login);
+}
+
+void CloudServer::save_user(const std::string &login) {
+    std::ofstream user_file(get_user_head_path(login));
+    user_file << users[login].encode();
 }
 
 Node CloudServer::generate_node() {
@@ -1265,56 +2097,355 @@ std::string CloudServer::get_node_head_path(Node node) {
     return config.nodes_head_directory + PATH_DIV + node2string(node);
 }
 
+Node CloudServer::get_node_home(Node node) {
+    std::vector<Node> climbed;
+    Node current = node;
+    Node home;
+    uint16_t error = REQUEST_OK;
+    while (!home_cache.get(current, home)) {
+        climbed.push_back(current);
+        if (!get_parent(current, current, error)) {
+            home = current;
+            break;
+        }
+    }
+    // a missing node has no home to remember
+    if (error == REQUEST_OK) for (Node climbed_node : climbed) home_cache.put(climbed_node, home);
+    return home;
+}
+
 std::string CloudServer::get_node_owner(Node node) {
-    Node home = node;
     uint16_t error;
-    while (get_parent(home, home, error));
     std::string owner;
-    get_home_owner(home, error, owner);
+    get_home_owner(get_node_home(node), error, owner);
     return owner;
 }
 
+uint16_t CloudServer::resolve_path(Session *session, Node base, const std::string &path, Node &result) {
+    Node current = base;
+    size_t start = 0;
+    if (!path.empty() && (path[0] == CLOUD_PATH_HOME || path[0] == CLOUD_PATH_NODE)) {
+        start = std::min(path.find(CLOUD_PATH_DIV), path.length());
+        std::string name = path.substr(1, start - 1);
+        if (path[0] == CLOUD_PATH_HOME) {
+            if (name.empty()) name = session->login;
+            if (!is_valid_login(name)) return REQUEST_ERR_NOT_FOUND;
+            auto user = users.find(name);
+            if (user == users.end()) return REQUEST_ERR_NOT_FOUND;
+            current = user->second.home;
+        } else {
+            try {
+                current = string2node(name);
+            } catch (std::invalid_argument &) {
+                return REQUEST_ERR_NOT_FOUND;
+            }
+        }
+    }
+    if (!node_exists(current)) return REQUEST_ERR_NOT_FOUND;
+    while (start < path.length()) {
+        size_t end = std::min(path.find(CLOUD_PATH_DIV, start), path.length());
+        std::string part = path.substr(start, end - start);
+        start = end + 1;
+        if (part.empty()) continue;
+        uint16_t error;
+        if (part == "..") {
+            get_parent(current, current, error);
+            continue;
+        }
+        auto[node_head, head_size] = get_node_head(current);
+        if (!node_head) return REQUEST_ERR_NOT_FOUND;
+        uint8_t type = *(node_head + NODE_HEAD_OFFSET_TYPE);
+        delete[] node_head;
+        if (!get_user_rights(current, session->login).read) return REQUEST_ERR_FORBIDDEN;
+        if (type != NODE_TYPE_DIRECTORY) return REQUEST_ERR_NOT_A_DIRECTORY;
+        auto[dir_data, dir_size] = get_node_data(current);
+        auto[child_pos, child_size] = find_child_by_name(dir_data, dir_size, part);
+        if (child_pos != -1) current = *reinterpret_cast<Node *>(dir_data + child_pos);
+        delete[] dir_data;
+        if (child_pos == -1) return REQUEST_ERR_NOT_FOUND;
+    }
+    result = current;
+    return REQUEST_OK;
+}
+
+uint16_t CloudServer::get_node_path(Session *session, Node node, std::string &path) {
+    if (!node_exists(node)) return REQUEST_ERR_NOT_FOUND;
+    std::string result;
+    Node current = node;
+    Node parent;
+    uint16_t error;
+    while (get_parent(current, parent, error)) {
+        std::string name(1, CLOUD_PATH_UNKNOWN);
+        if (get_user_rights(parent, session->login).read) {
+            auto[dir_data, dir_size] = get_node_data(parent);
+            auto[child_pos, child_size] = find_child_by_node(dir_data, dir_size, current);
+            if (child_pos != -1) {
+                name = std::string(dir_data + child_pos + sizeof(Node) + 1, child_size - sizeof(Node) - 1);
+            }
+            delete[] dir_data;
+        }
+        result = CLOUD_PATH_DIV + name + result;
+        current = parent;
+    }
+    std::string owner;
+    get_home_owner(current, error, owner);
+    path = CLOUD_PATH_HOME + owner + result;
+    return REQUEST_OK;
+}
+
 bool CloudServer::node_exists(Node node) {
-    return std::filesystem::is_regular_file(get_node_head_path(node));
+    std::string node_head;
+    return node_cache.get(node, node_head) || std::filesystem::is_regular_file(get_node_head_path(node));
+}
+
+bool CloudServer::is_written(Node node) {
+    auto writer = writers.find(node);
+    return (writer != writers.end() && writer->second) || shared_writers.count(node);
+}
+
+bool CloudServer::is_open(Node node) {
+    auto reader = readers.find(node);
+    return (reader != readers.end() && !reader->second.empty()) || is_written(node);
+}
+
+uint16_t CloudServer::remove_node(Session *session, Node node) {
+    if (!node_exists(node)) return REQUEST_ERR_NOT_FOUND;
+    auto[node_head, node_head_size] = get_node_head(node);
+    uint8_t type = *(node_head + NODE_HEAD_OFFSET_TYPE);
+    delete[] node_head;
+    if (type == NODE_TYPE_DIRECTORY) {
+        auto[node_data, node_data_size] = get_node_data(node);
+        delete[] node_data;
+        if (node_data_size) return REQUEST_ERR_DIRECTORY_IS_NOT_EMPTY;
+    }
+    if (!get_user_rights(node, session->login).write) return REQUEST_ERR_FORBIDDEN;
+    if (is_open(node)) return REQUEST_ERR_BUSY;
+    // homes have no parent and are never removed
+    uint16_t error = REQUEST_OK;
+    Node parent;
+    if (!get_parent(node, parent, error)) return REQUEST_ERR_FORBIDDEN;
+    // cut parent link to node
+    auto[parent_data, parent_data_size] = get_node_data(parent);
+    auto[cut_pos, cut_sz] = find_child_by_node(parent_data, parent_data_size, node);
+    if (cut_pos == -1) {
+        delete[] parent_data;
+        return REQUEST_ERR_NOT_FOUND;
+    }
+    std::string parent_data_string(parent_data, parent_data_size);
+    delete[] parent_data;
+    parent_data_string.erase(cut_pos, cut_sz);
+    {
+        std::ofstream parent_data_file(get_node_data_path(parent));
+        parent_data_file << parent_data_string;
+    }
+    std::filesystem::remove(get_node_data_path(node));
+    remove_node_head(node);
+    readers.erase(node);
+    writers.erase(node);
+    return REQUEST_OK;
+}
+
+void CloudServer::yield_lock(std::unique_lock<std::shared_mutex> &global_locker,
+                             std::unique_lock<std::mutex> &session_locker) {
+    session_locker.unlock();
+    global_locker.unlock();
+    global_locker.lock();
+    session_locker.lock();
+}
+
+void CloudServer::remove_tree(Session *session, Node root, TreeProgress &progress,
+                              std::unique_lock<std::shared_mutex> &global_locker,
+                              std::unique_lock<std::mutex> &session_locker) {
+    struct Task {
+        Node node;
+        Node parent;
+        bool expanded; // set once the children of a directory are on the stack
+    };
+    Node root_parent;
+    uint16_t error = REQUEST_OK;
+    if (!get_parent(root, root_parent, error)) return;
+    std::vector<Task> stack{{root, root_parent, false}};
+    while (!stack.empty()) {
+        if (++progress.steps % TREE_LOCK_STEPS == 0) yield_lock(global_locker, session_locker);
+        Task task = stack.back();
+        // the tree may change while the lock is yielded, nodes which are gone or moved elsewhere are left alone
+        Node parent;
+        if (!node_exists(task.node) || !get_parent(task.node, parent, error) || parent != task.parent) {
+            stack.pop_back();
+            continue;
+        }
+        auto[node_head, node_head_size] = get_node_head(task.node);
+        uint8_t type = *(node_head + NODE_HEAD_OFFSET_TYPE);
+        delete[] node_head;
+        if (type == NODE_TYPE_DIRECTORY && !task.expanded) {
+            if (!get_user_rights(task.node, session->login).read) {
+                stack.pop_back();
+                progress.fail(task.node, REQUEST_ERR_FORBIDDEN);
+                continue;
+            }
+            stack.back().expanded = true;
+            auto[node_data, node_data_size] = get_node_data(task.node);
+            for (size_t offset = 0; offset + sizeof(Node) < node_data_size;) {
+                stack.push_back({*reinterpret_cast<const Node *>(node_data + offset), task.node, false});
+                offset += sizeof(Node) + 1 + uint8_t(node_data[offset + sizeof(Node)]);
+            }
+            delete[] node_data;
+            continue;
+        }
+        stack.pop_back();
+        error = remove_node(session, task.node);
+        if (error == REQUEST_OK) progress.done++;
+        else progress.fail(task.node, error);
+    }
+}
+
+uint16_t CloudServer::copy_node(Session *session, Node node, Node parent, const std::string &name, Node &clone,
+                                std::unique_lock<std::shared_mutex> &global_locker,
+                                std::unique_lock<std::mutex> &session_locker) {
+    if (!node_exists(node) || !node_exists(parent)) return REQUEST_ERR_NOT_FOUND;
+    if (!get_user_rights(node, session->login).read) return REQUEST_ERR_FORBIDDEN;
+    auto[node_head, node_head_size] = get_node_head(node);
+    uint8_t type = *(node_head + NODE_HEAD_OFFSET_TYPE);
+    // a file being written would be copied half done
+    if (type == NODE_TYPE_FILE && is_written(node)) {
+        delete[] node_head;
+        return REQUEST_ERR_BUSY;
+    }
+    // the clone keeps the attributes of the node and points to its new parent
+    auto owner_size = (size_t) *reinterpret_cast<unsigned char *>(node_head + NODE_HEAD_OFFSET_OWNER_GROUP_SIZE);
+    std::string clone_head(node_head, NODE_HEAD_OFFSET_OWNER_GROUP + owner_size);
+    clone_head.append(reinterpret_cast<char *>(&parent), sizeof(Node));
+    delete[] node_head;
+    clone = generate_node();
+    set_node_head(clone, clone_head);
+    bool copied = true;
+    if (type == NODE_TYPE_FILE) {
+        writers[clone] = session;
+        session_locker.unlock();
+        global_locker.unlock();
+        try {
+            std::filesystem::copy(get_node_data_path(node), get_node_data_path(clone));
+        } catch (std::filesystem::filesystem_error &) {
+            copied = false;
+        }
+        global_locker.lock();
+        session_locker.lock();
+        writers.erase(clone);
+    } else {
+        std::ofstream clone_data_file(get_node_data_path(clone));
+    }
+    auto[parent_data, parent_data_size] = get_node_data(parent);
+    uint16_t error = REQUEST_OK;
+    if (!copied || !parent_data) error = REQUEST_ERR_NOT_FOUND;
+    else if (find_child_by_name(parent_data, parent_data_size, name).first != -1) error = REQUEST_ERR_EXISTS;
+    if (error != REQUEST_OK) {
+        delete[] parent_data;
+        std::filesystem::remove(get_node_data_path(clone));
+        remove_node_head(clone);
+        return error;
+    }
+    std::string parent_data_string(parent_data, parent_data_size);
+    delete[] parent_data;
+    parent_data_string.append(reinterpret_cast<char *>(&clone), sizeof(Node));
+    parent_data_string += char(name.length());
+    parent_data_string += name;
+    std::ofstream parent_data_file(get_node_data_path(parent));
+    parent_data_file << parent_data_string;
+    return REQUEST_OK;
+}
+
+uint16_t CloudServer::copy_tree(Session *session, Node root, Node parent, const std::string &name, Node &clone,
+                                TreeProgress &progress, std::unique_lock<std::shared_mutex> &global_locker,
+                                std::unique_lock<std::mutex> &session_locker) {
+    struct Task {
+        Node node;
+        Node parent;
+        std::string name;
+    };
+    std::vector<Task> stack{{root, parent, name}};
+    while (!stack.empty()) {
+        if (++progress.steps % TREE_LOCK_STEPS == 0) yield_lock(global_locker, session_locker);
+        Task task = stack.back();
+        stack.pop_back();
+        Node node_clone;
+        uint16_t error = copy_node(session, task.node, task.parent, task.name, node_clone, global_locker,
+                                   session_locker);
+        if (progress.steps == 1) {
+            if (error != REQUEST_OK) return error;
+            clone = node_clone;
+        }
+        if (error != REQUEST_OK) {
+            progress.fail(task.node, error);
+            continue;
+        }
+        progress.done++;
+        auto[node_head, node_head_size] = get_node_head(node_clone);
+        bool directory = *(node_head + NODE_HEAD_OFFSET_TYPE) == NODE_TYPE_DIRECTORY;
+        delete[] node_head;
+        if (!directory) continue;
+        // pushed in reverse, so that the clones are listed in the order of the originals
+        auto[node_data, node_data_size] = get_node_data(task.node);
+        std::vector<Task> children;
+        for (size_t offset = 0; offset + sizeof(Node) < node_data_size;) {
+            auto name_length = uint8_t(node_data[offset + sizeof(Node)]);
+            children.push_back({*reinterpret_cast<const Node *>(node_data + offset), node_clone,
+                                std::string(node_data + offset + sizeof(Node) + 1, name_length)});
+            offset += sizeof(Node) + 1 + name_length;
+        }
+        delete[] node_data;
+        stack.insert(stack.end(), children.rbegin(), children.rend());
+    }
+    return REQUEST_OK;
+}
+
+void CloudServer::TreeProgress::fail(Node node, uint16_t status) {
+    if (failed++ >= TREE_FAILURES_MAX) return;
+    failures.append(reinterpret_cast<char *>(&node), sizeof(Node));
+    char status_buffer[sizeof(uint16_t)];
+    buf_send_uint16(status_buffer, status);
+    failures.append(status_buffer, sizeof status_buffer);
+}
+
+std::string CloudServer::User::encode() const {
+    std::string data = salt + hash;
+    data.append(reinterpret_cast<const char *>(&home), sizeof(Node));
+    for (const std::string &group : groups) {
+        data += char(group.length());
+        data += group;
+    }
+    return data;
+}
+
+std::string CloudServer::TreeProgress::encode() const {
+    char counts[2 * sizeof(uint64_t)];
+    buf_send_uint64(counts, done);
+    buf_send_uint64(counts + sizeof(uint64_t), failed);
+    return std::string(counts, sizeof counts) + failures;
 }
 
 void CloudServer::close_fd(Session *session, CloudServer::Session::FileDescriptor fd) {
-    delete fd.stream;
+    ::close(fd.file);
     if (fd.mode & NODE_FD_MODE_READ) readers[fd.node].erase(session);
-    if (fd.mode & NODE_FD_MODE_WRITE) writers[fd.node] = nullptr;
+    if (!(fd.mode & NODE_FD_MODE_WRITE)) return;
+    if (fd.mode & NODE_FD_MODE_SHARED_WRITE) {
+        if (--shared_writers[fd.node] == 0) shared_writers.erase(fd.node);
+    } else writers[fd.node] = nullptr;
 }
 
-std::string CloudServer::get_user_head_path(const std::string &user) {
-    return config.users_directory + PATH_DIV + user;
+uint16_t CloudServer::check_fd(Session *session, uint8_t fd, uint8_t mode) {
+    if (fd >= session->fds.size() || session->fds[fd].file == -1) return REQUEST_ERR_BAD_FD;
+    if ((session->fds[fd].mode & mode) != mode) return REQUEST_ERR_NOT_SUPPORTED;
+    return REQUEST_OK;
 }
 
-std::pair<const char *, size_t> CloudServer::get_user_head(const std::string &user) {
-    std::string user_file_path = get_user_head_path(user);
-    if (!std::filesystem::exists(user_file_path)) return {nullptr, 0};
-    std::ifstream user_file(user_file_path);
-    std::string user_string((std::istreambuf_iterator<char>(user_file)), std::istreambuf_iterator<char>());
-    char *ret = new char[user_string.size()];
-    memcpy(ret, user_string.c_str(), user_string.size());
-    return {ret, user_string.size()};
+std::string CloudServer::get_user_head_path(const std::string &user) {
+    return config.users_directory + PATH_DIV + user;
 }
 
 bool CloudServer::is_member(const std::string &user, const std::string &group) {
     if (user == group) return true;
-    auto[user_head, user_size] = get_user_head(user);
-    const char *ptr = user_head + USER_HEAD_OFFSET_GROUPS;
-    bool res = false;
-    while (ptr < user_head + user_size) {
-        uint8_t length = *reinterpret_cast<const uint8_t *>(ptr);
-        ptr++;
-        std::string cur_group(ptr, length);
-        if (cur_group == group) {
-            res = true;
-            break;
-        }
-        ptr += length;
-    }
-    delete[] user_head;
-    return res;
+    auto members = group_members.find(group);
+    return members != group_members.end() && members->second.count(user);
 }
 
 std::string CloudServer::get_node_group(const char *node_head) {
@@ -1323,20 +2454,12 @@ std::string CloudServer::get_node_group(const char *node_head) {
 }
 
 void CloudServer::remove_from_group(const std::string &group, const std::string &user) {
-    auto[head_p, size] = get_user_head(user);
-    std::string head(head_p, size);
-    delete[] head_p;
-    size_t pos = USER_HEAD_OFFSET_GROUPS;
-    while (pos < size) {
-        uint8_t length = head[pos];
-        pos++;
-        if (head.substr(pos, length) == group) {
-            std::ofstream head_stream(get_user_head_path(user));
-            head_stream << head.substr(0, pos - 1) << head.substr(pos + length);
-            return;
-        }
-        pos += length;
-    }
+    auto user_entry = users.find(user);
+    if (user_entry == users.end() || !user_entry->second.groups.erase(group)) return;
+    auto members = group_members.find(group);
+    members->second.erase(user);
+    if (members->second.empty()) group_members.erase(members);
+    save_user(user);
 }
 
 std::pair<ssize_t, ssize_t> CloudServer::find_child_by_node(const char *dir_data, size_t dir_data_size, Node node) {
@@ -1371,6 +2494,7 @@ CloudServer::find_child_by_name(const char *dir_data, size_t dir_data_size, cons
             child_sz = sizeof(Node) + 1 + len;
             break;
         }
+        pos += len;
     }
     return {child_pos, child_sz};
 }
@@ -1391,6 +2515,39 @@ bool CloudServer::use_invite(const std::string &invite) {
     return ok;
 }
 
-CloudServer::Session::Session(NetConnection *connection, size_t id) : connection(connection), id(id) {
+size_t CloudServer::ResponseBuffer::send(size_t n, const void *buffer) {
+    data.append(static_cast<const char *>(buffer), n);
+    return n;
+}
+
+size_t CloudServer::ResponseBuffer::read(size_t, void *) {
+    throw std::runtime_error("response buffer is write only");
+}
+
+size_t CloudServer::ResponseBuffer::read_nonblock(size_t, void *) {
+    throw std::runtime_error("response buffer is write only");
+}
+
+size_t CloudServer::ResponseBuffer::send_nonblock(size_t n, const void *buffer) {
+    return send(n, buffer);
+}
+
+int CloudServer::ResponseBuffer::get_fd() {
+    return -1;
+}
+
+void CloudServer::ResponseBuffer::close() {
+
+}
+
+bool CloudServer::ResponseBuffer::is_valid() {
+    return true;
+}
+
+void CloudServer::ResponseBuffer::flush() {
+
+}
+
+CloudServer::Session::Session(BufferedConnection<NetConnection> *connection, size_t id) : connection(connection), id(id) {
 
 }
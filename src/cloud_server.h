@@ -7,10 +7,25 @@
 #include <fstream>
 #include <set>
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
 #include "networking.h"
 #include "cloud_common.h"
 
+static const char *CLOUD_IO_MODEL_THREADS = "threads"; // thread per connection
+static const char *CLOUD_IO_MODEL_EPOLL = "epoll"; // fixed number of epoll event loops
+
+static const size_t TREE_LOCK_STEPS = 256; // nodes a recursive request handles before it lets other requests run
+
+static const size_t NODE_CACHE_SHARDS = 16;
+
 class CloudConfig {
 public:
     std::string users_directory;
@@ -20,6 +35,10 @@ public:
     std::string invites_file;
     size_t data_buffer_size;
     size_t net_buffer_size;
+    std::string io_model = CLOUD_IO_MODEL_THREADS;
+    size_t event_loops = 0; // 0 means the number of CPU cores
+    size_t request_workers = 0; // 0 means requests are executed by the thread that reads them
+    size_t node_cache_size = 65536; // node heads and homes kept in memory, 0 disables the caches
 
     CloudConfig();
 
@@ -30,6 +49,107 @@ struct ReadWrite {
     bool read = false, write = false;
 };
 
+struct NodeCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t size = 0;
+};
+
+struct NodeHash {
+    size_t operator()(const Node &node) const {
+        size_t hash; // node ids are random, so their first bytes are a good enough hash
+        std::memcpy(&hash, node.id, sizeof hash);
+        return hash;
+    }
+};
+
+// bounded LRU cache of something known about nodes, split into shards so that parallel read only requests rarely
+// contend
+template<typename T>
+class NodeCache final {
+private:
+    struct Shard {
+        std::mutex lock;
+        std::list<std::pair<Node, T>> entries; // most recently used first
+        std::unordered_map<Node, typename std::list<std::pair<Node, T>>::iterator, NodeHash> index;
+    };
+
+    const size_t shard_capacity;
+    Shard shards[NODE_CACHE_SHARDS];
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+
+    Shard &get_shard(Node node) {
+        return shards[NodeHash()(node) % NODE_CACHE_SHARDS];
+    }
+
+public:
+    explicit NodeCache(size_t capacity) : shard_capacity((capacity + NODE_CACHE_SHARDS - 1) / NODE_CACHE_SHARDS) {}
+
+    NodeCache(const NodeCache &) = delete;
+
+    // counts a hit or a miss
+    bool get(Node node, T &value) {
+        Shard &shard = get_shard(node);
+        std::unique_lock locker(shard.lock);
+        auto entry = shard.index.find(node);
+        if (entry == shard.index.end()) {
+            misses++;
+            return false;
+        }
+        hits++;
+        shard.entries.splice(shard.entries.begin(), shard.entries, entry->second);
+        value = entry->second->second;
+        return true;
+    }
+
+    void put(Node node, const T &value) {
+        if (shard_capacity == 0) return;
+        Shard &shard = get_shard(node);
+        std::unique_lock locker(shard.lock);
+        auto entry = shard.index.find(node);
+        if (entry != shard.index.end()) {
+            entry->second->second = value;
+            shard.entries.splice(shard.entries.begin(), shard.entries, entry->second);
+            return;
+        }
+        if (shard.entries.size() >= shard_capacity) {
+            shard.index.erase(shard.entries.back().first);
+            shard.entries.pop_back();
+        }
+        shard.entries.emplace_front(node, value);
+        shard.index[node] = shard.entries.begin();
+    }
+
+    void erase(Node node) {
+        Shard &shard = get_shard(node);
+        std::unique_lock locker(shard.lock);
+        auto entry = shard.index.find(node);
+        if (entry == shard.index.end()) return;
+        shard.entries.erase(entry->second);
+        shard.index.erase(entry);
+    }
+
+    void clear() {
+        for (Shard &shard : shards) {
+            std::unique_lock locker(shard.lock);
+            shard.entries.clear();
+            shard.index.clear();
+        }
+    }
+
+    NodeCacheStats stats() {
+        NodeCacheStats stats;
+        stats.hits = hits;
+        stats.misses = misses;
+        for (Shard &shard : shards) {
+            std::unique_lock locker(shard.lock);
+            stats.size += shard.entries.size();
+        }
+        return stats;
+    }
+};
+
 class CloudServer final {
 private:
     class Session {
@@ -38,37 +158,193 @@ private:
         public:
             Node node;
             uint8_t mode;
-            std::fstream *stream;
+            int file = -1;
+            uint64_t position = 0;
+            bool eof = false;
+        };
+
+        enum Stage {
+            STAGE_NEGOTIATION, STAGE_INIT, STAGE_REQUEST
         };
 
-        NetConnection *const connection;
+        BufferedConnection<NetConnection> *const connection;
         std::string login;
         std::vector<FileDescriptor> fds;
         std::mutex lock;
         size_t id;
+        bool goodbye = false;
+        size_t in_flight = 0; // requests being executed by workers, guarded by lock
+        std::string failure; // set by a worker that failed to serve a request, guarded by lock
+        std::condition_variable idle;
+        // responses of the workers, which are sent by the session's own thread or event loop, guarded by lock
+        std::string output;
+        std::string sending; // taken from output and being sent
+        size_t sending_offset = 0;
+        int wakeup = -1; // eventfd the workers wake the listener of the threads io model with
+        bool kicked = false; // waits in the kick queue of its event loop, guarded by the queue's lock
+        bool parked = false; // a transfer thread has the connection, the event loop leaves it alone, guarded by lock
+        std::thread *transfer = nullptr;
+        bool closing = false; // ended, but still has requests on the workers, guarded by lock
+
+        // incremental frame decoder state, used by the epoll io model
+        Stage stage = STAGE_NEGOTIATION;
+        char frame_header[REQUEST_HEADER_LENGTH];
+        size_t frame_header_fullness = 0;
+        char *frame_body = nullptr;
+        uint64_t frame_body_size = 0;
+        uint64_t frame_body_fullness = 0;
+        int event_loop = -1;
+
+        Session(BufferedConnection<NetConnection> *connection, size_t id);
+    };
+
+    // the outcome of a recursive request
+    struct TreeProgress {
+        uint64_t done = 0;
+        uint64_t failed = 0;
+        std::string failures; // node, status for up to TREE_FAILURES_MAX nodes
+        size_t steps = 0;
+
+        void fail(Node node, uint16_t status);
+
+        std::string encode() const;
+    };
+
+    // the contents of a user file, which stays the persistent copy
+    struct User {
+        std::string salt;
+        std::string hash;
+        Node home;
+        std::unordered_set<std::string> groups;
+
+        std::string encode() const;
+    };
+
+    // collects a response produced by a worker, so that it is sent to the client at once
+    class ResponseBuffer final : public NetConnection {
+    public:
+        std::string data;
+
+        size_t send(size_t n, const void *buffer) override;
+
+        size_t read(size_t n, void *buffer) override;
+
+        size_t read_nonblock(size_t n, void *buffer) override;
+
+        size_t send_nonblock(size_t n, const void *buffer) override;
+
+        int get_fd() override;
+
+        void close() override;
 
-        Session(NetConnection *connection, size_t id);
+        bool is_valid() override;
+
+        void flush() override;
     };
 
 private:
+    // what a session waits for once it has served everything it could
+    enum SessionWait {
+        WAIT_READABLE, WAIT_WRITABLE, WAIT_KICK, WAIT_CLOSED
+    };
+
+    // sessions that workers have finished something for, served by their event loop
+    struct KickQueue {
+        int event = -1;
+        std::mutex lock;
+        std::vector<Session *> sessions;
+    };
+
     const CloudConfig config;
-    NetServer *const net;
-    std::thread *connector;
+    const std::vector<NetServer *> nets;
+    std::vector<std::thread *> connectors;
     std::vector<std::thread *> listeners;
+    std::vector<std::thread *> event_loops;
+    std::vector<std::thread *> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex tasks_lock;
+    std::condition_variable tasks_notifier;
+    bool stopping_workers = false;
+    std::vector<int> event_loop_fds;
+    std::vector<KickQueue *> kick_queues;
+    int event_loop_wakeup = -1;
     std::set<Session *> sessions;
     bool shutting_down = false;
-    std::mutex lock;
+    std::shared_mutex lock; // read only requests hold it shared
+    std::mutex log_lock;
     std::map<Node, std::set<Session *>> readers;
     std::map<Node, Session *> writers;
+    std::map<Node, size_t> shared_writers;
+    NodeCache<std::string> node_cache; // raw node heads
+    NodeCache<Node> home_cache; // the home each node is in
+    // all the users, read once at startup and changed together with their files, guarded by lock
+    std::unordered_map<std::string, User> users;
+    std::unordered_map<std::string, std::unordered_set<std::string>> group_members;
+    std::unordered_map<Node, std::string, NodeHash> home_owners;
     std::ofstream access_log;
     size_t session_id = 0;
 
-    void connector_routine();
+    void connector_routine(NetServer *net, size_t shard);
 
     void listener_routine(Session *);
 
+    void event_loop_routine(size_t loop);
+
+    void worker_routine();
+
+    // runs a long request of a session of an event loop, which is parked meanwhile
+    void transfer_routine(Session *session, uint32_t id, uint16_t cmd, uint64_t size, char *body);
+
+    // reads and runs requests until the session has to wait, the threads io model without workers reads blocking
+    SessionWait serve_session(Session *session);
+
+    void step_session(Session *session);
+
+    void watch_session(Session *session, int op, uint32_t events);
+
+    // makes the session's thread or event loop serve it, the session lock must be held
+    void kick_session(Session *session);
+
+    // sends the responses of the workers, returns false if the rest has to wait for the peer to read
+    bool send_output(Session *session, bool block = false);
+
+    void close_session(Session *session);
+
+    void negotiate(Session *session, const char *client_header);
+
+    [[noreturn]] void init_error(Session *session, uint16_t error);
+
+    void init_session(Session *session, uint16_t cmd, uint64_t size, char *body);
+
+    // runs a read only request on a worker, which queues its response, takes ownership of the body
+    void submit_request(Session *session, uint32_t id, uint16_t cmd, uint64_t size, char *body);
+
+    // runs a request on the connection once the queued responses are sent, takes ownership of the body
+    void run_request(Session *session, uint32_t id, uint16_t cmd, uint64_t size, char *body);
+
+    // runs a request that doesn't read from the connection and queues its response, takes ownership of the body
+    void queue_request(Session *session, uint32_t id, uint16_t cmd, uint64_t size, char *body);
+
+    void wait_idle(Session *session);
+
+    static bool is_read_only(uint16_t cmd);
+
+    // transfers and recursive requests, which the epoll io model runs outside of the event loops
+    static bool is_long_running(uint16_t cmd);
+
+    void handle_request(Session *session, NetConnection *connection, uint32_t id, uint16_t cmd, uint64_t size,
+                        char *body);
+
+    void handle_batch(Session *session, NetConnection *connection, uint32_t id, uint64_t size, char *body);
+
     std::pair<char *, size_t> get_node_head(Node node);
 
+    // writes the head file and updates the cache, all head changes must go through it
+    void set_node_head(Node node, const std::string &head);
+
+    // removes the head file and everything cached about the node
+    void remove_node_head(Node node);
+
     std::pair<char *, size_t> get_node_data(Node node); // use only for directories
 
     ReadWrite get_user_rights(Node node, const std::string &user);
@@ -81,17 +357,59 @@ private:
 
     bool get_home_owner(Node node, uint16_t &error, std::string &owner);
 
+    // reads all the user files once, later registrations add their users
+    void load_users();
+
+    void add_user(const std::string &login, const User &user);
+
+    void save_user(const std::string &login);
+
     Node generate_node();
 
+    // climbs to the home only until a node whose home is cached
+    Node get_node_home(Node node);
+
     std::string get_node_owner(Node node);
 
+    // resolves the path like the shell does, a directory is searched only if the user may list it
+    uint16_t resolve_path(Session *session, Node base, const std::string &path, Node &result);
+
+    // names in directories the user may not list are replaced by CLOUD_PATH_UNKNOWN
+    uint16_t get_node_path(Session *session, Node node, std::string &path);
+
     bool node_exists(Node node);
 
+    bool is_written(Node node);
+
+    // true if the node is open for reading or writing by any session
+    bool is_open(Node node);
+
+    // removes a single node with the checks of REMOVE_NODE
+    uint16_t remove_node(Session *session, Node node);
+
+    // lets the other requests in between the steps of a recursive request
+    void yield_lock(std::unique_lock<std::shared_mutex> &global_locker, std::unique_lock<std::mutex> &session_locker);
+
+    // removes the tree bottom up, a directory is removed once its children are gone
+    void remove_tree(Session *session, Node root, TreeProgress &progress,
+                     std::unique_lock<std::shared_mutex> &global_locker, std::unique_lock<std::mutex> &session_locker);
+
+    // clones a single node into parent under the given name, the data of a file is copied without the global lock
+    uint16_t copy_node(Session *session, Node node, Node parent, const std::string &name, Node &clone,
+                       std::unique_lock<std::shared_mutex> &global_locker,
+                       std::unique_lock<std::mutex> &session_locker);
+
+    // copies the tree top down, returns the status of the root whose clone is stored in clone
+    uint16_t copy_tree(Session *session, Node root, Node parent, const std::string &name, Node &clone,
+                       TreeProgress &progress, std::unique_lock<std::shared_mutex> &global_locker,
+                       std::unique_lock<std::mutex> &session_locker);
+
     void close_fd(Session *session, Session::FileDescriptor fd);
 
-    std::string get_user_head_path(const std::string &user);
+    // returns REQUEST_OK if the session has the fd open in the given mode
+    static uint16_t check_fd(Session *session, uint8_t fd, uint8_t mode);
 
-    std::pair<const char *, size_t> get_user_head(const std::string &user);
+    std::string get_user_head_path(const std::string &user);
 
     bool is_member(const std::string &user, const std::string &group);
 
@@ -112,6 +430,7 @@ private:
     template<typename... P>
     void log_request(Session *session, uint16_t request, P... pairs) {
         if (config.access_log.empty()) return;
+        std::unique_lock locker(log_lock);
         access_log << "[" << generate_timestamp() << "] ";
         std::string s_pairs[]{log_pair_to_str(pairs)...};
         access_log << session->id << " ";
@@ -123,6 +442,7 @@ private:
     template<typename... P>
     void log_error(Session *session, uint16_t status, P... pairs) {
         if (config.access_log.empty()) return;
+        std::unique_lock locker(log_lock);
         access_log << "[" << generate_timestamp() << "] ";
         std::string s_pairs[]{log_pair_to_str(pairs)...};
         access_log << session->id << " ";
@@ -134,6 +454,7 @@ private:
     template<typename... P>
     void log_response(Session *session, P... pairs) {
         if (config.access_log.empty()) return;
+        std::unique_lock locker(log_lock);
         access_log << "[" << generate_timestamp() << "] ";
         std::string s_pairs[]{log_pair_to_str(pairs)...};
         access_log << session->id << " ";
@@ -145,6 +466,7 @@ private:
     template<typename... P>
     void log_init(Session *session, P... pairs) {
         if (config.access_log.empty()) return;
+        std::unique_lock locker(log_lock);
         access_log << "[" << generate_timestamp() << "] ";
         std::string s_pairs[]{log_pair_to_str(pairs)...};
         access_log << session->id << " ";
@@ -155,6 +477,7 @@ private:
 
     void log_exit(Session *session, const std::string &reason) {
         if (config.access_log.empty()) return;
+        std::unique_lock locker(log_lock);
         access_log << "[" << generate_timestamp() << "] ";
         access_log << session->id << " ";
         access_log << "\tBYE ";
@@ -165,8 +488,13 @@ private:
 public:
     CloudServer(NetServer *net, const CloudConfig &config);
 
+    // serves connections of all the given servers, e.g. a TCP or SSL server together with a local unix socket
+    CloudServer(const std::vector<NetServer *> &nets, const CloudConfig &config);
+
     void wait_destroy();
 
+    NodeCacheStats get_node_cache_stats();
+
     ~CloudServer();
 };
 
@@ -3,6 +3,7 @@
 #include <vector>
 #include "networking_ssl.h"
 #include "networking_tcp.h"
+#include "networking_unix.h"
 #include "iostream"
 #include "cloud_common.h"
 #include "cloud_client.h"
@@ -11,6 +12,8 @@
 
 static const std::string OPTION_LONG_PORT = "port=";
 static const std::string OPTION_LONG_NET_BUFFER_SIZE = "nbs=";
+static const std::string OPTION_LONG_UNIX = "unix=";
+static const std::string TLS_SESSION_FILE_PREFIX = "/.cloud9_session_";
 
 void print_version() {
     std::cout << "cloud9 version " << CLOUD9_REL_NAME << " (" << CLOUD9_REL_CODE << ")" << std::endl;
@@ -18,6 +21,7 @@ void print_version() {
 
 void print_usage() {
     std::cout << "Usage: cloud9 [OPTIONS]... [USERNAME@]HOST" << std::endl;
+    std::cout << "  or:  cloud9 [OPTIONS]... --unix=PATH [USERNAME@]" << std::endl;
     std::cout << "Console Cloud9 client." << std::endl;
     std::cout << std::endl;
     std::cout << "Default behavior: connects to HOST and logs in with USERNAME." << std::endl;
@@ -33,6 +37,8 @@ void print_usage() {
     std::cout << " \t" << "-t" << "\t\t" << "insecure (TCP) connection" << std::endl;
     std::cout << " \t" << "--port=<port>" << "\t" << "server port, default " << CLOUD_DEFAULT_PORT << std::endl;
     std::cout << " \t" << "--nbs=<size>" << "\t" << "net buffer size, default 1 MiB" << std::endl;
+    std::cout << " \t" << "--unix=<path>" << "\t" << "connect to the server's unix socket, the password is not asked" << std::endl;
+    std::cout << " \t" << "" << "\t\t" << "if you run as the same system user as the server" << std::endl;
 }
 
 int main(int argc, const char **argv) {
@@ -71,25 +77,8 @@ int main(int argc, const char **argv) {
             return 1;
         }
     }
-    if (args.empty() || args[0].empty()) {
-        std::cerr << "No target specified" << std::endl;
-        return 1;
-    }
-    std::string login;
-    std::string host;
-    { // parsing target
-        std::string target = args[0];
-        auto login_end = std::find(target.begin(), target.end(), LOGIN_DIV);
-        size_t host_begin = 0;
-        if (login_end == target.end()) {
-            login = getenv("USER");
-        } else {
-            login = target.substr(0, login_end - target.begin());
-            host_begin = login_end - target.begin() + 1;
-        }
-        host = target.substr(host_begin);
-    }
     size_t net_buffer_size = DEFAULT_NET_BUFFER_SIZE;
+    std::string unix_path;
     for (std::string &o : options_long) {
         if (o.empty()) continue;
         if (o.find(OPTION_LONG_PORT) == 0) {
@@ -120,22 +109,58 @@ int main(int argc, const char **argv) {
                 return 1;
             }
             net_buffer_size = size;
+        } else if (o.find(OPTION_LONG_UNIX) == 0) {
+            unix_path = o.substr(OPTION_LONG_UNIX.length());
+            if (unix_path.empty()) {
+                std::cerr << "Unix socket path must not be empty" << std::endl;
+                return 1;
+            }
         } else {
             std::cerr << "Unknown long option '" << o << "'" << std::endl;
             return 1;
         }
     }
+    if ((args.empty() || args[0].empty()) && unix_path.empty()) {
+        std::cerr << "No target specified" << std::endl;
+        return 1;
+    }
+    std::string login;
+    std::string host;
+    { // parsing target
+        std::string target = args.empty() ? "" : args[0];
+        auto login_end = std::find(target.begin(), target.end(), LOGIN_DIV);
+        size_t host_begin = 0;
+        if (login_end == target.end()) {
+            login = getenv("USER");
+        } else {
+            login = target.substr(0, login_end - target.begin());
+            host_begin = login_end - target.begin() + 1;
+        }
+        host = target.substr(host_begin);
+    }
+    if (host.empty()) host = "localhost";
+    auto open_connection = [&]() -> NetConnection * {
+        if (!unix_path.empty())
+            return new BufferedConnection<UnixConnection>(net_buffer_size, unix_path.c_str());
+        else if (tcp)
+            return new BufferedConnection<TCPConnection>(net_buffer_size, host.c_str(), port);
+        else {
+            const char *home = getenv("HOME");
+            std::string session_file = home ? home + TLS_SESSION_FILE_PREFIX + host + "_" + std::to_string(port) : "";
+            return new BufferedConnection<SSLConnection>(net_buffer_size, host.c_str(), port, session_file);
+        }
+    };
     NetConnection *connection = nullptr;
     try {
-        if (tcp)
-            connection = new BufferedConnection<TCPConnection>(net_buffer_size, host.c_str(), port);
-        else connection = new BufferedConnection<SSLConnection>(net_buffer_size, host.c_str(), port);
+        connection = open_connection();
     } catch (std::exception &exception) {
         std::cerr << exception.what() << std::endl;
         return 1;
     }
     int result;
     CloudClient *client = nullptr;
+    // kept for the additional sessions of striped transfers
+    std::string password;
     if (registration) {
         std::cout << "Registering " << login << " at " << host << std::endl;
         try {
@@ -149,13 +174,13 @@ int main(int argc, const char **argv) {
                                          }
                                          return invite;
                                      },
-                                     []() -> std::string {
+                                     [&password]() -> std::string {
                                          std::string password1, password2;
                                          do {
                                              password1 = prompt_password("Enter new password: ");
                                              password2 = prompt_password("Confirm the password: ");
                                          } while (password1 != password2);
-                                         return password1;
+                                         return password = password1;
                                      });
         } catch (std::exception &exception) {
             std::cerr << "Registering failed: " << exception.what() << std::endl;
@@ -166,9 +191,22 @@ int main(int argc, const char **argv) {
     } else {
         std::string prompt = "Password for " + login + "@" + host + ": ";
         try {
-            client = new CloudClient(connection, login, [prompt]() -> std::string {
-                return prompt_password(prompt);
-            });
+            if (!unix_path.empty()) {
+                // the server doesn't check the password of its owner, try that before asking for it
+                try {
+                    client = new CloudClient(connection, login, []() -> std::string { return ""; });
+                } catch (CloudInitError &error) {
+                    if (error.status != INIT_ERR_AUTH_FAILED) throw;
+                    connection->close();
+                    delete connection;
+                    connection = open_connection();
+                }
+            }
+            if (!client) {
+                client = new CloudClient(connection, login, [prompt, &password]() -> std::string {
+                    return password = prompt_password(prompt);
+                });
+            }
         } catch (std::exception &exception) {
             std::cerr << "Authentication failed: " << exception.what() << std::endl;
             connection->close();
@@ -176,7 +214,20 @@ int main(int argc, const char **argv) {
             return 1;
         }
     }
-    result = shell(client, connection, login, host);
+    Connector connect = [&]() -> std::pair<NetConnection *, CloudClient *> {
+        NetConnection *extra = nullptr;
+        try {
+            extra = open_connection();
+            return {extra, new CloudClient(extra, login, [&password]() -> std::string { return password; })};
+        } catch (std::exception &exception) {
+            if (extra) {
+                extra->close();
+                delete extra;
+            }
+            throw std::runtime_error(std::string("failed to open another session: ") + exception.what());
+        }
+    };
+    result = shell(client, connection, login, host, connect);
     delete client;
     connection->close();
     delete connection;
@@ -11,6 +11,8 @@ extern "C" {
 
 #include "networking_ssl.h"
 #include "networking_tcp.h"
+#include "networking_uring.h"
+#include "networking_unix.h"
 #include "cloud_server.h"
 #include "server_config.h"
 
@@ -47,6 +49,7 @@ int main(int argc, const char **argv) {
         return 1;
     }
     NetServer *net;
+    std::vector<NetServer *> nets;
     try {
         if (config.ssl) {
             bool password_prompt = config.ssl_password.empty();
@@ -63,15 +66,24 @@ int main(int argc, const char **argv) {
             };
             auto callback = password_prompt ? callback_prompt : callback_no_prompt;
             net = new SSLServer(config.server_port, config.ssl_cert_path.c_str(), config.ssl_key_path.c_str(), callback,
-                                ud);
+                                ud, config.ssl_ktls, config.ssl_session_cache_size, config.ssl_ticket_key_lifetime,
+                                config.acceptors);
+        } else if (config.io_uring && URingServer::is_supported()) {
+            net = new URingServer(config.server_port);
         } else {
-            net = new TCPServer(config.server_port);
+            if (config.io_uring) {
+                std::cerr << "warning: io_uring is not supported by the kernel, falling back to epoll" << std::endl;
+                config.io_model = CLOUD_IO_MODEL_EPOLL;
+            }
+            net = new TCPServer(config.server_port, config.acceptors);
         }
+        nets.push_back(net);
+        if (config.unix_socket) nets.push_back(new UnixServer(config.unix_path.c_str(), config.unix_trust_owner));
     } catch (std::exception &exception) {
         std::cerr << "failed to start server: " << exception.what() << std::endl;
         return 1;
     }
-    server = new CloudServer(net, config);
+    server = new CloudServer(nets, config);
     server->wait_destroy();
     return 0;
 }
@@ -5,6 +5,13 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 class NetConnection {
 public:
@@ -12,12 +19,67 @@ public:
 
     virtual size_t read(size_t n, void *buffer) = 0;
 
+    // sends data gathered from count buffers, may send less than their total length like writev
+    virtual size_t send_iov(const iovec *iov, size_t count) {
+        size_t sent = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (iov[i].iov_len == 0) continue;
+            size_t part = send(iov[i].iov_len, iov[i].iov_base);
+            sent += part;
+            if (part < iov[i].iov_len) break;
+        }
+        return sent;
+    }
+
+    virtual size_t read_nonblock(size_t n, void *buffer) = 0; // returns 0 if no data is available right now
+
+    virtual size_t send_nonblock(size_t n, const void *buffer) = 0; // returns 0 if nothing can be sent right now
+
+    // poll events of get_fd that tell that send_nonblock can send again after it returned 0
+    virtual short sendable_events() {
+        return POLLOUT;
+    }
+
+    virtual int get_fd() = 0;
+
+    // true if the peer was authenticated by the operating system as the owner of the server
+    virtual bool is_trusted() {
+        return false;
+    }
+
+    // microseconds the transport handshake took from accept to completion, 0 if there was none (yet)
+    virtual uint64_t handshake_time() {
+        return 0;
+    }
+
     virtual void close() = 0;
 
     virtual bool is_valid() = 0;
 
     virtual void flush() = 0;
 
+    // sends up to n bytes of file starting at offset, buffer should have room for n bytes
+    virtual size_t send_file(int file, uint64_t offset, size_t n, char *buffer) {
+        ssize_t read = pread(file, buffer, n, offset);
+        if (read == -1) throw std::runtime_error(std::string("file read error: ") + strerror(errno));
+        if (read == 0) throw std::runtime_error("unexpected end of file");
+        size_t sent = 0;
+        while (sent < size_t(read)) sent += send(read - sent, buffer + sent);
+        return read;
+    }
+
+    // receives up to n bytes and writes them to file starting at offset, buffer should have room for n bytes
+    virtual size_t read_file(int file, uint64_t offset, size_t n, char *buffer) {
+        size_t received = read(n, buffer);
+        size_t written = 0;
+        while (written < received) {
+            ssize_t status = pwrite(file, buffer + written, received - written, offset + written);
+            if (status == -1) throw std::runtime_error(std::string("file write error: ") + strerror(errno));
+            written += status;
+        }
+        return received;
+    }
+
     virtual ~NetConnection() = default;
 };
 
@@ -25,6 +87,15 @@ class NetServer {
 public:
     virtual NetConnection *accept() = 0;
 
+    // number of listening sockets, each of them could be accepted from by its own thread
+    virtual size_t shards() {
+        return 1;
+    }
+
+    virtual NetConnection *accept_shard(size_t /*shard*/) {
+        return accept();
+    }
+
     virtual void destroy() = 0;
 
     virtual bool is_valid() = 0;
@@ -32,41 +103,134 @@ public:
     virtual ~NetServer() = default;
 };
 
+// upper bound of the read buffer, reads that are at least this large bypass it
+#define BUFFERED_CONNECTION_READ_BUFFER_SIZE 65536
+// sends that are at least this large are not copied into the buffer, it is sent together with them instead
+#define BUFFERED_CONNECTION_DIRECT_SEND_SIZE 16384
+
 template<class C>
 class BufferedConnection : public NetConnection {
 private:
     char *const buffer;
     const size_t buffer_size;
     size_t buffer_fullness;
+    const size_t read_buffer_size;
+    char *const read_buffer;
+    size_t read_begin = 0, read_end = 0;
     C *const connection;
 public:
     template<typename ...A>
     explicit BufferedConnection(size_t buffer_size, A ...args) : connection(new C(args...)),
                                                                  buffer_size(buffer_size),
                                                                  buffer(new char[buffer_size]),
-                                                                 buffer_fullness(0) {
+                                                                 buffer_fullness(0),
+                                                                 read_buffer_size(std::min(
+                                                                         buffer_size,
+                                                                         size_t(BUFFERED_CONNECTION_READ_BUFFER_SIZE))),
+                                                                 read_buffer(new char[read_buffer_size]) {
 
     }
 
     BufferedConnection(size_t buffer_size, C *connection) : connection(connection),
                                                             buffer_size(buffer_size),
                                                             buffer(new char[buffer_size]),
-                                                            buffer_fullness(0) {
+                                                            buffer_fullness(0),
+                                                            read_buffer_size(std::min(
+                                                                    buffer_size,
+                                                                    size_t(BUFFERED_CONNECTION_READ_BUFFER_SIZE))),
+                                                            read_buffer(new char[read_buffer_size]) {
 
     }
 
     size_t send(size_t n, const void *data) override {
-        if (buffer_fullness + n > buffer_size) {
-            flush();
-            if (n > buffer_size) return connection->send(n, data);
+        if (n < BUFFERED_CONNECTION_DIRECT_SEND_SIZE && buffer_fullness + n <= buffer_size) {
+            memcpy(buffer + buffer_fullness, data, n);
+            buffer_fullness += n;
+            return n;
         }
-        memcpy(buffer + buffer_fullness, data, n);
-        buffer_fullness += n;
-        return n;
+        iovec part{const_cast<void *>(data), n};
+        return send_iov(&part, 1);
+    }
+
+    size_t send_iov(const iovec *iov, size_t count) override {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) total += iov[i].iov_len;
+        if (total < BUFFERED_CONNECTION_DIRECT_SEND_SIZE && buffer_fullness + total <= buffer_size) {
+            for (size_t i = 0; i < count; i++) {
+                memcpy(buffer + buffer_fullness, iov[i].iov_base, iov[i].iov_len);
+                buffer_fullness += iov[i].iov_len;
+            }
+            return total;
+        }
+        std::vector<iovec> parts;
+        parts.reserve(count + 1);
+        if (buffer_fullness > 0) parts.push_back({buffer, buffer_fullness});
+        parts.insert(parts.end(), iov, iov + count);
+        send_all(parts.data(), parts.size());
+        buffer_fullness = 0;
+        return total;
     }
 
     size_t read(size_t n, void *data) override {
-        return connection->read(n, data);
+        if (read_begin == read_end) {
+            if (n >= read_buffer_size) return connection->read(n, data);
+            read_begin = 0;
+            read_end = connection->read(read_buffer_size, read_buffer);
+        }
+        return take(n, data);
+    }
+
+    size_t read_nonblock(size_t n, void *data) override {
+        if (read_begin == read_end) {
+            if (n >= read_buffer_size) return connection->read_nonblock(n, data);
+            read_begin = 0;
+            read_end = connection->read_nonblock(read_buffer_size, read_buffer);
+        }
+        return take(n, data);
+    }
+
+    // the send buffer is flushed first, so that the data keeps its order
+    size_t send_nonblock(size_t n, const void *data) override {
+        flush();
+        return connection->send_nonblock(n, data);
+    }
+
+    short sendable_events() override {
+        return connection->sendable_events();
+    }
+
+    // number of bytes that can be read without touching the underlying connection
+    size_t available() const {
+        return read_end - read_begin;
+    }
+
+    // blocks until at least n bytes are buffered and returns them without consuming
+    const char *peek(size_t n) {
+        if (n > read_buffer_size) throw std::invalid_argument("peek size exceeds read buffer size");
+        if (read_end - read_begin < n) {
+            memmove(read_buffer, read_buffer + read_begin, read_end - read_begin);
+            read_end -= read_begin;
+            read_begin = 0;
+            while (read_end < n) read_end += connection->read(read_buffer_size - read_end, read_buffer + read_end);
+        }
+        return read_buffer + read_begin;
+    }
+
+    // drops n bytes previously returned by peek
+    void consume(size_t n) {
+        read_begin += std::min(n, read_end - read_begin);
+    }
+
+    int get_fd() override {
+        return connection->get_fd();
+    }
+
+    bool is_trusted() override {
+        return connection->is_trusted();
+    }
+
+    uint64_t handshake_time() override {
+        return connection->handshake_time();
     }
 
     void close() override {
@@ -78,14 +242,59 @@ public:
     }
 
     void flush() override {
-        connection->send(buffer_fullness, buffer);
+        if (buffer_fullness == 0) return;
+        iovec part{buffer, buffer_fullness};
+        send_all(&part, 1);
         buffer_fullness = 0;
     }
 
+    size_t send_file(int file, uint64_t offset, size_t n, char *data) override {
+        flush();
+        return connection->send_file(file, offset, n, data);
+    }
+
+    size_t read_file(int file, uint64_t offset, size_t n, char *data) override {
+        if (read_begin == read_end) return connection->read_file(file, offset, n, data);
+        size_t count = std::min(n, read_end - read_begin);
+        size_t written = 0;
+        while (written < count) {
+            ssize_t status = pwrite(file, read_buffer + read_begin + written, count - written, offset + written);
+            if (status == -1) throw std::runtime_error(std::string("file write error: ") + strerror(errno));
+            written += status;
+        }
+        read_begin += count;
+        return count;
+    }
+
     ~BufferedConnection() override {
         delete[] buffer;
+        delete[] read_buffer;
         delete connection;
     }
+
+private:
+    // sends everything, iov is advanced past the sent bytes
+    void send_all(iovec *iov, size_t count) {
+        while (count > 0) {
+            size_t sent = connection->send_iov(iov, count);
+            while (count > 0 && sent >= iov->iov_len) {
+                sent -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + sent;
+                iov->iov_len -= sent;
+            }
+        }
+    }
+
+    size_t take(size_t n, void *data) {
+        size_t count = std::min(n, read_end - read_begin);
+        memcpy(data, read_buffer + read_begin, count);
+        read_begin += count;
+        return count;
+    }
 };
 
 #endif //CLOUD9_NETWORKING_H
\ No newline at end of file
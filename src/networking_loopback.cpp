@@ -0,0 +1,234 @@
+#include <stdexcept>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "networking_loopback.h"
+
+static size_t ring_capacity(size_t capacity) {
+    size_t power = 1;
+    while (power < capacity) power <<= 1u;
+    return power;
+}
+
+static void signal_event(int event) {
+    uint64_t one = 1;
+    write(event, &one, sizeof one);
+}
+
+static void drain_event(int event) {
+    uint64_t count;
+    read(event, &count, sizeof count);
+}
+
+static void wait_event(int event) {
+    pollfd descriptor{event, POLLIN, 0};
+    poll(&descriptor, 1, -1);
+    drain_event(event);
+}
+
+LoopbackRing::LoopbackRing(size_t capacity) : capacity(ring_capacity(capacity)),
+                                              data(new char[ring_capacity(capacity)]),
+                                              readable(eventfd(0, EFD_NONBLOCK)),
+                                              writable(eventfd(0, EFD_NONBLOCK)) {
+    if (readable == -1 || writable == -1) {
+        if (readable != -1) ::close(readable);
+        if (writable != -1) ::close(writable);
+        delete[] data;
+        throw std::runtime_error(std::string("failed to create loopback ring: ") + strerror(errno));
+    }
+}
+
+size_t LoopbackRing::write(size_t n, const void *buffer, bool block) {
+    while (true) {
+        if (closed) throw std::runtime_error("connection is closed");
+        size_t position = tail.load(std::memory_order_relaxed);
+        size_t space = capacity - (position - head.load(std::memory_order_acquire));
+        if (space > 0) {
+            size_t count = std::min(n, space);
+            size_t offset = position & (capacity - 1);
+            size_t first = std::min(count, capacity - offset);
+            memcpy(data + offset, buffer, first);
+            memcpy(data, static_cast<const char *>(buffer) + first, count - first);
+            tail.store(position + count);
+            if (reader_waiting.exchange(false)) signal_event(readable);
+            return count;
+        }
+        // the flag is set before the second look, so a reader that frees space after it will wake us
+        writer_waiting = true;
+        drain_event(writable);
+        if (!block && writer_event != -1) drain_event(writer_event);
+        if (capacity - (position - head.load()) > 0 || closed) continue;
+        if (!block) return 0;
+        wait_event(writable);
+    }
+}
+
+size_t LoopbackRing::read(size_t n, void *buffer, bool block) {
+    while (true) {
+        size_t position = head.load(std::memory_order_relaxed);
+        size_t available = tail.load(std::memory_order_acquire) - position;
+        if (available > 0) {
+            size_t count = std::min(n, available);
+            size_t offset = position & (capacity - 1);
+            size_t first = std::min(count, capacity - offset);
+            memcpy(buffer, data + offset, first);
+            memcpy(static_cast<char *>(buffer) + first, data, count - first);
+            head.store(position + count);
+            if (writer_waiting.exchange(false)) {
+                signal_event(writable);
+                if (writer_event != -1) signal_event(writer_event);
+            }
+            return count;
+        }
+        if (closed) throw std::runtime_error("connection reset by peer");
+        reader_waiting = true;
+        drain_event(readable);
+        if (tail.load() != position || closed) continue;
+        if (!block) return 0;
+        wait_event(readable);
+    }
+}
+
+void LoopbackRing::close() {
+    closed = true;
+    signal_event(readable);
+    signal_event(writable);
+}
+
+bool LoopbackRing::is_closed() {
+    return closed;
+}
+
+int LoopbackRing::get_readable_fd() {
+    return readable;
+}
+
+void LoopbackRing::set_writer_event(int event) {
+    writer_event = event;
+}
+
+LoopbackRing::~LoopbackRing() {
+    ::close(readable);
+    ::close(writable);
+    delete[] data;
+}
+
+LoopbackConnection::LoopbackConnection(std::shared_ptr<LoopbackRing> in, std::shared_ptr<LoopbackRing> out)
+        : in(std::move(in)), out(std::move(out)) {
+
+}
+
+std::pair<LoopbackConnection *, LoopbackConnection *> LoopbackConnection::make_pair(size_t ring_size) {
+    auto first = std::make_shared<LoopbackRing>(ring_size);
+    auto second = std::make_shared<LoopbackRing>(ring_size);
+    // each end writes to one ring and watches the readable fd of the other
+    first->set_writer_event(second->get_readable_fd());
+    second->set_writer_event(first->get_readable_fd());
+    return {new LoopbackConnection(first, second), new LoopbackConnection(second, first)};
+}
+
+size_t LoopbackConnection::send(size_t n, const void *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    return out->write(n, buffer, true);
+}
+
+size_t LoopbackConnection::read(size_t n, void *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    return in->read(n, buffer, true);
+}
+
+size_t LoopbackConnection::read_nonblock(size_t n, void *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    return in->read(n, buffer, false);
+}
+
+size_t LoopbackConnection::send_nonblock(size_t n, const void *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    return out->write(n, buffer, false);
+}
+
+short LoopbackConnection::sendable_events() {
+    return POLLIN;
+}
+
+int LoopbackConnection::get_fd() {
+    return in->get_readable_fd();
+}
+
+void LoopbackConnection::close() {
+    if (!valid) return;
+    valid = false;
+    in->close();
+    out->close();
+}
+
+bool LoopbackConnection::is_valid() {
+    return valid;
+}
+
+void LoopbackConnection::flush() {
+
+}
+
+LoopbackConnection::~LoopbackConnection() {
+    if (is_valid()) {
+        std::cout << "networking_loopback: warning: destructing valid connection" << std::endl;
+        close();
+    }
+}
+
+LoopbackServer::LoopbackServer(size_t ring_size) : ring_size(ring_size) {
+
+}
+
+LoopbackConnection *LoopbackServer::connect() {
+    auto[client, server] = LoopbackConnection::make_pair(ring_size);
+    {
+        std::unique_lock locker(lock);
+        if (!valid) {
+            delete client;
+            delete server;
+            throw std::runtime_error("server is destroyed");
+        }
+        pending.push(server);
+    }
+    pending_cv.notify_one();
+    return client;
+}
+
+LoopbackConnection *LoopbackServer::accept() {
+    std::unique_lock locker(lock);
+    pending_cv.wait(locker, [this] { return !valid || !pending.empty(); });
+    if (!valid) throw std::runtime_error("server is destroyed");
+    LoopbackConnection *connection = pending.front();
+    pending.pop();
+    return connection;
+}
+
+void LoopbackServer::destroy() {
+    {
+        std::unique_lock locker(lock);
+        if (!valid) return;
+        valid = false;
+        while (!pending.empty()) {
+            pending.front()->close();
+            delete pending.front();
+            pending.pop();
+        }
+    }
+    pending_cv.notify_all();
+}
+
+bool LoopbackServer::is_valid() {
+    std::unique_lock locker(lock);
+    return valid;
+}
+
+LoopbackServer::~LoopbackServer() {
+    if (is_valid()) {
+        std::cout << "networking_loopback: warning: destructing valid server" << std::endl;
+        destroy();
+    }
+}
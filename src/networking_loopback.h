@@ -0,0 +1,115 @@
+#ifndef CLOUD9_NETWORKING_LOOPBACK_H
+#define CLOUD9_NETWORKING_LOOPBACK_H
+
+#include "networking.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+
+// per direction, small enough for thousands of simulated clients, pass a larger size for bulk transfers
+#define LOOPBACK_DEFAULT_RING_SIZE (64 * 1024)
+
+// single producer single consumer byte ring, the other side is woken through an eventfd only if it sleeps
+class LoopbackRing final {
+private:
+    const size_t capacity;
+    char *const data;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    std::atomic<bool> reader_waiting{true}; // a reader that hasn't looked yet may be waiting in epoll
+    std::atomic<bool> writer_waiting{false};
+    std::atomic<bool> closed{false};
+    const int readable;
+    const int writable;
+    int writer_event = -1; // also signalled when room is freed, the writer's own end watches it with epoll
+
+public:
+    // capacity is rounded up to a power of two
+    explicit LoopbackRing(size_t capacity);
+
+    LoopbackRing(const LoopbackRing &) = delete;
+
+    // returns 0 only if block is false and the ring is full, writer_event is then signalled once there is room
+    size_t write(size_t n, const void *buffer, bool block);
+
+    // returns 0 only if block is false and the ring is empty
+    size_t read(size_t n, void *buffer, bool block);
+
+    void close();
+
+    bool is_closed();
+
+    // becomes readable when data arrives after read returned 0
+    int get_readable_fd();
+
+    // must be set before the ring is used
+    void set_writer_event(int event);
+
+    ~LoopbackRing();
+};
+
+class LoopbackServer;
+
+class LoopbackConnection final : public NetConnection {
+private:
+    friend LoopbackServer;
+
+    const std::shared_ptr<LoopbackRing> in, out;
+    bool valid = true;
+
+    LoopbackConnection(std::shared_ptr<LoopbackRing> in, std::shared_ptr<LoopbackRing> out);
+
+public:
+    LoopbackConnection() = delete;
+
+    // creates two connected connections
+    static std::pair<LoopbackConnection *, LoopbackConnection *> make_pair(size_t ring_size = LOOPBACK_DEFAULT_RING_SIZE);
+
+    size_t send(size_t n, const void *buffer) override;
+
+    size_t read(size_t n, void *buffer) override;
+
+    size_t read_nonblock(size_t n, void *buffer) override;
+
+    // must not be mixed with a read blocked in another thread, which could miss the wakeup it drains
+    size_t send_nonblock(size_t n, const void *buffer) override;
+
+    // the readable fd of the incoming ring is signalled when the outgoing one has room again
+    short sendable_events() override;
+
+    int get_fd() override;
+
+    void close() override;
+
+    bool is_valid() override;
+
+    void flush() override;
+
+    ~LoopbackConnection() override;
+};
+
+// in-process server, connect() hands the client side of a new pair and accept() returns the server side
+class LoopbackServer final : public NetServer {
+private:
+    const size_t ring_size;
+    std::queue<LoopbackConnection *> pending;
+    std::mutex lock;
+    std::condition_variable pending_cv;
+    bool valid = true;
+public:
+    explicit LoopbackServer(size_t ring_size = LOOPBACK_DEFAULT_RING_SIZE);
+
+    LoopbackConnection *connect();
+
+    LoopbackConnection *accept() override;
+
+    void destroy() override;
+
+    bool is_valid() override;
+
+    ~LoopbackServer() override;
+};
+
+#endif //CLOUD9_NETWORKING_LOOPBACK_H
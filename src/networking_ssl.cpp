@@ -2,6 +2,8 @@
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
 #include <stdexcept>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -9,9 +11,15 @@
 #include <unistd.h>
 #include <iostream>
 #include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <atomic>
+#include <fstream>
 
 #define SSL_SOCKET_QUEUE_LENGTH 16
 
+static std::atomic_flag ktls_checked = ATOMIC_FLAG_INIT;
+
 inline std::runtime_error ssl_error(SSL *ssl, const char *pref, int status) {
     auto error = ERR_get_error();
     if (error) {
@@ -21,6 +29,21 @@ inline std::runtime_error ssl_error(SSL *ssl, const char *pref, int status) {
     } else return std::runtime_error(pref + std::string(": unknown error"));
 }
 
+// repeats an SSL call while it waits for the socket, with poll if block is true, so that the socket itself can stay
+// non-blocking and blocking calls can be mixed with non-blocking ones, error_code is set if the call didn't succeed
+template<typename C>
+static auto ssl_retry(SSL *ssl, int sock, bool block, int &error_code, C call) {
+    while (true) {
+        ERR_clear_error();
+        auto status = call();
+        if (status > 0) return status;
+        error_code = SSL_get_error(ssl, int(status));
+        if (!block || (error_code != SSL_ERROR_WANT_READ && error_code != SSL_ERROR_WANT_WRITE)) return status;
+        pollfd descriptor{sock, short(error_code == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT), 0};
+        if (poll(&descriptor, 1, -1) == -1 && errno != EINTR) return status;
+    }
+}
+
 void init_networking_ssl() {
     SSL_load_error_strings();
     SSL_library_init();
@@ -33,7 +56,8 @@ void shutdown_networking_ssl() {
     EVP_cleanup();
 }
 
-SSLConnection::SSLConnection(const char *host, int port) {
+SSLConnection::SSLConnection(const char *host, int port, const std::string &session_file)
+        : session_file(session_file) {
     addrinfo *server_info, hints;
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_INET;
@@ -56,8 +80,23 @@ SSLConnection::SSLConnection(const char *host, int port) {
     }
     freeaddrinfo(server_info);
     context = SSL_CTX_new(SSLv23_client_method());
+    if (!session_file.empty()) {
+        SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(context, save_session);
+    }
     ssl = SSL_new(context);
+    SSL_set_app_data(ssl, this);
     SSL_set_fd(ssl, sock);
+    if (!session_file.empty()) {
+        std::ifstream stream(session_file, std::ios::binary);
+        std::string der((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+        auto *p = reinterpret_cast<const unsigned char *>(der.data());
+        SSL_SESSION *session = der.empty() ? nullptr : d2i_SSL_SESSION(nullptr, &p, long(der.size()));
+        if (session) {
+            SSL_set_session(ssl, session);
+            SSL_SESSION_free(session);
+        }
+    }
     status = SSL_connect(ssl);
     if (status != 1) {
         ::close(sock);
@@ -65,9 +104,53 @@ SSLConnection::SSLConnection(const char *host, int port) {
     }
 }
 
+int SSLConnection::save_session(SSL *ssl, SSL_SESSION *session) {
+    auto *connection = static_cast<SSLConnection *>(SSL_get_app_data(ssl));
+    int length = i2d_SSL_SESSION(session, nullptr);
+    if (length <= 0) return 0;
+    std::string der(length, '\0');
+    auto *p = reinterpret_cast<unsigned char *>(der.data());
+    i2d_SSL_SESSION(session, &p);
+    // the session holds the master secret, so only the owner may read it
+    int file = open(connection->session_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (file == -1) return 0;
+    size_t written = 0;
+    while (written < der.size()) {
+        ssize_t status = write(file, der.data() + written, der.size() - written);
+        if (status <= 0) break;
+        written += status;
+    }
+    ::close(file);
+    return 0;
+}
+
+bool SSLConnection::handshake(bool block) {
+    if (handshaken) return true;
+    if (!is_valid()) throw std::runtime_error("not connected");
+    int error_code = SSL_ERROR_NONE;
+    int status = ssl_retry(ssl, sock, block, error_code, [this]() { return SSL_accept(ssl); });
+    if (status <= 0 && (error_code == SSL_ERROR_WANT_READ || error_code == SSL_ERROR_WANT_WRITE) && !block) {
+        return false;
+    }
+    if (status != 1) {
+        auto error = ssl_error(ssl, "failed to initiate SSL handshake with client", status);
+        close();
+        throw error;
+    }
+    handshaken = true;
+    handshake_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - accept_time).count();
+    if ((SSL_get_options(ssl) & SSL_OP_ENABLE_KTLS) && !ktls_checked.test_and_set() && !is_ktls()) {
+        std::cerr << "networking_ssl: warning: kernel TLS is not available, using user space TLS" << std::endl;
+    }
+    return true;
+}
+
 size_t SSLConnection::send(size_t n, const void *buffer) {
     if (!is_valid()) throw std::runtime_error("not connected");
-    int status = SSL_write(ssl, buffer, n);
+    handshake(true);
+    int error_code;
+    int status = ssl_retry(ssl, sock, true, error_code, [&]() { return SSL_write(ssl, buffer, int(n)); });
     if (status <= 0) {
         auto error = ssl_error(ssl, "socket connection send error", status);
         close();
@@ -75,21 +158,80 @@ size_t SSLConnection::send(size_t n, const void *buffer) {
     } else return status;
 }
 
+size_t SSLConnection::send_iov(const iovec *iov, size_t count) {
+    // small parts are coalesced so that they end up in a single record instead of one record each
+    char record[SSL3_RT_MAX_PLAIN_LENGTH];
+    size_t fullness = 0, sent = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (fullness + iov[i].iov_len <= sizeof record) {
+            memcpy(record + fullness, iov[i].iov_base, iov[i].iov_len);
+            fullness += iov[i].iov_len;
+            continue;
+        }
+        if (fullness > 0) {
+            sent += send(fullness, record);
+            fullness = 0;
+        }
+        if (iov[i].iov_len >= sizeof record) sent += send(iov[i].iov_len, iov[i].iov_base);
+        else {
+            memcpy(record, iov[i].iov_base, iov[i].iov_len);
+            fullness = iov[i].iov_len;
+        }
+    }
+    if (fullness > 0) sent += send(fullness, record);
+    return sent;
+}
+
 size_t SSLConnection::read(size_t n, void *buffer) {
     if (!is_valid()) throw std::runtime_error("not connected");
-    auto i = rand();
-    int status = SSL_read(ssl, buffer, n);
+    handshake(true);
+    int error_code;
+    int status = ssl_retry(ssl, sock, true, error_code, [&]() { return SSL_read(ssl, buffer, int(n)); });
+    if (status <= 0) {
+        auto error = ssl_error(ssl, "socket connection read error", status);
+        close();
+        throw error;
+    } else return status;
+}
+
+size_t SSLConnection::read_nonblock(size_t n, void *buffer) {
+    if (!is_valid()) throw std::runtime_error("not connected");
+    if (!handshake(false)) return 0;
+    int error_code;
+    int status = ssl_retry(ssl, sock, false, error_code, [&]() { return SSL_read(ssl, buffer, int(n)); });
     if (status <= 0) {
+        if (error_code == SSL_ERROR_WANT_READ || error_code == SSL_ERROR_WANT_WRITE) return 0;
         auto error = ssl_error(ssl, "socket connection read error", status);
         close();
         throw error;
     } else return status;
 }
 
+size_t SSLConnection::send_nonblock(size_t n, const void *buffer) {
+    if (!is_valid()) throw std::runtime_error("not connected");
+    if (!handshake(false)) return 0;
+    int error_code;
+    int status = ssl_retry(ssl, sock, false, error_code, [&]() { return SSL_write(ssl, buffer, int(n)); });
+    if (status <= 0) {
+        if (error_code == SSL_ERROR_WANT_READ || error_code == SSL_ERROR_WANT_WRITE) return 0;
+        auto error = ssl_error(ssl, "socket connection send error", status);
+        close();
+        throw error;
+    } else return status;
+}
+
+int SSLConnection::get_fd() {
+    return sock;
+}
+
+uint64_t SSLConnection::handshake_time() {
+    return handshake_us;
+}
+
 void SSLConnection::close() {
     if (!is_valid()) return;
     connected = false;
-    SSL_shutdown(ssl);
+    if (handshaken) SSL_shutdown(ssl);
     ::shutdown(sock, SHUT_RDWR);
 }
 
@@ -111,9 +253,47 @@ void SSLConnection::flush() {
 
 }
 
-SSLServer::SSLServer(int port, const char *cert, const char *key, pem_password_cb *password_cb, void *password_cb_ud)
-        : cert(cert), key(key) {
+size_t SSLConnection::send_file(int file, uint64_t offset, size_t n, char *buffer) {
+    if (!is_ktls()) return NetConnection::send_file(file, offset, n, buffer);
+    if (!is_valid()) throw std::runtime_error("not connected");
+    int error_code;
+    ossl_ssize_t sent = ssl_retry(ssl, sock, true, error_code,
+                                  [&]() { return SSL_sendfile(ssl, file, off_t(offset), n, 0); });
+    if (sent < 0) {
+        auto error = ssl_error(ssl, "socket connection sendfile error", int(sent));
+        close();
+        throw error;
+    }
+    if (sent == 0) throw std::runtime_error("unexpected end of file");
+    return sent;
+}
+
+bool SSLConnection::is_ktls() {
+#ifndef OPENSSL_NO_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return false;
+#endif
+}
+
+SSLServer::SSLServer(int port, const char *cert, const char *key, pem_password_cb *password_cb, void *password_cb_ud,
+                     bool ktls, size_t session_cache_size, uint64_t ticket_key_lifetime, size_t acceptors)
+        : cert(cert), key(key), ticket_key_lifetime(ticket_key_lifetime) {
     context = SSL_CTX_new(SSLv23_server_method());
+    SSL_CTX_set_app_data(context, this);
+    if (ktls) SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_mode(context, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_id_context(context, reinterpret_cast<const unsigned char *>(SSL_SESSION_ID_CONTEXT),
+                                   sizeof SSL_SESSION_ID_CONTEXT - 1);
+    if (session_cache_size) {
+        SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(context, session_cache_size);
+    } else SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+    if (ticket_key_lifetime) {
+        generate_ticket_key(ticket_keys[0]);
+        SSL_CTX_set_timeout(context, ticket_key_lifetime);
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(context, ticket_key_callback);
+    } else SSL_CTX_set_options(context, SSL_OP_NO_TICKET);
     SSL_CTX_set_default_passwd_cb(context, password_cb);
     SSL_CTX_set_default_passwd_cb_userdata(context, password_cb_ud);
     if (SSL_CTX_use_certificate_file(context, cert, SSL_FILETYPE_PEM) <= 0) {
@@ -122,45 +302,96 @@ SSLServer::SSLServer(int port, const char *cert, const char *key, pem_password_c
     if (SSL_CTX_use_PrivateKey_file(context, key, SSL_FILETYPE_PEM) <= 0) {
         throw std::invalid_argument("invalid private key");
     }
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        throw std::runtime_error(std::string("error opening server socket: ") + strerror(errno));
-    }
-    const int REUSE = 1;
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &REUSE, sizeof REUSE)) {
-        throw std::runtime_error(std::string("failed to set reuse socket option: ") + strerror(errno));
-    }
-    sockaddr_in server_address;
-    std::fill_n(reinterpret_cast<char *>(&server_address), sizeof server_address, '\0');
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(port);
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    if (bind(sock, reinterpret_cast<const sockaddr *>(&server_address), sizeof server_address)) {
-        throw std::runtime_error(std::string("error binding server socket: ") + strerror(errno));
-    }
-    if (listen(sock, SSL_SOCKET_QUEUE_LENGTH)) {
-        throw std::runtime_error(std::string("error listening for connections: ") + strerror(errno));
+    try {
+        for (size_t i = 0; i < std::max(acceptors, size_t(1)); i++) {
+            socks.push_back(open_server_socket(port, SSL_SOCKET_QUEUE_LENGTH, acceptors > 1));
+        }
+    } catch (std::runtime_error &) {
+        for (int sock : socks) ::close(sock);
+        SSL_CTX_free(context);
+        throw;
     }
 }
 
 SSLConnection *SSLServer::accept() {
+    return accept_shard(0);
+}
+
+size_t SSLServer::shards() {
+    return socks.size();
+}
+
+SSLConnection *SSLServer::accept_shard(size_t shard) {
     if (!valid) throw std::runtime_error("socket server is closed");
-    int client = ::accept(sock, nullptr, nullptr);
+    int client = ::accept(socks[shard], nullptr, nullptr);
     if (client < 0) throw std::runtime_error("accept failed: " + std::string(strerror(errno)));
-    SSL *ssl = SSL_new(context);
-    SSL_set_fd(ssl, client);
-    auto status = SSL_accept(ssl);
-    if (status != 1) {
+    // non-blocking for the whole life of the connection, blocking calls wait for the socket with poll instead
+    if (fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK) == -1) {
+        std::string error = strerror(errno);
         ::close(client);
-        throw ssl_error(ssl, "failed to initiate SSL handshake with client", 1);
+        throw std::runtime_error("failed to make socket non-blocking: " + error);
     }
+    SSL *ssl = SSL_new(context);
+    SSL_set_fd(ssl, client);
     return new SSLConnection(ssl, client);
 }
 
+void SSLServer::generate_ticket_key(TicketKey &ticket_key) {
+    if (RAND_bytes(ticket_key.name, sizeof ticket_key.name) <= 0 ||
+        RAND_bytes(ticket_key.aes, sizeof ticket_key.aes) <= 0 ||
+        RAND_bytes(ticket_key.hmac, sizeof ticket_key.hmac) <= 0) {
+        throw std::runtime_error("failed to generate session ticket key");
+    }
+    ticket_key.created = std::chrono::steady_clock::now();
+}
+
+void SSLServer::rotate_ticket_keys() {
+    if (std::chrono::steady_clock::now() - ticket_keys[0].created < std::chrono::seconds(ticket_key_lifetime)) return;
+    ticket_keys[1] = ticket_keys[0];
+    has_previous_ticket_key = true;
+    generate_ticket_key(ticket_keys[0]);
+}
+
+int SSLServer::ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *cipher,
+                                   EVP_MAC_CTX *mac, int encrypt) {
+    auto *server = static_cast<SSLServer *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    std::lock_guard<std::mutex> locker(server->ticket_keys_lock);
+    const TicketKey *ticket_key = nullptr;
+    int result = 1;
+    try {
+        server->rotate_ticket_keys();
+    } catch (std::runtime_error &) {
+        return -1;
+    }
+    if (encrypt) {
+        ticket_key = &server->ticket_keys[0];
+        if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) <= 0) return -1;
+        memcpy(key_name, ticket_key->name, sizeof ticket_key->name);
+        if (!EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, ticket_key->aes, iv)) return -1;
+    } else {
+        if (memcmp(key_name, server->ticket_keys[0].name, SSL_TICKET_KEY_NAME_LENGTH) == 0) {
+            ticket_key = &server->ticket_keys[0];
+        } else if (server->has_previous_ticket_key &&
+                   memcmp(key_name, server->ticket_keys[1].name, SSL_TICKET_KEY_NAME_LENGTH) == 0) {
+            ticket_key = &server->ticket_keys[1];
+            result = 2; // still valid, but a ticket with the current key should be issued
+        } else return 0;
+        if (!EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, ticket_key->aes, iv)) return -1;
+    }
+    OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char *>(ticket_key->hmac),
+                                              sizeof ticket_key->hmac),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0),
+            OSSL_PARAM_construct_end()
+    };
+    if (!EVP_MAC_CTX_set_params(mac, params)) return -1;
+    return result;
+}
+
 void SSLServer::destroy() {
     if (!is_valid()) return;
     valid = false;
-    ::shutdown(sock, SHUT_RDWR);
+    for (int sock : socks) ::shutdown(sock, SHUT_RDWR);
 }
 
 bool SSLServer::is_valid() {
@@ -173,5 +404,5 @@ SSLServer::~SSLServer() {
         destroy();
     }
     SSL_CTX_free(context);
-    ::close(sock);
+    for (int sock : socks) ::close(sock);
 }
@@ -1,7 +1,13 @@
 #ifndef CLOUD9_NETWORKING_SSL_H
 #define CLOUD9_NETWORKING_SSL_H
 
-#include "networking.h"
+#include "networking_tcp.h"
+#include <chrono>
+#include <mutex>
+
+#define SSL_SESSION_ID_CONTEXT "cloud9"
+#define SSL_TICKET_KEY_NAME_LENGTH 16
+#define SSL_TICKET_KEY_LENGTH 32
 
 void init_networking_ssl();
 
@@ -15,39 +21,96 @@ private:
     int sock;
     SSL_CTX *context;
     bool connected = true;
+    bool handshaken = true;
+    std::chrono::steady_clock::time_point accept_time;
+    uint64_t handshake_us = 0;
+    std::string session_file;
+
+    // accepted connection, the handshake is done lazily by the first read or send
+    SSLConnection(SSL *ssl, int sock) : ssl(ssl), sock(sock), context(nullptr), handshaken(false),
+                                        accept_time(std::chrono::steady_clock::now()) {}
+
+    // returns false if block is false and the handshake needs more data from the peer
+    bool handshake(bool block);
 
-    SSLConnection(SSL *ssl, int sock) : ssl(ssl), sock(sock), context(nullptr) {}
+    static int save_session(SSL *ssl, SSL_SESSION *session);
 
     friend SSLServer;
 public:
-    SSLConnection(const char *host, int port);
+    // if session_file is not empty, the TLS session is resumed from it and new sessions are stored there
+    SSLConnection(const char *host, int port, const std::string &session_file = "");
 
     size_t send(size_t n, const void *buffer) override;
 
+    size_t send_iov(const iovec *iov, size_t count) override;
+
     size_t read(size_t n, void *buffer) override;
 
+    size_t read_nonblock(size_t n, void *buffer) override;
+
+    // after it returned 0, the next call has to be made with the same data
+    size_t send_nonblock(size_t n, const void *buffer) override;
+
+    int get_fd() override;
+
+    uint64_t handshake_time() override;
+
     void close() override;
 
     bool is_valid() override;
 
     void flush() override;
 
+    // uses SSL_sendfile when kernel TLS is active for sending
+    size_t send_file(int file, uint64_t offset, size_t n, char *buffer) override;
+
+    bool is_ktls();
+
     ~SSLConnection() override;
 };
 
 class SSLServer final : public NetServer {
 private:
-    int sock;
+    struct TicketKey {
+        unsigned char name[SSL_TICKET_KEY_NAME_LENGTH];
+        unsigned char aes[SSL_TICKET_KEY_LENGTH];
+        unsigned char hmac[SSL_TICKET_KEY_LENGTH];
+        std::chrono::steady_clock::time_point created;
+    };
+
+    std::vector<int> socks;
     SSL_CTX *context;
     const char *const cert, *const key;
     bool valid = true;
+    const uint64_t ticket_key_lifetime;
+    // current and previous keys, tickets encrypted with the previous one are accepted and renewed
+    TicketKey ticket_keys[2];
+    bool has_previous_ticket_key = false;
+    std::mutex ticket_keys_lock;
+
+    static void generate_ticket_key(TicketKey &ticket_key);
+
+    void rotate_ticket_keys();
+
+    static int ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *cipher,
+                                   EVP_MAC_CTX *mac, int encrypt);
+
 public:
     SSLServer() = delete;
 
-    SSLServer(int port, const char *cert, const char *key, pem_password_cb *password_cb, void *password_cb_ud);
+    // ktls enables kernel TLS offload, connections use user space TLS if the kernel doesn't support it
+    // sessions are cached up to session_cache_size (0 disables the cache) and resumable with stateless tickets,
+    // whose keys are rotated every ticket_key_lifetime seconds (0 disables tickets)
+    SSLServer(int port, const char *cert, const char *key, pem_password_cb *password_cb, void *password_cb_ud,
+              bool ktls = false, size_t session_cache_size = SSL_SESSION_CACHE_MAX_SIZE_DEFAULT,
+              uint64_t ticket_key_lifetime = 0, size_t acceptors = 1);
 
     SSLConnection *accept() override;
 
+    size_t shards() override;
+
+    SSLConnection *accept_shard(size_t shard) override;
+
     void destroy() override;
 
     bool is_valid() override;
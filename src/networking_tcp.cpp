@@ -1,8 +1,11 @@
 #include <stdexcept>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <cstring>
+#include <climits>
+#include <algorithm>
 #include <iostream>
 #include "networking_tcp.h"
 
@@ -40,6 +43,20 @@ size_t TCPConnection::send(size_t n, const void *buffer) {
     return sent;
 }
 
+size_t TCPConnection::send_iov(const iovec *iov, size_t count) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    msghdr message;
+    memset(&message, 0, sizeof message);
+    message.msg_iov = const_cast<iovec *>(iov);
+    message.msg_iovlen = std::min(count, size_t(IOV_MAX));
+    ssize_t sent = ::sendmsg(sock, &message, 0);
+    if (sent == -1) {
+        close();
+        throw std::runtime_error(strerror(errno));
+    }
+    return sent;
+}
+
 size_t TCPConnection::read(size_t n, void *buffer) {
     if (!is_valid()) throw std::runtime_error("connection is closed");
     ssize_t read = ::recv(sock, buffer, n, 0);
@@ -54,6 +71,36 @@ size_t TCPConnection::read(size_t n, void *buffer) {
     return read;
 }
 
+size_t TCPConnection::read_nonblock(size_t n, void *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    ssize_t read = ::recv(sock, buffer, n, MSG_DONTWAIT);
+    if (read == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        close();
+        throw std::runtime_error(strerror(errno));
+    }
+    if (read == 0) {
+        close();
+        throw std::runtime_error("connection reset by peer");
+    }
+    return read;
+}
+
+size_t TCPConnection::send_nonblock(size_t n, const void *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    ssize_t sent = ::send(sock, buffer, n, MSG_DONTWAIT);
+    if (sent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        close();
+        throw std::runtime_error(strerror(errno));
+    }
+    return sent;
+}
+
+int TCPConnection::get_fd() {
+    return sock;
+}
+
 void TCPConnection::close() {
     if (sock == -1) return;
     shutdown(sock, SHUT_RDWR);
@@ -76,44 +123,84 @@ void TCPConnection::flush() {
 
 }
 
-TCPServer::TCPServer(int port) {
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+size_t TCPConnection::send_file(int file, uint64_t offset, size_t n, char *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    off_t position = offset;
+    ssize_t sent = sendfile(sock, file, &position, n);
+    if (sent == -1) {
+        if (errno == EINVAL || errno == ENOSYS) return NetConnection::send_file(file, offset, n, buffer);
+        if (errno == EIO) throw std::runtime_error(std::string("file read error: ") + strerror(errno));
+        close();
+        throw std::runtime_error(strerror(errno));
+    }
+    if (sent == 0) throw std::runtime_error("unexpected end of file");
+    return sent;
+}
+
+int open_server_socket(int port, int queue_length, bool reuse_port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         throw std::runtime_error(std::string("error opening server socket: ") + strerror(errno));
     }
     const int REUSE = 1;
     if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &REUSE, sizeof REUSE)) {
+        ::close(sock);
         throw std::runtime_error(std::string("failed to set reuse socket option: ") + strerror(errno));
     }
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &REUSE, sizeof REUSE)) {
+        ::close(sock);
+        throw std::runtime_error(std::string("failed to set reuse port socket option: ") + strerror(errno));
+    }
     sockaddr_in server_address;
     std::fill_n(reinterpret_cast<char *>(&server_address), sizeof server_address, '\0');
     server_address.sin_family = AF_INET;
     server_address.sin_port = htons(port);
     server_address.sin_addr.s_addr = INADDR_ANY;
     if (bind(sock, reinterpret_cast<const sockaddr *>(&server_address), sizeof server_address)) {
+        ::close(sock);
         throw std::runtime_error(std::string("error binding server socket: ") + strerror(errno));
     }
-    if (listen(sock, TCP_SOCKET_QUEUE_LENGTH)) {
+    if (listen(sock, queue_length)) {
+        ::close(sock);
         throw std::runtime_error(std::string("error listening for connections: ") + strerror(errno));
     }
+    return sock;
+}
+
+TCPServer::TCPServer(int port, size_t acceptors) {
+    try {
+        for (size_t i = 0; i < std::max(acceptors, size_t(1)); i++) {
+            socks.push_back(open_server_socket(port, TCP_SOCKET_QUEUE_LENGTH, acceptors > 1));
+        }
+    } catch (std::runtime_error &) {
+        for (int sock : socks) ::close(sock);
+        throw;
+    }
 }
 
 TCPConnection *TCPServer::accept() {
+    return accept_shard(0);
+}
+
+size_t TCPServer::shards() {
+    return socks.size();
+}
+
+TCPConnection *TCPServer::accept_shard(size_t shard) {
     if (!is_valid()) throw std::runtime_error("server is destroyed");
-    int client = ::accept(sock, nullptr, nullptr);
+    int client = ::accept(socks[shard], nullptr, nullptr);
     if (client == -1) throw std::runtime_error(strerror(errno));
     return new TCPConnection(client);
 }
 
 void TCPServer::destroy() {
-    if (sock == -1) return;
-    shutdown(sock, SHUT_RDWR);
-    ::close(sock);
-    sock = -1;
+    if (!valid) return;
+    valid = false;
+    for (int sock : socks) shutdown(sock, SHUT_RDWR);
 }
 
 bool TCPServer::is_valid() {
-    return sock != -1;
+    return valid;
 }
 
 TCPServer::~TCPServer() {
@@ -121,4 +208,5 @@ TCPServer::~TCPServer() {
         std::cout << "networking_tcp: warning: destructing valid server" << std::endl;
         destroy();
     }
+    for (int sock : socks) ::close(sock);
 }
@@ -2,15 +2,21 @@
 #define CLOUD9_NETWORKING_TCP_H
 
 #include "networking.h"
+#include <vector>
 
 #define TCP_SOCKET_QUEUE_LENGTH 8
 
+// creates a socket listening on port of all interfaces, reuse_port lets several sockets share the port
+int open_server_socket(int port, int queue_length, bool reuse_port);
+
 class TCPServer;
 
-class TCPConnection final : public NetConnection {
+// also serves other stream sockets, see UnixConnection
+class TCPConnection : public NetConnection {
 private:
     friend TCPServer;
 
+protected:
     int sock;
 
     explicit TCPConnection(int sock) : sock(sock) {}
@@ -22,28 +28,45 @@ public:
 
     size_t send(size_t n, const void *buffer) override;
 
+    size_t send_iov(const iovec *iov, size_t count) override;
+
     size_t read(size_t n, void *buffer) override;
 
+    size_t read_nonblock(size_t n, void *buffer) override;
+
+    size_t send_nonblock(size_t n, const void *buffer) override;
+
+    int get_fd() override;
+
     void close() override;
 
     bool is_valid() override;
 
     void flush() override;
 
+    // uses sendfile(2), buffer is only needed if the file does not support it
+    size_t send_file(int file, uint64_t offset, size_t n, char *buffer) override;
+
     ~TCPConnection() override;
 };
 
 
 class TCPServer final : public NetServer {
 private:
-    int sock;
+    std::vector<int> socks;
+    bool valid = true;
 public:
     TCPServer() = delete;
 
-    explicit TCPServer(int port);
+    // acceptors > 1 binds that many SO_REUSEPORT sockets, the kernel spreads incoming connections over them
+    explicit TCPServer(int port, size_t acceptors = 1);
 
     TCPConnection *accept() override;
 
+    size_t shards() override;
+
+    TCPConnection *accept_shard(size_t shard) override;
+
     void destroy() override;
 
     bool is_valid() override;
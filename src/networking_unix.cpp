@@ -0,0 +1,92 @@
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstring>
+#include <iostream>
+#include "networking_unix.h"
+
+static sockaddr_un unix_address(const char *path) {
+    sockaddr_un address;
+    std::fill_n(reinterpret_cast<char *>(&address), sizeof address, '\0');
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof address.sun_path) throw std::invalid_argument("unix socket path is too long");
+    strcpy(address.sun_path, path);
+    return address;
+}
+
+UnixConnection::UnixConnection(const char *path) : TCPConnection(-1), trusted(false) {
+    sockaddr_un address = unix_address(path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) throw std::runtime_error("error opening client socket: " + std::string(strerror(errno)));
+    if (connect(sock, reinterpret_cast<const sockaddr *>(&address), sizeof address)) {
+        ::close(sock);
+        sock = -1;
+        throw std::runtime_error("error connecting to server: " + std::string(strerror(errno)));
+    }
+}
+
+bool UnixConnection::is_trusted() {
+    return trusted;
+}
+
+UnixServer::UnixServer(const char *path, bool trust_owner) : path(path), trust_owner(trust_owner) {
+    sockaddr_un address = unix_address(path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        throw std::runtime_error(std::string("error opening server socket: ") + strerror(errno));
+    }
+    struct stat existing{};
+    if (lstat(path, &existing) == 0) {
+        // a stale socket of a previous run, anything else is most likely a typo in the config
+        if (!S_ISSOCK(existing.st_mode)) {
+            ::close(sock);
+            throw std::runtime_error(std::string("error binding server socket: ") + path +
+                                     ": path exists and is not a socket");
+        }
+        unlink(path);
+    }
+    if (bind(sock, reinterpret_cast<const sockaddr *>(&address), sizeof address)) {
+        ::close(sock);
+        throw std::runtime_error(std::string("error binding server socket: ") + strerror(errno));
+    }
+    if (listen(sock, UNIX_SOCKET_QUEUE_LENGTH)) {
+        ::close(sock);
+        throw std::runtime_error(std::string("error listening for connections: ") + strerror(errno));
+    }
+}
+
+UnixConnection *UnixServer::accept() {
+    if (!is_valid()) throw std::runtime_error("server is destroyed");
+    int client = ::accept(sock, nullptr, nullptr);
+    if (client == -1) throw std::runtime_error(strerror(errno));
+    bool trusted = false;
+    if (trust_owner) {
+        ucred credentials{};
+        socklen_t length = sizeof credentials;
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0) {
+            trusted = credentials.uid == geteuid();
+        }
+    }
+    return new UnixConnection(client, trusted);
+}
+
+void UnixServer::destroy() {
+    if (sock == -1) return;
+    shutdown(sock, SHUT_RDWR);
+    ::close(sock);
+    sock = -1;
+    unlink(path.c_str());
+}
+
+bool UnixServer::is_valid() {
+    return sock != -1;
+}
+
+UnixServer::~UnixServer() {
+    if (is_valid()) {
+        std::cout << "networking_unix: warning: destructing valid server" << std::endl;
+        destroy();
+    }
+}
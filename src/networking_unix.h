@@ -0,0 +1,46 @@
+#ifndef CLOUD9_NETWORKING_UNIX_H
+#define CLOUD9_NETWORKING_UNIX_H
+
+#include "networking_tcp.h"
+
+#define UNIX_SOCKET_QUEUE_LENGTH 16
+
+class UnixServer;
+
+class UnixConnection final : public TCPConnection {
+private:
+    friend UnixServer;
+
+    bool trusted;
+
+    UnixConnection(int sock, bool trusted) : TCPConnection(sock), trusted(trusted) {}
+
+public:
+    UnixConnection() = delete;
+
+    explicit UnixConnection(const char *path);
+
+    bool is_trusted() override;
+};
+
+class UnixServer final : public NetServer {
+private:
+    int sock;
+    const std::string path;
+    const bool trust_owner;
+public:
+    UnixServer() = delete;
+
+    // trust_owner marks connections of processes running as the same user as the server as trusted
+    UnixServer(const char *path, bool trust_owner);
+
+    UnixConnection *accept() override;
+
+    void destroy() override;
+
+    bool is_valid() override;
+
+    ~UnixServer() override;
+};
+
+#endif //CLOUD9_NETWORKING_UNIX_H
@@ -0,0 +1,376 @@
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <iostream>
+#include "networking_uring.h"
+#include "networking_tcp.h"
+
+static int io_uring_setup(unsigned entries, io_uring_params *params) {
+    return int(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return int(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+URing::URing(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof params);
+    fd = io_uring_setup(entries, &params);
+    if (fd < 0) throw std::runtime_error("failed to setup io_uring: " + std::string(strerror(errno)));
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = reinterpret_cast<io_uring_sqe *>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        std::string error = strerror(errno);
+        if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+        if (cq_ring != MAP_FAILED) munmap(cq_ring, cq_ring_size);
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        ::close(fd);
+        throw std::runtime_error("failed to map io_uring: " + error);
+    }
+    auto *sq = reinterpret_cast<char *>(sq_ring);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    auto *cq = reinterpret_cast<char *>(cq_ring);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+}
+
+io_uring_sqe *URing::prepare() {
+    unsigned index = (*sq_tail + prepared) & *sq_mask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->user_data = prepared;
+    sq_array[index] = index;
+    prepared++;
+    return sqe;
+}
+
+void URing::submit_and_wait(int *results) {
+    unsigned count = prepared;
+    prepared = 0;
+    __atomic_store_n(sq_tail, *sq_tail + count, __ATOMIC_RELEASE);
+    unsigned to_submit = count, completed = 0;
+    while (completed < count) {
+        int status = io_uring_enter(fd, to_submit, count - completed, IORING_ENTER_GETEVENTS);
+        if (status < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("io_uring error: " + std::string(strerror(errno)));
+        }
+        to_submit -= std::min(to_submit, unsigned(status));
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            results[cqe->user_data] = cqe->res;
+            completed++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+bool URing::supports(uint8_t opcode) {
+    size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    auto *probe = reinterpret_cast<io_uring_probe *>(new char[probe_size]);
+    memset(probe, 0, probe_size);
+    bool ok = io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+              opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    delete[] reinterpret_cast<char *>(probe);
+    return ok;
+}
+
+URing::~URing() {
+    munmap(sqes, sqes_size);
+    munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    ::close(fd);
+}
+
+URingConnection::URingConnection(int sock) : sock(sock), send_ring(URING_QUEUE_DEPTH),
+                                             read_ring(URING_QUEUE_DEPTH) {}
+
+URingConnection::URingConnection(const char *host, uint16_t port) : send_ring(URING_QUEUE_DEPTH),
+                                                                    read_ring(URING_QUEUE_DEPTH) {
+    addrinfo *server_info, hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(host, std::to_string(port).c_str(), &hints, &server_info);
+    if (status < 0) {
+        throw std::runtime_error("failed to resolve host: " + std::string(gai_strerror(status)));
+    }
+    if (!server_info) {
+        throw std::runtime_error("failed to resolve host");
+    }
+    sock = socket(server_info->ai_family, server_info->ai_socktype, server_info->ai_protocol);
+    if (sock < 0) {
+        freeaddrinfo(server_info);
+        throw std::runtime_error("error opening client socket: " + std::string(strerror(errno)));
+    }
+    if (connect(sock, server_info->ai_addr, server_info->ai_addrlen)) {
+        freeaddrinfo(server_info);
+        throw std::runtime_error("error connecting to server: " + std::string(strerror(errno)));
+    }
+    freeaddrinfo(server_info);
+}
+
+size_t URingConnection::send(size_t n, const void *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    io_uring_sqe *sqe = send_ring.prepare();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sock;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = n;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    int sent;
+    send_ring.submit_and_wait(&sent);
+    if (sent < 0) {
+        close();
+        throw std::runtime_error(strerror(-sent));
+    }
+    return sent;
+}
+
+size_t URingConnection::send_iov(const iovec *iov, size_t count) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    msghdr message;
+    memset(&message, 0, sizeof message);
+    message.msg_iov = const_cast<iovec *>(iov);
+    message.msg_iovlen = std::min(count, size_t(IOV_MAX));
+    io_uring_sqe *sqe = send_ring.prepare();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = reinterpret_cast<uint64_t>(&message);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    int sent;
+    send_ring.submit_and_wait(&sent);
+    if (sent < 0) {
+        close();
+        throw std::runtime_error(strerror(-sent));
+    }
+    return sent;
+}
+
+size_t URingConnection::read(size_t n, void *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    io_uring_sqe *sqe = read_ring.prepare();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = n;
+    int read;
+    read_ring.submit_and_wait(&read);
+    if (read < 0) {
+        close();
+        throw std::runtime_error(strerror(-read));
+    }
+    if (read == 0) {
+        close();
+        throw std::runtime_error("connection reset by peer");
+    }
+    return read;
+}
+
+size_t URingConnection::read_nonblock(size_t n, void *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    ssize_t read = ::recv(sock, buffer, n, MSG_DONTWAIT);
+    if (read == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        close();
+        throw std::runtime_error(strerror(errno));
+    }
+    if (read == 0) {
+        close();
+        throw std::runtime_error("connection reset by peer");
+    }
+    return read;
+}
+
+size_t URingConnection::send_nonblock(size_t n, const void *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    ssize_t sent = ::send(sock, buffer, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        close();
+        throw std::runtime_error(strerror(errno));
+    }
+    return sent;
+}
+
+int URingConnection::get_fd() {
+    return sock;
+}
+
+size_t URingConnection::send_file(int file, uint64_t offset, size_t n, char *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    // the disk read and the socket send are linked, so both go to the kernel with a single syscall
+    io_uring_sqe *sqe = send_ring.prepare();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = n;
+    sqe->off = offset;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = send_ring.prepare();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sock;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = n;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    int results[2];
+    send_ring.submit_and_wait(results);
+    // kernels before the short read fix run the linked send anyway, the stale bytes past what was read
+    // are already on the wire and the stream can't be recovered
+    if (results[1] > std::max(results[0], 0)) {
+        close();
+        throw std::runtime_error("file changed during transfer");
+    }
+    if (results[0] < 0) throw std::runtime_error("file read error: " + std::string(strerror(-results[0])));
+    if (results[0] == 0) throw std::runtime_error("unexpected end of file");
+    if (results[1] < 0 && results[1] != -ECANCELED) {
+        close();
+        throw std::runtime_error(strerror(-results[1]));
+    }
+    // a short read cancels the linked send, the rest is sent the usual way
+    size_t sent = std::max(results[1], 0);
+    while (sent < size_t(results[0])) sent += send(results[0] - sent, buffer + sent);
+    return results[0];
+}
+
+size_t URingConnection::read_file(int file, uint64_t offset, size_t n, char *buffer) {
+    if (!is_valid()) throw std::runtime_error("connection is closed");
+    io_uring_sqe *sqe = read_ring.prepare();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = n;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = read_ring.prepare();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = file;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = n;
+    sqe->off = offset;
+    int results[2];
+    read_ring.submit_and_wait(results);
+    if (results[0] < 0) {
+        close();
+        throw std::runtime_error(strerror(-results[0]));
+    }
+    if (results[0] == 0) {
+        close();
+        throw std::runtime_error("connection reset by peer");
+    }
+    if (results[1] < 0 && results[1] != -ECANCELED) {
+        throw std::runtime_error("file write error: " + std::string(strerror(-results[1])));
+    }
+    // a short receive cancels the linked write, the rest is written the usual way
+    size_t received = results[0];
+    size_t written = std::max(results[1], 0);
+    if (written > received) {
+        // kernels before the short receive fix run the linked write anyway, so stale buffer bytes follow
+        // what was received; receive the rest of that range and write it again over them
+        while (received < written) received += read(written - received, buffer + received);
+        written = results[0];
+    }
+    while (written < received) {
+        ssize_t status = pwrite(file, buffer + written, received - written, offset + written);
+        if (status == -1) throw std::runtime_error("file write error: " + std::string(strerror(errno)));
+        written += status;
+    }
+    return received;
+}
+
+void URingConnection::close() {
+    if (sock == -1) return;
+    shutdown(sock, SHUT_RDWR);
+    ::close(sock);
+    sock = -1;
+}
+
+bool URingConnection::is_valid() {
+    return sock != -1;
+}
+
+void URingConnection::flush() {
+
+}
+
+URingConnection::~URingConnection() {
+    if (is_valid()) {
+        std::cout << "networking_uring: warning: destructing valid connection" << std::endl;
+        close();
+    }
+}
+
+URingServer::URingServer(int port) : accept_ring(URING_QUEUE_DEPTH) {
+    sock = open_server_socket(port, URING_SOCKET_QUEUE_LENGTH, false);
+}
+
+URingConnection *URingServer::accept() {
+    if (!is_valid()) throw std::runtime_error("server is destroyed");
+    io_uring_sqe *sqe = accept_ring.prepare();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sock;
+    int client;
+    accept_ring.submit_and_wait(&client);
+    if (client < 0) throw std::runtime_error(strerror(-client));
+    try {
+        return new URingConnection(client);
+    } catch (...) {
+        ::close(client);
+        throw;
+    }
+}
+
+void URingServer::destroy() {
+    if (sock == -1) return;
+    shutdown(sock, SHUT_RDWR);
+    ::close(sock);
+    sock = -1;
+}
+
+bool URingServer::is_valid() {
+    return sock != -1;
+}
+
+bool URingServer::is_supported() {
+    try {
+        URing ring(1);
+        for (uint8_t op : {IORING_OP_ACCEPT, IORING_OP_SEND, IORING_OP_RECV, IORING_OP_READ, IORING_OP_WRITE}) {
+            if (!ring.supports(op)) return false;
+        }
+        return true;
+    } catch (std::runtime_error &error) {
+        return false;
+    }
+}
+
+URingServer::~URingServer() {
+    if (is_valid()) {
+        std::cout << "networking_uring: warning: destructing valid server" << std::endl;
+        destroy();
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef CLOUD9_NETWORKING_URING_H
+#define CLOUD9_NETWORKING_URING_H
+
+#include "networking.h"
+
+#define URING_SOCKET_QUEUE_LENGTH 16
+#define URING_QUEUE_DEPTH 8
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// minimal io_uring instance, not thread safe
+class URing final {
+private:
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    unsigned prepared = 0;
+
+public:
+    explicit URing(unsigned entries);
+
+    URing(const URing &) = delete;
+
+    io_uring_sqe *prepare();
+
+    // submits all prepared entries and waits for the same number of completions, results are stored in order
+    void submit_and_wait(int *results);
+
+    bool supports(uint8_t opcode);
+
+    ~URing();
+};
+
+class URingServer;
+
+class URingConnection final : public NetConnection {
+private:
+    friend URingServer;
+
+    int sock;
+    URing send_ring;
+    URing read_ring;
+
+    explicit URingConnection(int sock);
+
+public:
+    URingConnection() = delete;
+
+    URingConnection(const char *host, uint16_t port);
+
+    size_t send(size_t n, const void *buffer) override;
+
+    size_t send_iov(const iovec *iov, size_t count) override;
+
+    size_t read(size_t n, void *buffer) override;
+
+    size_t read_nonblock(size_t n, void *buffer) override;
+
+    size_t send_nonblock(size_t n, const void *buffer) override;
+
+    int get_fd() override;
+
+    void close() override;
+
+    bool is_valid() override;
+
+    void flush() override;
+
+    size_t send_file(int file, uint64_t offset, size_t n, char *buffer) override;
+
+    size_t read_file(int file, uint64_t offset, size_t n, char *buffer) override;
+
+    ~URingConnection() override;
+};
+
+class URingServer final : public NetServer {
+private:
+    int sock;
+    URing accept_ring;
+public:
+    URingServer() = delete;
+
+    explicit URingServer(int port);
+
+    URingConnection *accept() override;
+
+    void destroy() override;
+
+    bool is_valid() override;
+
+    static bool is_supported();
+
+    ~URingServer() override;
+};
+
+#endif //CLOUD9_NETWORKING_URING_H
@@ -10,10 +10,18 @@ extern "C" {
 
 struct LauncherConfig : public CloudConfig {
     uint16_t server_port;
+    size_t acceptors;
+    bool io_uring;
     bool ssl;
     std::string ssl_cert_path;
     std::string ssl_key_path;
     std::string ssl_password;
+    bool ssl_ktls;
+    size_t ssl_session_cache_size;
+    uint64_t ssl_ticket_key_lifetime;
+    bool unix_socket;
+    std::string unix_path;
+    bool unix_trust_owner;
 };
 
 struct ConfigLoaderData {
@@ -80,6 +88,21 @@ LUA_INTEGER global_get_config_integer(lua_State *state, const std::string &path,
     return res;
 }
 
+bool global_get_config_boolean(lua_State *state, const std::string &path, const bool *def = nullptr) {
+    global_get_config_option(state, path);
+    if (!lua_isboolean(state, lua_gettop(state))) {
+        if (def && lua_isnil(state, lua_gettop(state))) {
+            lua_pop(state, 1);
+            return *def;
+        }
+        lua_close(state);
+        throw std::invalid_argument("invalid config: " + path + " must be a boolean");
+    }
+    bool res = lua_toboolean(state, lua_gettop(state));
+    lua_pop(state, 1);
+    return res;
+}
+
 
 static const size_t CONFIG_LOADER_BUFFER_SIZE = 4096;
 static const char *CONFIG_FILE = "config.lua";
@@ -94,15 +117,37 @@ static const char *CONFIG_OPTION_NET_BUFFER_SIZE = "cloud.net_buffer_size";
 static const LUA_INTEGER CONFIG_DEFAULT_NET_BUFFER_SIZE = DEFAULT_NET_BUFFER_SIZE;
 static const char *CONFIG_OPTION_DATA_BUFFER_SIZE = "cloud.data_buffer_size";
 static const LUA_INTEGER CONFIG_DEFAULT_DATA_BUFFER_SIZE = DEFAULT_DATA_BUFFER_SIZE;
+static const char *CONFIG_OPTION_IO_MODEL = "cloud.io_model";
+static const std::string CONFIG_DEFAULT_IO_MODEL = CLOUD_IO_MODEL_THREADS;
+static const char *CONFIG_OPTION_EVENT_LOOPS = "cloud.event_loops";
+static const LUA_INTEGER CONFIG_DEFAULT_EVENT_LOOPS = 0;
+static const char *CONFIG_OPTION_REQUEST_WORKERS = "cloud.request_workers";
+static const LUA_INTEGER CONFIG_DEFAULT_REQUEST_WORKERS = 0;
+static const char *CONFIG_OPTION_NODE_CACHE_SIZE = "cloud.node_cache_size";
+static const LUA_INTEGER CONFIG_DEFAULT_NODE_CACHE_SIZE = 65536;
 
 static const char *CONFIG_OPTION_LAUNCHER = "launcher";
 static const char *CONFIG_OPTION_SERVER_PORT = "launcher.server_port";
 static const LUA_INTEGER CONFIG_DEFAULT_SERVER_PORT = CLOUD_DEFAULT_PORT;
+static const char *CONFIG_OPTION_ACCEPTORS = "launcher.acceptors";
+static const LUA_INTEGER CONFIG_DEFAULT_ACCEPTORS = 1;
+static const char *CONFIG_OPTION_IO_URING = "launcher.io_uring";
+static const bool CONFIG_DEFAULT_IO_URING = false;
 static const char *CONFIG_OPTION_SSL = "launcher.ssl";
 static const char *CONFIG_OPTION_SSL_CERT = "launcher.ssl.cert";
 static const char *CONFIG_OPTION_SSL_KEY = "launcher.ssl.key";
 static const char *CONFIG_OPTION_SSL_PASSWORD = "launcher.ssl.passwd";
 static const std::string CONFIG_DEFAULT_SSL_PASSWORD;
+static const char *CONFIG_OPTION_SSL_KTLS = "launcher.ssl.ktls";
+static const bool CONFIG_DEFAULT_SSL_KTLS = false;
+static const char *CONFIG_OPTION_SSL_SESSION_CACHE_SIZE = "launcher.ssl.session_cache_size";
+static const LUA_INTEGER CONFIG_DEFAULT_SSL_SESSION_CACHE_SIZE = SSL_SESSION_CACHE_MAX_SIZE_DEFAULT;
+static const char *CONFIG_OPTION_SSL_TICKET_KEY_LIFETIME = "launcher.ssl.ticket_key_lifetime";
+static const LUA_INTEGER CONFIG_DEFAULT_SSL_TICKET_KEY_LIFETIME = 3600;
+static const char *CONFIG_OPTION_UNIX = "launcher.unix";
+static const char *CONFIG_OPTION_UNIX_PATH = "launcher.unix.path";
+static const char *CONFIG_OPTION_UNIX_TRUST_OWNER = "launcher.unix.trust_owner";
+static const bool CONFIG_DEFAULT_UNIX_TRUST_OWNER = false;
 
 void load_config(LauncherConfig &config) {
     if (!std::filesystem::is_regular_file(CONFIG_FILE)) throw std::invalid_argument("nonexistent config file");
@@ -150,6 +195,17 @@ void load_config(LauncherConfig &config) {
                                                        &CONFIG_DEFAULT_NET_BUFFER_SIZE);
     config.data_buffer_size = global_get_config_integer(state, CONFIG_OPTION_DATA_BUFFER_SIZE,
                                                         &CONFIG_DEFAULT_DATA_BUFFER_SIZE);
+    config.io_model = global_get_config_string(state, CONFIG_OPTION_IO_MODEL, &CONFIG_DEFAULT_IO_MODEL);
+    if (config.io_model != CLOUD_IO_MODEL_THREADS && config.io_model != CLOUD_IO_MODEL_EPOLL) {
+        lua_close(state);
+        throw std::invalid_argument(std::string("invalid config: ") + CONFIG_OPTION_IO_MODEL + " must be '" +
+                                    CLOUD_IO_MODEL_THREADS + "' or '" + CLOUD_IO_MODEL_EPOLL + "'");
+    }
+    config.event_loops = global_get_config_integer(state, CONFIG_OPTION_EVENT_LOOPS, &CONFIG_DEFAULT_EVENT_LOOPS);
+    config.request_workers = global_get_config_integer(state, CONFIG_OPTION_REQUEST_WORKERS,
+                                                       &CONFIG_DEFAULT_REQUEST_WORKERS);
+    config.node_cache_size = global_get_config_integer(state, CONFIG_OPTION_NODE_CACHE_SIZE,
+                                                       &CONFIG_DEFAULT_NODE_CACHE_SIZE);
 
     global_get_config_option(state, CONFIG_OPTION_LAUNCHER);
     if (lua_isnil(state, lua_gettop(state))) {
@@ -159,6 +215,8 @@ void load_config(LauncherConfig &config) {
     }
 
     config.server_port = global_get_config_integer(state, CONFIG_OPTION_SERVER_PORT, &CONFIG_DEFAULT_SERVER_PORT);
+    config.acceptors = global_get_config_integer(state, CONFIG_OPTION_ACCEPTORS, &CONFIG_DEFAULT_ACCEPTORS);
+    if (config.acceptors == 0) config.acceptors = std::max(1u, std::thread::hardware_concurrency());
     global_get_config_option(state, CONFIG_OPTION_SSL);
     config.ssl = !lua_isnil(state, lua_gettop(state));
     lua_pop(state, 1);
@@ -166,6 +224,24 @@ void load_config(LauncherConfig &config) {
         config.ssl_cert_path = global_get_config_string(state, CONFIG_OPTION_SSL_CERT);
         config.ssl_key_path = global_get_config_string(state, CONFIG_OPTION_SSL_KEY);
         config.ssl_password = global_get_config_string(state, CONFIG_OPTION_SSL_PASSWORD, &CONFIG_DEFAULT_SSL_PASSWORD);
+        config.ssl_ktls = global_get_config_boolean(state, CONFIG_OPTION_SSL_KTLS, &CONFIG_DEFAULT_SSL_KTLS);
+        config.ssl_session_cache_size = global_get_config_integer(state, CONFIG_OPTION_SSL_SESSION_CACHE_SIZE,
+                                                                  &CONFIG_DEFAULT_SSL_SESSION_CACHE_SIZE);
+        config.ssl_ticket_key_lifetime = global_get_config_integer(state, CONFIG_OPTION_SSL_TICKET_KEY_LIFETIME,
+                                                                   &CONFIG_DEFAULT_SSL_TICKET_KEY_LIFETIME);
+    }
+    global_get_config_option(state, CONFIG_OPTION_UNIX);
+    config.unix_socket = !lua_isnil(state, lua_gettop(state));
+    lua_pop(state, 1);
+    if (config.unix_socket) {
+        config.unix_path = global_get_config_string(state, CONFIG_OPTION_UNIX_PATH);
+        config.unix_trust_owner = global_get_config_boolean(state, CONFIG_OPTION_UNIX_TRUST_OWNER,
+                                                            &CONFIG_DEFAULT_UNIX_TRUST_OWNER);
+    }
+    config.io_uring = global_get_config_boolean(state, CONFIG_OPTION_IO_URING, &CONFIG_DEFAULT_IO_URING);
+    if (config.io_uring && config.ssl) {
+        lua_close(state);
+        throw std::invalid_argument(std::string("invalid config: ") + CONFIG_OPTION_IO_URING + " can't be used with SSL");
     }
 
     lua_close(state);
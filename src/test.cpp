@@ -1,7 +1,14 @@
 #include <iostream>
 #include <unistd.h>
 #include <csignal>
-#include "networking_tcp.h"
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <cstring>
+#include "networking_loopback.h"
+#include "networking_unix.h"
 #include "server_config.h"
 #include "cloud_server.h"
 #include "cloud_client.h"
@@ -13,40 +20,56 @@ bool unpack_test_cloud() {
     return !system("bash -c \"tar -xf " TEST_CLOUD_FILE "\"");
 }
 
-TCPServer *tcp_server = nullptr;
+LoopbackServer *loopback_server = nullptr;
 CloudServer *cloud_server = nullptr;
 
-#define TEST_SERVER_PORT 1999
 #define TEST_SERVER_USER "user"
 #define TEST_SERVER_PASS "password"
 #define TEST_SERVER_USER1 "alice"
 #define TEST_SERVER_PASS1 "i_am_alice"
 #define TEST_SERVER_USER2 "bob"
 #define TEST_SERVER_PASS2 "b0b$12345"
+#define TEST_UNIX_SOCKET "cloud9_test.sock"
+#define TEST_UNIX_SOCKET_UNTRUSTED "cloud9_test_untrusted.sock"
 
-void start_test_server() {
-    chdir(TEST_CLOUD_DIR);
+typedef std::function<void(LauncherConfig &)> ConfigTweak;
+
+// serves the test cloud in the current directory over the loopback server and the extra servers,
+// tweak may change the loaded config
+void launch_test_server(const ConfigTweak &tweak = {}, std::vector<NetServer *> extra_servers = {}) {
     LauncherConfig config;
     load_config(config);
-    tcp_server = new TCPServer(TEST_SERVER_PORT);
-    cloud_server = new CloudServer(tcp_server, config);
+    if (tweak) tweak(config);
+    loopback_server = new LoopbackServer();
+    extra_servers.insert(extra_servers.begin(), loopback_server);
+    cloud_server = new CloudServer(extra_servers, config);
+}
+
+void start_test_server(const ConfigTweak &tweak = {}, const std::vector<NetServer *> &extra_servers = {}) {
+    chdir(TEST_CLOUD_DIR);
+    launch_test_server(tweak, extra_servers);
+}
+
+void stop_test_server() {
+    delete cloud_server;
+    delete loopback_server;
 }
 
 
 std::pair<NetConnection *, CloudClient *> connect_test_client(const std::string &login = TEST_SERVER_USER,
                                                               const std::string &pass = TEST_SERVER_PASS) {
-    auto *connection = new TCPConnection("localhost", TEST_SERVER_PORT);
+    auto *connection = loopback_server->connect();
     auto *client = new CloudClient(connection, login, [&pass]() { return pass; });
     return {connection, client};
 }
 
 void cleanup() {
-    delete cloud_server;
-    delete tcp_server;
+    stop_test_server();
     system("bash -c \"rm -rf " TEST_CLOUD_DIR "\"");
 }
 
-#define SIMPLE_TEST_INIT() if (!unpack_test_cloud()) return false; start_test_server(); auto[connection, client] = connect_test_client()
+#define TWEAKED_TEST_INIT(...) if (!unpack_test_cloud()) return false; start_test_server(__VA_ARGS__); auto[connection, client] = connect_test_client()
+#define SIMPLE_TEST_INIT() TWEAKED_TEST_INIT()
 #define SIMPLE_TEST_CLEANUP() delete client; delete connection; cleanup();
 
 bool test_make_node(int, char **) {
@@ -152,11 +175,723 @@ bool test_groups(int, char **) {
     return true;
 }
 
+bool test_pipeline(int, char **) {
+    SIMPLE_TEST_INIT();
+    Node home = client->get_home();
+    std::atomic<bool> ok = true;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < 16; i++) {
+        threads.emplace_back([client = client, home, i, &ok]() {
+            try {
+                for (size_t j = 0; j < 20; j++) {
+                    uint8_t type = (i + j) % 2;
+                    std::string name = "pipeline_" + std::to_string(i) + "_" + std::to_string(j);
+                    Node node = client->make_node(home, name, type);
+                    if (client->get_node_info(node).type != type) ok = false;
+                    if (client->get_node_owner(node) != TEST_SERVER_USER) ok = false;
+                }
+            } catch (...) {
+                ok = false;
+            }
+        });
+    }
+    for (auto &thread : threads) thread.join();
+    size_t count = 0;
+    client->list_directory(home, [&count](std::string name, Node child) {
+        if (name.rfind("pipeline_", 0) == 0) count++;
+    });
+    if (count != 16 * 20) ok = false;
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_async(int, char **) {
+    SIMPLE_TEST_INIT();
+    auto[connection1, client1] = connect_test_client();
+    Node home = client->get_home();
+    std::vector<std::future<Node>> made;
+    for (size_t i = 0; i < 200; i++) {
+        CloudClient *target = i % 2 ? client1 : client;
+        made.push_back(target->make_node_async(home, "async_" + std::to_string(i), i % 2));
+    }
+    std::vector<std::future<NodeInfo>> infos;
+    for (auto &future : made) infos.push_back(client->get_node_info_async(future.get()));
+    bool ok = true;
+    for (size_t i = 0; i < infos.size(); i++) {
+        if (infos[i].get().type != i % 2) ok = false;
+    }
+    if (client->list_directory_async(home).get().size() < 200) ok = false;
+    try {
+        client->make_node_async(home, "async_0", NODE_TYPE_FILE).get();
+        ok = false;
+    } catch (CloudRequestError &error) {}
+    delete client1;
+    delete connection1;
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_workers(int, char **) {
+    TWEAKED_TEST_INIT([](LauncherConfig &config) { config.request_workers = 4; });
+    Node home = client->get_home();
+    Node dir = client->make_node(home, "workers_test", NODE_TYPE_DIRECTORY);
+    bool ok = true;
+    for (size_t round = 0; round < 10; round++) {
+        // the new node must be visible to the read only requests sent after it
+        auto made = client->make_node_async(dir, "node_" + std::to_string(round), NODE_TYPE_FILE);
+        std::vector<std::future<NodeInfo>> infos;
+        for (size_t i = 0; i < 20; i++) infos.push_back(client->get_node_info_async(dir));
+        auto children = client->list_directory_async(dir);
+        auto owner = client->get_node_owner_async(made.get());
+        for (auto &info : infos) if (info.get().type != NODE_TYPE_DIRECTORY) ok = false;
+        if (children.get().size() != round + 1) ok = false;
+        if (owner.get() != TEST_SERVER_USER) ok = false;
+    }
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_batch(int, char **) {
+    SIMPLE_TEST_INIT();
+    Node home = client->get_home();
+    std::string data = "batched file content";
+    CloudBatch batch;
+    auto dir = batch.make_node(home, "batch_test", NODE_TYPE_DIRECTORY);
+    auto file = batch.make_node(dir, "file", NODE_TYPE_FILE);
+    auto fd = batch.fd_open(file, NODE_FD_MODE_WRITE);
+    batch.fd_write(fd, data.size(), data.c_str());
+    batch.fd_close(fd);
+    auto results = client->batch(batch);
+    bool ok = results.size() == batch.count();
+    Node file_node;
+    std::memcpy(&file_node, results[file].data(), sizeof(Node));
+    if (client->get_node_info(file_node).size != data.size()) ok = false;
+    auto read_fd = client->fd_open(file_node, NODE_FD_MODE_READ);
+    char buffer[64];
+    if (std::string(buffer, client->fd_read(read_fd, sizeof buffer, buffer)) != data) ok = false;
+    client->fd_close(read_fd);
+    // the second sub-request fails, so the third one is not executed
+    CloudBatch failing;
+    failing.make_node(home, "batch_test_1", NODE_TYPE_DIRECTORY);
+    failing.make_node(home, "batch_test", NODE_TYPE_DIRECTORY);
+    failing.make_node(home, "batch_test_2", NODE_TYPE_DIRECTORY);
+    try {
+        client->batch(failing);
+        ok = false;
+    } catch (CloudRequestError &error) {
+        if (error.status != REQUEST_ERR_EXISTS) ok = false;
+    }
+    size_t count = 0;
+    client->list_directory(home, [&count](std::string name, Node child) {
+        if (name.rfind("batch_test", 0) == 0) count++;
+    });
+    if (count != 2) ok = false;
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_positioned(int, char **) {
+    SIMPLE_TEST_INIT();
+    Node file = client->make_node(client->get_home(), "positioned_test", NODE_TYPE_FILE);
+    std::string data(100000, ' ');
+    for (char &c : data) c = char('a' + std::rand() % 26);
+    auto fd = client->fd_open(file, NODE_FD_MODE_WRITE);
+    client->fd_write_long(fd, data.size(), data.c_str(), [&data]() { return uint32_t(data.size()); });
+    client->fd_pwrite(fd, 10, 5, "01234");
+    data.replace(10, 5, "01234");
+    client->fd_close(fd);
+    fd = client->fd_open(file, NODE_FD_MODE_READ);
+    bool ok = true;
+    char buffer[1000];
+    // reads at different offsets in any order don't affect each other
+    for (uint64_t offset : {uint64_t(50000), uint64_t(0), uint64_t(99500), uint64_t(7)}) {
+        uint32_t read = client->fd_pread(fd, offset, sizeof buffer, buffer);
+        if (std::string(buffer, read) != data.substr(offset, sizeof buffer)) ok = false;
+    }
+    std::string tail;
+    client->fd_pread_long(fd, data.size() - 30000, 30000, buffer, sizeof buffer, [&](uint32_t read) {
+        tail.append(buffer, read);
+    });
+    if (tail != data.substr(data.size() - 30000)) ok = false;
+    // the fd position is still at the start
+    uint32_t read = client->fd_read(fd, 20, buffer);
+    if (std::string(buffer, read) != data.substr(0, 20)) ok = false;
+    // offset + count wraps around for the second one
+    for (auto[offset, count] : {std::pair(uint64_t(data.size() - 10), uint64_t(20)),
+                                std::pair(uint64_t(-10), uint64_t(20))}) {
+        try {
+            client->fd_pread_long(fd, offset, count, buffer, sizeof buffer, [](uint32_t) {});
+            ok = false;
+        } catch (CloudRequestError &error) {
+            if (error.status != REQUEST_ERR_END_OF_FILE) ok = false;
+        }
+    }
+    read = client->fd_read(fd, 20, buffer);
+    if (std::string(buffer, read) != data.substr(20, 20)) ok = false;
+    client->fd_close(fd);
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_resume(int, char **) {
+    SIMPLE_TEST_INIT();
+    Node file = client->make_node(client->get_home(), "resume_test", NODE_TYPE_FILE);
+    std::string data = "the first part, the second part";
+    auto fd = client->fd_open(file, NODE_FD_MODE_WRITE);
+    client->fd_write(fd, 15, data.c_str());
+    client->fd_close(fd);
+    // an interrupted upload continues where the remote file ends
+    uint64_t offset = client->get_node_info(file).size;
+    bool ok = offset == 15;
+    fd = client->fd_open(file, NODE_FD_MODE_WRITE | NODE_FD_MODE_NO_TRUNCATE);
+    client->fd_pwrite_long(fd, offset, data.size() - offset, data.c_str() + offset,
+                           [&]() { return uint32_t(data.size() - offset); });
+    client->fd_close(fd);
+    char buffer[64];
+    fd = client->fd_open(file, NODE_FD_MODE_READ);
+    if (std::string(buffer, client->fd_read(fd, sizeof buffer, buffer)) != data) ok = false;
+    client->fd_close(fd);
+    fd = client->fd_open(file, NODE_FD_MODE_WRITE);
+    client->fd_close(fd);
+    if (client->get_node_info(file).size != 0) ok = false;
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_unix(int, char **) {
+    if (!unpack_test_cloud()) return false;
+    chdir(TEST_CLOUD_DIR);
+    // a path that is not a socket is left alone
+    bool ok = true;
+    std::ofstream(TEST_UNIX_SOCKET) << "not a socket";
+    try {
+        delete new UnixServer(TEST_UNIX_SOCKET, true);
+        ok = false;
+    } catch (std::runtime_error &) {}
+    if (access(TEST_UNIX_SOCKET, F_OK) != 0) ok = false;
+    unlink(TEST_UNIX_SOCKET);
+    auto *unix_server = new UnixServer(TEST_UNIX_SOCKET, true);
+    auto *untrusted_server = new UnixServer(TEST_UNIX_SOCKET_UNTRUSTED, false);
+    launch_test_server({}, {unix_server, untrusted_server});
+    // the test runs as the server owner, so the password is not checked
+    auto *connection = new UnixConnection(TEST_UNIX_SOCKET);
+    auto *client = new CloudClient(connection, TEST_SERVER_USER1, []() { return std::string(); });
+    if (client->get_node_owner(client->get_home()) != TEST_SERVER_USER1) ok = false;
+    delete client;
+    delete connection;
+    auto *untrusted_connection = new UnixConnection(TEST_UNIX_SOCKET_UNTRUSTED);
+    try {
+        delete new CloudClient(untrusted_connection, TEST_SERVER_USER1, []() { return std::string(); });
+        ok = false;
+    } catch (CloudInitError &error) {
+        if (error.status != INIT_ERR_AUTH_FAILED) ok = false;
+    }
+    untrusted_connection->close();
+    delete untrusted_connection;
+    cleanup();
+    delete unix_server;
+    delete untrusted_server;
+    return ok;
+}
+
+bool test_striped(int, char **) {
+    SIMPLE_TEST_INIT();
+    Node file = client->make_node(client->get_home(), "striped_test", NODE_TYPE_FILE);
+    std::string data(300001, ' ');
+    for (char &c : data) c = char('a' + std::rand() % 26);
+    std::vector<std::pair<NetConnection *, CloudClient *>> sessions{{connection, client}};
+    for (int i = 0; i < 3; i++) sessions.push_back(connect_test_client());
+    std::vector<CloudClient *> clients;
+    for (auto &session : sessions) clients.push_back(session.second);
+    bool ok = true;
+    // shared writers only admit each other
+    auto fd = client->fd_open(file, NODE_FD_MODE_WRITE | NODE_FD_MODE_SHARED_WRITE);
+    auto shared_fd = clients[1]->fd_open(file, NODE_FD_MODE_WRITE | NODE_FD_MODE_SHARED_WRITE);
+    for (uint8_t mode : {NODE_FD_MODE_WRITE, NODE_FD_MODE_READ}) {
+        try {
+            clients[2]->fd_close(clients[2]->fd_open(file, mode));
+            ok = false;
+        } catch (CloudRequestError &error) {
+            if (error.status != REQUEST_ERR_BUSY) ok = false;
+        }
+    }
+    clients[1]->fd_close(shared_fd);
+    client->fd_close(fd);
+    auto source = [&](uint64_t offset, uint32_t n, char *buffer) {
+        std::memcpy(buffer, data.c_str() + offset, n);
+    };
+    CloudClient::striped_write(clients, file, 0, data.size(), 4096, source);
+    if (client->get_node_info(file).size != data.size()) ok = false;
+    std::string result(data.size(), ' ');
+    CloudClient::striped_read(clients, file, 0, data.size(), 4096, [&](uint64_t offset, uint32_t n, const char *buffer) {
+        std::memcpy(result.data() + offset, buffer, n);
+    });
+    if (result != data) ok = false;
+    // all the stripes are closed, so the file can be opened exclusively again
+    client->fd_close(client->fd_open(file, NODE_FD_MODE_WRITE));
+    // only the stripes before a failed one are known to be written, the file can be cut there and resumed later
+    sessions.back().first->close();
+    uint64_t written = 0;
+    try {
+        CloudClient::striped_write(clients, file, 0, data.size(), 4096, source, &written);
+        ok = false;
+    } catch (std::exception &) {}
+    uint64_t stripe_size = (data.size() + clients.size() - 1) / clients.size();
+    if (written != stripe_size * (clients.size() - 1)) ok = false;
+    fd = client->fd_open(file, NODE_FD_MODE_WRITE | NODE_FD_MODE_NO_TRUNCATE);
+    client->fd_truncate(fd, written);
+    client->fd_close(fd);
+    if (client->get_node_info(file).size != written) ok = false;
+    for (size_t i = 1; i < sessions.size(); i++) {
+        delete sessions[i].second;
+        delete sessions[i].first;
+    }
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_list_plus(int, char **) {
+    SIMPLE_TEST_INIT();
+    Node home = client->get_home();
+    Node dir = client->make_node(home, "list_plus_test", NODE_TYPE_DIRECTORY);
+    Node file = client->make_node(dir, "file", NODE_TYPE_FILE);
+    client->make_node(dir, "subdir", NODE_TYPE_DIRECTORY);
+    auto fd = client->fd_open(file, NODE_FD_MODE_WRITE);
+    client->fd_write(fd, 12, "some content");
+    client->fd_close(fd);
+    client->set_node_rights(file, NODE_RIGHTS_ALL_READ);
+    size_t count = 0;
+    bool ok = true;
+    client->list_directory_plus(dir, [&](const DirectoryEntry &entry) {
+        count++;
+        NodeInfo info = client->get_node_info(entry.node);
+        if (entry.info.type != info.type || entry.info.size != info.size || entry.info.rights != info.rights)
+            ok = false;
+        if (entry.group != client->get_node_group(entry.node)) ok = false;
+        if (entry.owner != TEST_SERVER_USER) ok = false;
+        if (entry.name == "file" && (entry.node != file || entry.info.size != 12)) ok = false;
+    });
+    if (count != 2) ok = false;
+    try {
+        client->list_directory_plus(file, [](const DirectoryEntry &) {});
+        ok = false;
+    } catch (CloudRequestError &error) {
+        if (error.status != REQUEST_ERR_NOT_A_DIRECTORY) ok = false;
+    }
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_paths(int, char **) {
+    SIMPLE_TEST_INIT();
+    Node home = client->get_home();
+    Node a = client->make_node(home, "a", NODE_TYPE_DIRECTORY);
+    Node b = client->make_node(a, "b", NODE_TYPE_DIRECTORY);
+    client->make_node(b, "other", NODE_TYPE_FILE);
+    Node file = client->make_node(b, "file", NODE_TYPE_FILE);
+    bool ok = client->resolve_path(home, "a/b/file") == file;
+    if (client->resolve_path(file, std::string("~") + TEST_SERVER_USER + "/a//b/") != b) ok = false;
+    if (client->resolve_path(b, "../../a/b/..") != a) ok = false;
+    if (client->resolve_path(file, "#" + node2string(a) + "/b") != b) ok = false;
+    if (client->resolve_path(a, "~") != home) ok = false;
+    if (client->get_node_path(file) != std::string("~") + TEST_SERVER_USER + "/a/b/file") ok = false;
+    if (client->get_node_path(home) != std::string("~") + TEST_SERVER_USER) ok = false;
+    for (auto &[path, status] : std::vector<std::pair<std::string, uint16_t>>{
+            {"a/c",         REQUEST_ERR_NOT_FOUND},
+            {"a/b/file/x",  REQUEST_ERR_NOT_A_DIRECTORY},
+            {"~no_such_user", REQUEST_ERR_NOT_FOUND}}) {
+        try {
+            client->resolve_path(home, path);
+            ok = false;
+        } catch (CloudRequestError &error) {
+            if (error.status != status) ok = false;
+        }
+    }
+    // other users can't look into a private directory, even if its entries are readable
+    client->set_node_rights(file, NODE_RIGHTS_ALL_READ);
+    auto[connection1, client1] = connect_test_client(TEST_SERVER_USER1, TEST_SERVER_PASS1);
+    try {
+        client1->resolve_path(client1->get_home(), std::string("~") + TEST_SERVER_USER + "/a/b/file");
+        ok = false;
+    } catch (CloudRequestError &error) {
+        if (error.status != REQUEST_ERR_FORBIDDEN) ok = false;
+    }
+    if (client1->get_node_path(file) != std::string("~") + TEST_SERVER_USER + "/?/?/?") ok = false;
+    client->set_node_rights(b, NODE_RIGHTS_ALL_READ);
+    if (client1->get_node_path(file) != std::string("~") + TEST_SERVER_USER + "/?/?/file") ok = false;
+    delete client1;
+    delete connection1;
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_trees(int, char **) {
+    SIMPLE_TEST_INIT();
+    Node home = client->get_home();
+    Node tree = client->make_node(home, "tree", NODE_TYPE_DIRECTORY);
+    client->make_node(tree, "f1", NODE_TYPE_FILE);
+    Node d1 = client->make_node(tree, "d1", NODE_TYPE_DIRECTORY);
+    Node f2 = client->make_node(d1, "f2", NODE_TYPE_FILE);
+    Node d2 = client->make_node(d1, "d2", NODE_TYPE_DIRECTORY);
+    Node f3 = client->make_node(d2, "f3", NODE_TYPE_FILE);
+    auto fd = client->fd_open(f3, NODE_FD_MODE_WRITE);
+    client->fd_write(fd, 7, "content");
+    client->fd_close(fd);
+    // more nodes than a tree request handles in one go
+    Node many = client->make_node(tree, "many", NODE_TYPE_DIRECTORY);
+    CloudBatch batch;
+    for (size_t i = 0; i < TREE_LOCK_STEPS + 44; i++) batch.make_node(many, "f" + std::to_string(i), NODE_TYPE_FILE);
+    client->batch(batch);
+    size_t nodes = 7 + TREE_LOCK_STEPS + 44;
+    auto[copy, copied] = client->copy_tree(tree, "tree_copy");
+    bool ok = copied.done == nodes && copied.failed == 0;
+    Node f3_copy = client->resolve_path(copy, "d1/d2/f3");
+    if (f3_copy == f3) ok = false;
+    if (client->get_node_path(f3_copy) != std::string("~") + TEST_SERVER_USER + "/tree_copy/d1/d2/f3") ok = false;
+    char buffer[16];
+    fd = client->fd_open(f3_copy, NODE_FD_MODE_READ);
+    if (std::string(buffer, client->fd_read(fd, sizeof buffer, buffer)) != "content") ok = false;
+    client->fd_close(fd);
+    std::vector<std::string> names, copy_names;
+    client->list_directory(tree, [&names](const std::string &name, Node) { names.push_back(name); });
+    client->list_directory(copy, [&copy_names](const std::string &name, Node) { copy_names.push_back(name); });
+    if (names != copy_names) ok = false;
+    // an open file and its ancestors stay, everything else goes
+    fd = client->fd_open(f2, NODE_FD_MODE_READ);
+    try {
+        client->remove_node(f2);
+        ok = false;
+    } catch (CloudRequestError &error) {
+        if (error.status != REQUEST_ERR_BUSY) ok = false;
+    }
+    TreeResult removed = client->remove_tree(tree);
+    if (removed.done != nodes - 3 || removed.failed != 3 || removed.failures.size() != 3) ok = false;
+    for (auto &[node, status] : removed.failures) {
+        if (node == f2 && status != REQUEST_ERR_BUSY) ok = false;
+        if (node != f2 && node != d1 && node != tree) ok = false;
+    }
+    client->fd_close(fd);
+    removed = client->remove_tree(tree);
+    if (removed.done != 3 || removed.failed != 0) ok = false;
+    if (client->remove_tree(copy).done != nodes) ok = false;
+    size_t children = 0;
+    client->list_directory(home, [&children](const std::string &, Node) { children++; });
+    if (children != 0) ok = false;
+    try {
+        client->remove_tree(home);
+        ok = false;
+    } catch (CloudRequestError &error) {
+        if (error.status != REQUEST_ERR_FORBIDDEN) ok = false;
+    }
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_node_cache(int, char **) {
+    // a single entry per shard, so that heads are evicted all the time
+    TWEAKED_TEST_INIT([](LauncherConfig &config) { config.node_cache_size = NODE_CACHE_SHARDS; });
+    Node home = client->get_home();
+    Node dir = client->make_node(home, "cache_dir", NODE_TYPE_DIRECTORY);
+    Node file = client->make_node(dir, "cache_file", NODE_TYPE_FILE);
+    NodeCacheStats before = cloud_server->get_node_cache_stats();
+    client->get_node_info(file);
+    client->get_node_info(file);
+    NodeCacheStats after = cloud_server->get_node_cache_stats();
+    bool ok = after.hits > before.hits && after.size <= NODE_CACHE_SHARDS;
+    // every change of a head must be visible at once, whether the head was cached or evicted
+    client->set_node_rights(file, NODE_RIGHTS_ALL_READ);
+    if (client->get_node_info(file).rights != NODE_RIGHTS_ALL_READ) ok = false;
+    auto[connection1, client1] = connect_test_client(TEST_SERVER_USER1, TEST_SERVER_PASS1);
+    client1->group_invite(TEST_SERVER_USER);
+    client->set_node_group(file, TEST_SERVER_USER1);
+    if (client->get_node_group(file) != TEST_SERVER_USER1) ok = false;
+    client->move_node(file, home);
+    Node parent;
+    if (!client->get_parent(file, &parent) || parent != home) ok = false;
+    client->remove_node(file);
+    try {
+        client->get_node_info(file);
+        ok = false;
+    } catch (CloudRequestError &error) {
+        if (error.status != REQUEST_ERR_NOT_FOUND) ok = false;
+    }
+    if (cloud_server->get_node_cache_stats().size > NODE_CACHE_SHARDS) ok = false;
+    delete client1;
+    delete connection1;
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_register(int, char **) {
+    SIMPLE_TEST_INIT();
+    {
+        std::ofstream invites_file("invites.txt");
+        invites_file << "test_invite" << std::endl;
+    }
+    auto *connection1 = loopback_server->connect();
+    auto *client1 = new CloudClient(connection1, "carol", []() { return std::string("test_invite"); },
+                                    []() { return std::string("carol_pass"); });
+    // the owner of the new home is known without a restart, and the old homes keep theirs
+    Node home = client1->get_home();
+    bool ok = client1->get_node_owner(home) == "carol";
+    Node dir = client1->make_node(home, "register_dir", NODE_TYPE_DIRECTORY);
+    Node file = client1->make_node(dir, "register_file", NODE_TYPE_FILE);
+    if (client1->get_node_owner(file) != "carol") ok = false;
+    if (client->get_node_owner(client->get_home()) != TEST_SERVER_USER) ok = false;
+    if (client->get_node_owner(client->get_home(TEST_SERVER_USER2)) != TEST_SERVER_USER2) ok = false;
+    delete client1;
+    delete connection1;
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_owners(int, char **) {
+    SIMPLE_TEST_INIT();
+    Node home = client->get_home();
+    Node top = client->make_node(home, "owners_top", NODE_TYPE_DIRECTORY);
+    Node deep = top;
+    for (size_t level = 0; level < 16; level++) {
+        deep = client->make_node(deep, "level_" + std::to_string(level), NODE_TYPE_DIRECTORY);
+    }
+    Node file = client->make_node(deep, "owners_file", NODE_TYPE_FILE);
+    bool ok = client->get_node_owner(file) == TEST_SERVER_USER && client->get_node_owner(deep) == TEST_SERVER_USER;
+    // a move within the home keeps the owners, a move to another home changes the owner of the whole subtree
+    Node side = client->make_node(home, "owners_side", NODE_TYPE_DIRECTORY);
+    client->move_node(top, side);
+    if (client->get_node_owner(file) != TEST_SERVER_USER) ok = false;
+    auto[connection1, client1] = connect_test_client(TEST_SERVER_USER1, TEST_SERVER_PASS1);
+    Node home1 = client1->get_home();
+    client1->set_node_rights(home1, NODE_RIGHTS_ALL_WRITE);
+    client->move_node(top, home1);
+    if (client->get_node_owner(file) != TEST_SERVER_USER1) ok = false;
+    if (client->get_node_owner(deep) != TEST_SERVER_USER1) ok = false;
+    if (client->get_node_owner(side) != TEST_SERVER_USER) ok = false;
+    client1->remove_node(file);
+    try {
+        client->get_node_owner(file);
+        ok = false;
+    } catch (CloudRequestError &error) {
+        if (error.status != REQUEST_ERR_NOT_FOUND) ok = false;
+    }
+    delete client1;
+    delete connection1;
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_users(int, char **) {
+    SIMPLE_TEST_INIT();
+    auto[connection1, client1] = connect_test_client(TEST_SERVER_USER1, TEST_SERVER_PASS1);
+    client1->group_invite(TEST_SERVER_USER);
+    client1->group_invite(TEST_SERVER_USER2);
+    client1->group_kick(TEST_SERVER_USER2);
+    Node dir = client1->make_node(client1->get_home(), "users_dir", NODE_TYPE_DIRECTORY);
+    client1->set_node_rights(dir, NODE_RIGHTS_GROUP_READ | NODE_RIGHTS_GROUP_WRITE);
+    // a member may write to the directory right away, without a restart
+    bool ok = true;
+    try {
+        client->make_node(dir, "member_file", NODE_TYPE_FILE);
+    } catch (CloudRequestError &error) {
+        ok = false;
+    }
+    delete client1;
+    delete connection1;
+    delete client;
+    delete connection;
+    // the memberships must survive a restart, as they are read back from the user files
+    stop_test_server();
+    launch_test_server();
+    std::tie(connection, client) = connect_test_client();
+    auto[connection2, client2] = connect_test_client(TEST_SERVER_USER2, TEST_SERVER_PASS2);
+    std::vector<std::string> groups;
+    client->group_list([&groups](const std::string &group) { groups.push_back(group); });
+    if (groups != std::vector<std::string>{TEST_SERVER_USER1}) ok = false;
+    size_t count = 0;
+    client2->group_list([&count](const std::string &) { count++; });
+    if (count != 0) ok = false;
+    try {
+        client2->make_node(dir, "stranger_file", NODE_TYPE_FILE);
+        ok = false;
+    } catch (CloudRequestError &error) {
+        if (error.status != REQUEST_ERR_FORBIDDEN) ok = false;
+    }
+    delete client2;
+    delete connection2;
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+// appends a request frame to data, as the client would send it
+void append_request(std::string &data, uint32_t id, uint16_t cmd, const std::string &body) {
+    char header[REQUEST_HEADER_LENGTH];
+    buf_send_uint32(header, id);
+    buf_send_uint16(header + sizeof(uint32_t), cmd);
+    buf_send_uint64(header + sizeof(uint32_t) + sizeof(uint16_t), body.size());
+    data.append(header, REQUEST_HEADER_LENGTH);
+    data += body;
+}
+
+// the header and auth request the client starts with, for connections that bypass CloudClient
+std::string login_frames() {
+    std::string data(CLOUD9_HEADER, CLOUD9_HEADER_LENGTH);
+    char init[sizeof(uint16_t) + INIT_HEADER_LENGTH + sizeof(uint8_t)];
+    buf_send_uint16(init, CLOUD9_REL_CODE);
+    buf_send_uint16(init + sizeof(uint16_t), INIT_CMD_AUTH);
+    buf_send_uint64(init + sizeof(uint16_t) * 2,
+                    sizeof(uint8_t) + strlen(TEST_SERVER_USER) + strlen(TEST_SERVER_PASS));
+    init[sizeof init - 1] = char(strlen(TEST_SERVER_USER));
+    data.append(init, sizeof init);
+    data += TEST_SERVER_USER TEST_SERVER_PASS;
+    return data;
+}
+
+// sends changing and read only requests without waiting for any of them
+bool pipeline_requests(CloudClient *client, Node dir, const std::string &prefix) {
+    std::vector<std::future<Node>> made;
+    std::vector<std::future<NodeInfo>> infos;
+    for (size_t i = 0; i < 50; i++) {
+        made.push_back(client->make_node_async(dir, prefix + std::to_string(i), NODE_TYPE_FILE));
+        infos.push_back(client->get_node_info_async(dir));
+    }
+    bool ok = true;
+    std::vector<std::future<std::string>> owners;
+    for (auto &node : made) owners.push_back(client->get_node_owner_async(node.get()));
+    for (auto &owner : owners) if (owner.get() != TEST_SERVER_USER) ok = false;
+    for (auto &info : infos) if (info.get().type != NODE_TYPE_DIRECTORY) ok = false;
+    return ok;
+}
+
+// all the sessions share a single event loop, which watches the eventfds of the loopback connections,
+// so a transfer or a client that doesn't read must not hold up the others
+bool run_epoll_test(size_t request_workers) {
+    TWEAKED_TEST_INIT([request_workers](LauncherConfig &config) {
+        config.io_model = CLOUD_IO_MODEL_EPOLL;
+        config.event_loops = 1;
+        config.request_workers = request_workers;
+    });
+    Node home = client->get_home();
+    bool ok = pipeline_requests(client, home, "epoll_");
+    Node file = client->make_node(home, "epoll_test", NODE_TYPE_FILE);
+    std::string data(1000000, ' ');
+    for (char &c : data) c = char('a' + std::rand() % 26);
+    auto fd = client->fd_open(file, NODE_FD_MODE_WRITE);
+    client->fd_write_long(fd, data.size(), data.c_str(), [&data]() { return uint32_t(data.size()); });
+    client->fd_close(fd);
+    // the responses are many times larger than the loopback ring, so they wait for the ring to be read
+    fd = client->fd_open(file, NODE_FD_MODE_READ);
+    std::vector<std::string> blocks(20, std::string(50000, '\0'));
+    std::vector<std::future<uint32_t>> reads;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        reads.push_back(client->fd_pread_async(fd, i * 50000, 50000, blocks[i].data()));
+    }
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (reads[i].get() != 50000 || blocks[i] != data.substr(i * 50000, 50000)) ok = false;
+    }
+    auto[other_connection, other] = connect_test_client();
+    // the transfer stalls until the other client is done
+    std::string read_back;
+    char buffer[65536];
+    bool served = false;
+    client->fd_read_long(fd, data.size(), buffer, sizeof buffer, [&](uint32_t read) {
+        if (!served) {
+            served = true;
+            if (!pipeline_requests(other, home, "epoll_other_")) ok = false;
+        }
+        read_back.append(buffer, read);
+    });
+    if (read_back != data) ok = false;
+    client->fd_close(fd);
+    // a client that never reads its responses fills the ring and makes the server stop reading its requests
+    auto *stalled = loopback_server->connect();
+    std::string requests = login_frames();
+    for (uint32_t id = 0; id < 10000; id++) {
+        append_request(requests, id, REQUEST_CMD_GET_NODE_INFO,
+                       std::string(reinterpret_cast<const char *>(&home), sizeof(Node)));
+    }
+    std::thread sender([stalled, &requests]() {
+        try {
+            send_exact(stalled, requests.size(), requests.c_str());
+        } catch (std::exception &) {}
+    });
+    if (!pipeline_requests(other, home, "epoll_stalled_")) ok = false;
+    stalled->close();
+    sender.join();
+    delete stalled;
+    if (client->get_node_info(file).size != data.size()) ok = false;
+    delete other;
+    delete other_connection;
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
+bool test_epoll(int, char **) {
+    return run_epoll_test(0);
+}
+
+bool test_epoll_workers(int, char **) {
+    return run_epoll_test(2);
+}
+
+// CloudBatch has no way to add a long running request, so the batch is framed by hand;
+// the server must refuse it instead of copying the tree on the event loop
+bool test_epoll_batch(int, char **) {
+    TWEAKED_TEST_INIT([](LauncherConfig &config) {
+        config.io_model = CLOUD_IO_MODEL_EPOLL;
+        config.event_loops = 1;
+    });
+    Node home = client->get_home();
+    Node dir = client->make_node(home, "epoll_batch_test", NODE_TYPE_DIRECTORY);
+    client->make_node(dir, "file", NODE_TYPE_FILE);
+    std::string entry_body(reinterpret_cast<const char *>(&dir), sizeof(Node));
+    entry_body += "epoll_batch_copy";
+    char entry[BATCH_ENTRY_HEADER_LENGTH];
+    buf_send_uint16(entry, REQUEST_CMD_COPY_TREE);
+    entry[sizeof(uint16_t)] = 0;
+    buf_send_uint64(entry + sizeof(uint16_t) + sizeof(uint8_t), entry_body.size());
+    std::string requests = login_frames();
+    append_request(requests, 1, REQUEST_CMD_BATCH, std::string(entry, BATCH_ENTRY_HEADER_LENGTH) + entry_body);
+    auto *raw = loopback_server->connect();
+    send_exact(raw, requests.size(), requests.c_str());
+    char server_header[CLOUD9_FULL_HEADER_LENGTH];
+    read_exact(raw, CLOUD9_FULL_HEADER_LENGTH, server_header);
+    bool ok = read_uint16(raw) == INIT_OK;
+    ok = read_uint32(raw) == 1 && ok;
+    ok = read_uint16(raw) == REQUEST_OK && ok;
+    ok = read_uint64(raw) == BATCH_RESULT_HEADER_LENGTH && ok;
+    ok = read_uint16(raw) == REQUEST_ERR_NOT_SUPPORTED && ok;
+    ok = read_uint64(raw) == 0 && ok;
+    raw->close();
+    delete raw;
+    client->list_directory(home, [&ok](std::string name, Node child) {
+        if (name == "epoll_batch_copy") ok = false;
+    });
+    SIMPLE_TEST_CLEANUP();
+    return ok;
+}
+
 std::map<std::string, std::function<bool(int, char **)>> tests{ // NOLINT(cert-err58-cpp)
         {"make_node", test_make_node},
         {"homes",     test_homes},
         {"dirs",      test_dirs},
-        {"groups",    test_groups}
+        {"groups",    test_groups},
+        {"pipeline",  test_pipeline},
+        {"async",     test_async},
+        {"workers",   test_workers},
+        {"batch",     test_batch},
+        {"positioned", test_positioned},
+        {"resume",    test_resume},
+        {"striped",   test_striped},
+        {"list_plus", test_list_plus},
+        {"paths",     test_paths},
+        {"trees",     test_trees},
+        {"node_cache", test_node_cache},
+        {"register",  test_register},
+        {"owners",    test_owners},
+        {"users",     test_users},
+        {"epoll",     test_epoll},
+        {"epoll_workers", test_epoll_workers},
+        {"epoll_batch", test_epoll_batch},
+        {"unix",      test_unix}
 };
 
 int main(int argc, char **argv) {